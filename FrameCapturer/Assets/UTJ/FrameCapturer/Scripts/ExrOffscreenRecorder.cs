@@ -16,6 +16,10 @@ namespace UTJ
         public string m_outputFilename = "RenderTarget";
         public int m_beginFrame = 1;
         public int m_endFrame = 100;
+        [Tooltip("ZipS is compact but slow. Zip/PIZ/None are much faster for large or multi-layer captures.")]
+        public fcAPI.fcExrCompression m_compression = fcAPI.fcExrCompression.ZipS;
+        [Tooltip("write only the bounding box of non-transparent (Alpha) or non-black (AnyChannel) pixels.")]
+        public fcAPI.fcExrAutoCrop m_autoCrop = fcAPI.fcExrAutoCrop.None;
         public Shader m_shCopy;
 
         fcAPI.fcEXRContext m_ctx;
@@ -111,6 +115,8 @@ namespace UTJ
 
             // initialize exr context
             fcAPI.fcExrConfig conf = fcAPI.fcExrConfig.default_value;
+            conf.compression = m_compression;
+            conf.auto_crop = m_autoCrop;
             m_ctx = fcAPI.fcExrCreateContext(ref conf);
 
             // initialize render targets
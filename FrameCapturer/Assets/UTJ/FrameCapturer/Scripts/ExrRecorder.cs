@@ -19,6 +19,14 @@ namespace UTJ
         public DataPath m_outputDir = new DataPath(DataPath.Root.CurrentDirectory, "ExrOutput");
         public int m_beginFrame = 1;
         public int m_endFrame = 100;
+        [Tooltip("ZipS is compact but slow. Zip/PIZ/None are much faster for large or multi-layer captures.")]
+        public fcAPI.fcExrCompression m_compression = fcAPI.fcExrCompression.ZipS;
+        [Tooltip("write only the bounding box of non-transparent (Alpha) or non-black (AnyChannel) pixels.")]
+        public fcAPI.fcExrAutoCrop m_autoCrop = fcAPI.fcExrAutoCrop.None;
+        [Tooltip("write all G-buffer elements into one multi-part file (GBuffer_NNNN.exr). each element is a separate part, so readers can load only the ones they need.")]
+        public bool m_multiPart = false;
+        [Tooltip("0: scanline image. >0: tiled image with this tile size.")]
+        public int m_tileSize = 0;
         public Shader m_shCopy;
 
         fcAPI.fcEXRContext m_ctx;
@@ -30,6 +38,7 @@ namespace UTJ
         RenderTexture[] m_gbuffer;
         int[] m_callbacks_fb;
         int[] m_callbacks_gb;
+        int[] m_callbacks_gb_mp; // multi-part. begin + 15 layers + end
 
 
         public override int beginFrame
@@ -63,6 +72,15 @@ namespace UTJ
                 }
                 m_callbacks_gb = null;
             }
+
+            if (m_callbacks_gb_mp != null)
+            {
+                for (int i = 0; i < m_callbacks_gb_mp.Length; ++i)
+                {
+                    fcAPI.fcEraseDeferredCall(m_callbacks_gb_mp[i]);
+                }
+                m_callbacks_gb_mp = null;
+            }
         }
 
         void AddCommandBuffers()
@@ -120,7 +138,41 @@ namespace UTJ
                 }
             }
 
-            if (m_captureGBuffer)
+            if (m_captureGBuffer && m_multiPart)
+            {
+                // callbacks for gbuffer (one multi-part file)
+                if (m_callbacks_gb_mp == null)
+                {
+                    m_callbacks_gb_mp = new int[17];
+                }
+                {
+                    string path = dir + "/GBuffer_" + ext;
+                    var rt = m_gbuffer[0];
+                    int i = 0;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrBeginFrame(m_ctx, path, rt.width, rt.height, m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[0], 0, "Albedo.R", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[0], 1, "Albedo.G", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[0], 2, "Albedo.B", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[0], 3, "Occlusion.R", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[1], 0, "Specular.R", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[1], 1, "Specular.G", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[1], 2, "Specular.B", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[1], 3, "Smoothness.R", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[2], 0, "Normal.R", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[2], 1, "Normal.G", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[2], 2, "Normal.B", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[3], 0, "Emission.R", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[3], 1, "Emission.G", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[3], 2, "Emission.B", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrAddLayerTexture(m_ctx, m_gbuffer[4], 0, "Depth.R", m_callbacks_gb_mp[i]); ++i;
+                    m_callbacks_gb_mp[i] = fcAPI.fcExrEndFrame(m_ctx, m_callbacks_gb_mp[i]); ++i;
+                }
+                for (int i = 0; i < m_callbacks_gb_mp.Length; ++i)
+                {
+                    GL.IssuePluginEvent(fcAPI.fcGetRenderEventFunc(), m_callbacks_gb_mp[i]);
+                }
+            }
+            else if (m_captureGBuffer)
             {
                 // callbacks for gbuffer
                 if (m_callbacks_gb == null)
@@ -225,6 +277,10 @@ namespace UTJ
 
             // initialize exr context
             fcAPI.fcExrConfig conf = fcAPI.fcExrConfig.default_value;
+            conf.compression = m_compression;
+            conf.auto_crop = m_autoCrop;
+            conf.multi_part = m_multiPart;
+            conf.tile_size = m_tileSize;
             m_ctx = fcAPI.fcExrCreateContext(ref conf);
 
             // initialize render targets
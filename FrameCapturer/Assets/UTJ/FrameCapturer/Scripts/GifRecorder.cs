@@ -20,11 +20,20 @@ namespace UTJ
         public DataPath m_outputDir = new DataPath(DataPath.Root.PersistentDataPath, "");
         public int m_resolutionWidth = 300;
         public int m_numColors = 256;
+        public fcAPI.fcGifQuantizer m_quantizer = fcAPI.fcGifQuantizer.NeuQuant;
+        [Tooltip("palette is learned from 1/N of pixels. larger is faster but lower quality")]
+        public int m_quantizeSample = 1;
+        [Tooltip("Ordered is faster than FloydSteinberg as a frame can be processed on all cores")]
+        public fcAPI.fcGifDither m_dither = fcAPI.fcGifDither.FloydSteinberg;
         public FrameRateMode m_frameRateMode = FrameRateMode.Constant;
         [Tooltip("relevant only if FrameRateMode is Constant")]
         public int m_framerate = 30;
         public int m_captureEveryNthFrame = 2;
         public int m_keyframe = 30;
+        [Tooltip("keyframes keep the current palette if it is at most this much worse than when it was made. 0 always makes a new palette")]
+        public float m_paletteReuseThreshold = 0.0f;
+        [Tooltip("keep only the last N frames. 0 is unlimited")]
+        public int m_maxFrames = 0;
         [Tooltip("0 is treated as processor count")]
         public Shader m_shCopy;
 
@@ -48,11 +57,16 @@ namespace UTJ
 
             // initialize context and stream
             {
-                fcAPI.fcGifConfig conf;
+                fcAPI.fcGifConfig conf = fcAPI.fcGifConfig.default_value;
                 conf.width = m_scratch_buffer.width;
                 conf.height = m_scratch_buffer.height;
                 conf.num_colors = Mathf.Clamp(m_numColors, 1, 256);
                 conf.max_active_tasks = 0;
+                conf.quantizer = m_quantizer;
+                conf.quantize_sample = m_quantizeSample;
+                conf.dither = m_dither;
+                conf.max_frames = m_maxFrames;
+                conf.palette_reuse_threshold = m_paletteReuseThreshold;
                 m_ctx = fcAPI.fcGifCreateContext(ref conf);
             }
 
@@ -219,6 +233,9 @@ namespace UTJ
         void OnValidate()
         {
             m_numColors = Mathf.Clamp(m_numColors, 1, 256);
+            m_quantizeSample = Mathf.Max(m_quantizeSample, 1);
+            m_maxFrames = Mathf.Max(m_maxFrames, 0);
+            m_paletteReuseThreshold = Mathf.Max(m_paletteReuseThreshold, 0.0f);
         }
 #endif // UNITY_EDITOR
 
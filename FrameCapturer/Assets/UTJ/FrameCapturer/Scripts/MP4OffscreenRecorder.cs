@@ -27,6 +27,19 @@ namespace UTJ
         public int m_captureEveryNthFrame = 1;
         public int m_videoBitrate = 8192000;
         public int m_audioBitrate = 64000;
+        [Tooltip("software encoder threads. 0 = one per core.")]
+        public int m_encoderThreads = 0;
+        [Tooltip("in frames. 0 = only the first frame is a keyframe.")]
+        public int m_keyframeInterval = 0;
+        public fcAPI.fcMP4Complexity m_encoderComplexity = fcAPI.fcMP4Complexity.Medium;
+        [Tooltip("write fragmented mp4. the file is playable while recording and survives crashes.")]
+        public bool m_fragmented = false;
+        [Tooltip("relevant only if Fragmented is checked. in seconds.")]
+        public float m_fragmentDuration = 2.0f;
+        [Tooltip("put moov at the beginning of the file so that it can be played while downloading.")]
+        public bool m_faststart = false;
+        [Tooltip("keep the last N seconds in memory so that DumpReplay() can write them to a file. 0 = disabled.")]
+        public float m_replayDuration = 0.0f;
         public Shader m_shCopy;
 
         string m_output_file;
@@ -60,8 +73,15 @@ namespace UTJ
                 m_mp4conf.video_max_framerate = 60;
                 m_mp4conf.video_bitrate = m_videoBitrate;
                 m_mp4conf.audio_bitrate = m_audioBitrate;
+                m_mp4conf.video_threads = m_encoderThreads;
+                m_mp4conf.video_keyframe_interval = m_keyframeInterval;
+                m_mp4conf.video_complexity = m_encoderComplexity;
                 m_mp4conf.audio_sampling_rate = AudioSettings.outputSampleRate;
                 m_mp4conf.audio_num_channels = fcAPI.fcGetNumAudioChannels();
+                m_mp4conf.fragmented = m_fragmented;
+                m_mp4conf.fragment_duration = m_fragmentDuration;
+                m_mp4conf.faststart = m_faststart;
+                m_mp4conf.replay_duration = m_replayDuration;
                 m_ctx = fcAPI.fcMP4CreateContext(ref m_mp4conf);
 
                 m_output_file = DateTime.Now.ToString("yyyyMMdd_HHmmss") + ".mp4";
@@ -213,6 +233,24 @@ namespace UTJ
 
         public fcAPI.fcMP4Context GetMP4Context() { return m_ctx; }
 
+        // write the last 'seconds' kept in memory to a new file in the background. returns the path, or null on failure.
+        public string DumpReplay(float seconds)
+        {
+            if (m_ctx.ptr == IntPtr.Zero) { return null; }
+
+            string path = m_outputDir.GetPath();
+            if (path.Length > 0) { path += "/"; }
+            path += DateTime.Now.ToString("yyyyMMdd_HHmmss") + "_replay.mp4";
+
+            bool ret = false;
+            fcAPI.fcGuard(() =>
+            {
+                ret = fcAPI.fcMP4DumpReplayFile(m_ctx, path, seconds);
+            });
+            Debug.Log("MP4OffscreenRecorder.DumpReplay(" + seconds + "): " + path);
+            return ret ? path : null;
+        }
+
 #if UNITY_EDITOR
         void Reset()
         {
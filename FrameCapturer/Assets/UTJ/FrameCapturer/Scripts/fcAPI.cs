@@ -165,9 +165,39 @@ namespace UTJ
         // EXR Exporter
         // -------------------------------------------------------------
 
+        public enum fcExrCompression
+        {
+            Default = -1,
+            None = 0,
+            RLE,
+            ZipS,
+            Zip,
+            PIZ,
+            PXR24,
+            B44,
+            B44A,
+            DWAA,
+            DWAB,
+        };
+
+        public enum fcExrAutoCrop
+        {
+            None,
+            Alpha,
+            AnyChannel,
+        };
+
         public struct fcExrConfig
         {
             public int max_active_tasks;
+            public fcExrCompression compression;
+            public float dwa_compression_level;
+            public int frame_threads;
+            public Bool multi_part;
+            public int tile_size;
+            public Bool borrow_pixels;
+            public Bool store_u8_as_uint;
+            public fcExrAutoCrop auto_crop;
 
             public static fcExrConfig default_value
             {
@@ -176,6 +206,14 @@ namespace UTJ
                     return new fcExrConfig
                     {
                         max_active_tasks = 0,
+                        compression = fcExrCompression.ZipS,
+                        dwa_compression_level = 45.0f,
+                        frame_threads = -1,
+                        multi_part = false,
+                        tile_size = 0,
+                        borrow_pixels = false,
+                        store_u8_as_uint = false,
+                        auto_crop = fcExrAutoCrop.None,
                     };
                 }
             }
@@ -185,7 +223,8 @@ namespace UTJ
         [DllImport ("FrameCapturer")] public static extern fcEXRContext fcExrCreateContext(ref fcExrConfig conf);
         [DllImport ("FrameCapturer")] public static extern void         fcExrDestroyContext(fcEXRContext ctx);
         [DllImport ("FrameCapturer")] private static extern int         fcExrBeginFrameDeferred(fcEXRContext ctx, string path, int width, int height, int id);
-        [DllImport ("FrameCapturer")] private static extern int         fcExrAddLayerTextureDeferred(fcEXRContext ctx, IntPtr tex, fcPixelFormat f, int ch, string name, Bool flipY, int id);
+        [DllImport ("FrameCapturer")] private static extern int         fcExrBeginFrameStreamDeferred(fcEXRContext ctx, fcStream stream, int width, int height, int id);
+        [DllImport ("FrameCapturer")] private static extern int         fcExrAddLayerTextureDeferred(fcEXRContext ctx, IntPtr tex, fcPixelFormat f, int ch, string name, Bool flipY, fcExrCompression compression, int id);
         [DllImport ("FrameCapturer")] private static extern int         fcExrEndFrameDeferred(fcEXRContext ctx, int id);
 
         public static int fcExrBeginFrame(fcEXRContext ctx, string path, int width, int height, int id)
@@ -193,14 +232,19 @@ namespace UTJ
             return fcExrBeginFrameDeferred(ctx, path, width, height, id);
         }
 
+        public static int fcExrBeginFrame(fcEXRContext ctx, fcStream stream, int width, int height, int id)
+        {
+            return fcExrBeginFrameStreamDeferred(ctx, stream, width, height, id);
+        }
+
         public static int fcExrEndFrame(fcEXRContext ctx, int id)
         {
             return fcExrEndFrameDeferred(ctx, id);
         }
 
-        public static int fcExrAddLayerTexture(fcEXRContext ctx, RenderTexture tex, int ch, string name, int id)
+        public static int fcExrAddLayerTexture(fcEXRContext ctx, RenderTexture tex, int ch, string name, int id, fcExrCompression compression = fcExrCompression.Default)
         {
-            return fcExrAddLayerTextureDeferred(ctx, tex.GetNativeTexturePtr(), fcGetPixelFormat(tex.format), ch, name, false, id);
+            return fcExrAddLayerTextureDeferred(ctx, tex.GetNativeTexturePtr(), fcGetPixelFormat(tex.format), ch, name, false, compression, id);
         }
 
 
@@ -208,12 +252,42 @@ namespace UTJ
         // GIF Exporter
         // -------------------------------------------------------------
 
+        public enum fcGifPaletteMapper
+        {
+            Exhaustive,
+            Exact,
+            InverseMap,
+        };
+
+        public enum fcGifQuantizer
+        {
+            NeuQuant,
+            Octree,
+            MedianCut,
+            KMeans,
+        };
+
+        public enum fcGifDither
+        {
+            None,
+            FloydSteinberg,
+            Ordered,
+        };
+
         public struct fcGifConfig
         {
             public int width;
             public int height;
             public int num_colors;
             public int max_active_tasks;
+            public fcGifPaletteMapper palette_mapper;
+            public fcGifQuantizer quantizer;
+            public int quantize_sample;
+            public fcGifDither dither;
+            public Bool delta_frames;
+            public int max_frames;
+            public int max_data_size;
+            public float palette_reuse_threshold;
 
             public static fcGifConfig default_value
             {
@@ -225,6 +299,14 @@ namespace UTJ
                         height = 240,
                         num_colors = 256,
                         max_active_tasks = 0,
+                        palette_mapper = fcGifPaletteMapper.Exact,
+                        quantizer = fcGifQuantizer.NeuQuant,
+                        quantize_sample = 1,
+                        dither = fcGifDither.FloydSteinberg,
+                        delta_frames = true,
+                        max_frames = 0,
+                        max_data_size = 0,
+                        palette_reuse_threshold = 0.0f,
                     };
                 }
             }
@@ -232,6 +314,7 @@ namespace UTJ
         public struct fcGIFContext { public IntPtr ptr; }
 
         [DllImport ("FrameCapturer")] public static extern fcGIFContext fcGifCreateContext(ref fcGifConfig conf);
+        [DllImport ("FrameCapturer")] public static extern fcGIFContext fcGifCreateStreamingContext(ref fcGifConfig conf, fcStream stream);
         [DllImport ("FrameCapturer")] public static extern void         fcGifDestroyContext(fcGIFContext ctx);
         [DllImport ("FrameCapturer")] private static extern int         fcGifAddFrameTextureDeferred(fcGIFContext ctx, IntPtr tex, fcPixelFormat fmt, Bool keyframe, double timestamp, int id);
         [DllImport ("FrameCapturer")] public static extern Bool         fcGifWrite(fcGIFContext ctx, fcStream stream, int begin_frame=0, int end_frame=-1);
@@ -239,6 +322,7 @@ namespace UTJ
         [DllImport ("FrameCapturer")] public static extern void         fcGifClearFrame(fcGIFContext ctx);
         [DllImport ("FrameCapturer")] public static extern int          fcGifGetFrameCount(fcGIFContext ctx);
         [DllImport ("FrameCapturer")] public static extern void         fcGifGetFrameData(fcGIFContext ctx, IntPtr tex, int frame);
+        [DllImport ("FrameCapturer")] public static extern Bool         fcGifGetFramePixels(fcGIFContext ctx, IntPtr pixels, int frame);
         [DllImport ("FrameCapturer")] public static extern int          fcGifGetExpectedDataSize(fcGIFContext ctx, int begin_frame, int end_frame);
         [DllImport ("FrameCapturer")] public static extern void         fcGifEraseFrame(fcGIFContext ctx, int begin_frame, int end_frame);
 
@@ -260,6 +344,27 @@ namespace UTJ
         // MP4 Exporter
         // -------------------------------------------------------------
 
+        public enum fcMP4UsageType
+        {
+            CameraRealtime,
+            ScreenRealtime,
+            CameraNonRealtime,
+        };
+
+        public enum fcMP4Complexity
+        {
+            Low,
+            Medium,
+            High,
+        };
+
+        public enum fcMP4SliceMode
+        {
+            Single,
+            FixedCount,
+            FixedSize,
+        };
+
         public struct fcMP4Config
         {
             public Bool video;
@@ -271,10 +376,24 @@ namespace UTJ
             public int video_bitrate;
             public int video_max_framerate;
             public int video_max_buffers;
+            public int video_threads;
+            public int video_keyframe_interval;
+            public fcMP4UsageType video_usage;
+            public fcMP4Complexity video_complexity;
+            public fcMP4SliceMode video_slice_mode;
+            public int video_slice_count;
+            public int video_slice_size;
             public float audio_scale;
             public int audio_sampling_rate;
             public int audio_num_channels;
             public int audio_bitrate;
+            public Bool fragmented;
+            public float fragment_duration;
+            public Bool faststart;
+            public int moov_reserved_size;
+            public float replay_duration;
+            public int replay_max_bytes;
+            public float replay_keyframe_interval;
 
             public static fcMP4Config default_value
             {
@@ -290,16 +409,55 @@ namespace UTJ
                         video_bitrate = 256000,
                         video_max_framerate = 30,
                         video_max_buffers = 8,
+                        video_threads = 0,
+                        video_keyframe_interval = 0,
+                        video_usage = fcMP4UsageType.ScreenRealtime,
+                        video_complexity = fcMP4Complexity.Medium,
+                        video_slice_mode = fcMP4SliceMode.FixedCount,
+                        video_slice_count = 0,
+                        video_slice_size = 1500,
                         audio_scale = 32767.0f,
                         audio_sampling_rate = 48000,
                         audio_num_channels = 2,
                         audio_bitrate = 64000,
+                        fragmented = false,
+                        fragment_duration = 2.0f,
+                        faststart = false,
+                        moov_reserved_size = 0,
+                        replay_duration = 0.0f,
+                        replay_max_bytes = 0,
+                        replay_keyframe_interval = 1.0f,
                     };
                 }
             }
         };
         public struct fcMP4Context { public IntPtr ptr; }
 
+        public enum fcMP4DropPolicy
+        {
+            Block,
+            DropUntilKeyframe,
+        };
+
+        public struct fcMP4OutputStreamStats
+        {
+            public int queued_frames;
+            public int written_frames;
+            public int dropped_frames;
+            public ulong queued_bytes;
+            public double lag;
+            public double max_lag;
+        };
+
+        public struct fcMP4VideoStats
+        {
+            public int num_frames;
+            public double convert_time;
+            public double convert_wait_time;
+            public double encode_time;
+            public double mux_time;
+        };
+
         [DllImport ("FrameCapturer")] public static extern void             fcMP4SetFAACPackagePath(string path);
         [DllImport ("FrameCapturer")] public static extern Bool             fcMP4DownloadCodecBegin();
         [DllImport ("FrameCapturer")] public static extern fcDownloadState  fcMP4DownloadCodecGetState();
@@ -307,6 +465,12 @@ namespace UTJ
         [DllImport ("FrameCapturer")] public static extern fcMP4Context     fcMP4CreateContext(ref fcMP4Config conf);
         [DllImport ("FrameCapturer")] public static extern void             fcMP4DestroyContext(fcMP4Context ctx);
         [DllImport ("FrameCapturer")] public static extern void             fcMP4AddOutputStream(fcMP4Context ctx, fcStream s);
+        [DllImport ("FrameCapturer")] public static extern void             fcMP4AddOutputStreamWithPolicy(fcMP4Context ctx, fcStream s, fcMP4DropPolicy policy, int max_queued_frames);
+        [DllImport ("FrameCapturer")] public static extern Bool             fcMP4GetOutputStreamStats(fcMP4Context ctx, fcStream s, ref fcMP4OutputStreamStats stats);
+        [DllImport ("FrameCapturer")] public static extern Bool             fcMP4GetVideoStats(fcMP4Context ctx, ref fcMP4VideoStats stats);
+        [DllImport ("FrameCapturer")] public static extern Bool             fcMP4DumpReplay(fcMP4Context ctx, fcStream s, double seconds);
+        [DllImport ("FrameCapturer")] public static extern Bool             fcMP4DumpReplayFile(fcMP4Context ctx, string path, double seconds);
+        [DllImport ("FrameCapturer")] public static extern Bool             fcMP4IsDumpingReplay(fcMP4Context ctx);
         [DllImport ("FrameCapturer")] private static extern IntPtr          fcMP4GetAudioEncoderInfo(fcMP4Context ctx);
         [DllImport ("FrameCapturer")] private static extern IntPtr          fcMP4GetVideoEncoderInfo(fcMP4Context ctx);
         [DllImport ("FrameCapturer")] private static extern int             fcMP4AddVideoFrameTextureDeferred(fcMP4Context ctx, IntPtr tex, fcPixelFormat fmt, double time, int id);
@@ -3,11 +3,19 @@
 #include <half.h>
 #include <ImfRgbaFile.h>
 #include <ImfOutputFile.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfMultiPartOutputFile.h>
+#include <ImfOutputPart.h>
+#include <ImfTiledOutputPart.h>
+#include <ImfPartType.h>
 #include <ImfInputFile.h>
 #include <ImfChannelList.h>
 #include <ImfStringAttribute.h>
 #include <ImfMatrixAttribute.h>
+#include <ImfStandardAttributes.h>
 #include <ImfArray.h>
+#include <ImfIO.h>
+#include <ImfThreading.h>
 #include "fcFoundation.h"
 #include "fcThreadPool.h"
 #include "GraphicsDevice/fcGraphicsDevice.h"
@@ -24,18 +32,185 @@
 
 
 
+static inline Imf::Compression fcExrToImfCompression(fcExrCompression c)
+{
+    if (c < fcExrCompression_None || c > fcExrCompression_DWAB) {
+        return Imf::ZIPS_COMPRESSION;
+    }
+    // fcExrCompression_* have the same values as Imf::*_COMPRESSION
+    return (Imf::Compression)c;
+}
+
+// OpenEXR compresses line buffers on its own global IlmThread pool, which is shared by all contexts.
+// IlmThread 2.2 has no way to run its tasks on fcThreadPool, so the pool is only ever grown (never shrunk
+// while other contexts may be writing) and capped at the core count. the fcThreadPool worker that writes
+// a frame just waits for these tasks, so the two pools don't oversubscribe the cores.
+static void fcExrReserveGlobalThreads(int num_threads)
+{
+    static std::mutex s_mutex;
+    std::unique_lock<std::mutex> lock(s_mutex);
+    num_threads = std::min<int>(num_threads, std::thread::hardware_concurrency());
+    if (num_threads > Imf::globalThreadCount()) {
+        Imf::setGlobalThreadCount(num_threads);
+    }
+}
+
+// Imf::OStream that writes to fcStream.
+// positions are relative to where the stream was when the exr began, so an exr can be appended to a stream that already has data.
+class fcExrOStream : public Imf::OStream
+{
+public:
+    fcExrOStream(BinaryStream& s)
+        : Imf::OStream("fcStream"), m_stream(s), m_base(s.tellp())
+    {}
+
+    void write(const char c[], int n) override
+    {
+        m_stream.write(c, n);
+    }
+
+    Imf::Int64 tellp() override
+    {
+        return m_stream.tellp() - m_base;
+    }
+
+    void seekp(Imf::Int64 pos) override
+    {
+        m_stream.seekp(m_base + (size_t)pos);
+    }
+
+private:
+    BinaryStream& m_stream;
+    size_t m_base;
+};
+
+// "Albedo.R" -> "Albedo", "R" -> "rgba"
+static inline std::string fcExrGetPartName(const char *layer_name)
+{
+    const char *dot = strrchr(layer_name, '.');
+    if (dot == nullptr || dot == layer_name) { return "rgba"; }
+    return std::string(layer_name, dot);
+}
+
+static int fcExrGetScanlinesPerBlock(Imf::Compression c)
+{
+    switch (c) {
+    case Imf::ZIP_COMPRESSION:
+    case Imf::PXR24_COMPRESSION:
+        return 16;
+    case Imf::PIZ_COMPRESSION:
+    case Imf::B44_COMPRESSION:
+    case Imf::B44A_COMPRESSION:
+    case Imf::DWAA_COMPRESSION:
+        return 32;
+    case Imf::DWAB_COMPRESSION:
+        return 256;
+    default:
+        return 1;
+    }
+}
+
+struct fcExrChannelData
+{
+    std::string name;
+    int source; // index of fcExrTaskData::sources
+    int channel;
+    Imf::PixelType type;
+};
+
+struct fcExrPartData
+{
+    std::string name;
+    Imf::Header header;
+    std::vector<fcExrChannelData> channels;
+
+    fcExrPartData(const std::string& n, int w, int h, const fcExrConfig& conf)
+        : name(n), header(w, h)
+    {
+        setCompression(conf.compression, conf.dwa_compression_level);
+        if (conf.tile_size > 0) {
+            header.setTileDescription(Imf::TileDescription(conf.tile_size, conf.tile_size, Imf::ONE_LEVEL));
+        }
+        if (conf.multi_part) {
+            header.setName(name);
+            header.setType(conf.tile_size > 0 ? Imf::TILEDIMAGE : Imf::SCANLINEIMAGE);
+        }
+    }
+
+    void setCompression(fcExrCompression c, float dwa_level)
+    {
+        header.compression() = fcExrToImfCompression(c);
+        if (c == fcExrCompression_DWAA || c == fcExrCompression_DWAB) {
+            Imf::addDwaCompressionLevel(header, dwa_level);
+        }
+    }
+};
+
+// pixels of a layer source (texture or pixel pointer) as they were given.
+// each source is read back / copied only once per frame regardless of how many channels refer it.
+// u8 and flipped sources are converted / flipped a few scanlines at a time on the writer (see buildFrameBuffer()).
+struct fcExrLayerSource
+{
+    const void *key;
+    fcPixelFormat fmt;
+    bool flipY;
+    char *data; // points to fcExrTaskData::pixels or borrowed pixels
+
+    bool needsConversion() const { return flipY || (fmt & fcPixelFormat_TypeMask) == fcPixelFormat_Type_u8; }
+};
+
 struct fcExrTaskData
 {
     std::string path;
+    fcStream *stream;
+    int stream_seq;
+    std::ostringstream encoded; // used when stream is set
     int width, height;
+    Imath::Box2i roi; // data window is cropped to this
     std::list<Buffer> pixels;
-    Imf::Header header;
-    Imf::FrameBuffer frame_buffer;
+    std::vector<fcExrLayerSource> sources;
+    std::list<fcExrPartData> parts;
+    fcExrFrameCallback callback;
+    void *callback_userdata;
+
+    fcExrTaskData(const char *p, fcStream *s, int seq, int w, int h, const fcExrRegion *r)
+        : path(p ? p : ""), stream(s), stream_seq(seq), width(w), height(h)
+        , roi(Imath::V2i(0, 0), Imath::V2i(w - 1, h - 1))
+        , callback(), callback_userdata()
+    {
+        if (r && r->width > 0 && r->height > 0) {
+            roi.min.x = std::max<int>(roi.min.x, r->x);
+            roi.min.y = std::max<int>(roi.min.y, r->y);
+            roi.max.x = std::min<int>(roi.max.x, r->x + r->width - 1);
+            roi.max.y = std::min<int>(roi.max.y, r->y + r->height - 1);
+        }
+    }
+
+    int findSource(const void *key, fcPixelFormat fmt, bool flipY)
+    {
+        for (size_t i = 0; i < sources.size(); ++i) {
+            auto& src = sources[i];
+            if (src.key == key && src.fmt == fmt && src.flipY == flipY) { return (int)i; }
+        }
+        return -1;
+    }
 
-    fcExrTaskData(const char *p, int w, int h)
-        : path(p), width(w), height(h), header(w, h)
+    // pixels of the source can be shared regardless of flipY
+    char* findSourceData(const void *key, fcPixelFormat fmt)
     {
-        header.compression() = Imf::ZIPS_COMPRESSION;
+        for (auto& src : sources) {
+            if (src.key == key && src.fmt == fmt) { return src.data; }
+        }
+        return nullptr;
+    }
+
+    fcExrPartData& getPart(const std::string& name, const fcExrConfig& conf)
+    {
+        for (auto& part : parts) {
+            if (part.name == name) { return part; }
+        }
+        parts.emplace_back(name, width, height, conf);
+        return parts.back();
     }
 };
 
@@ -45,14 +220,22 @@ public:
     fcExrContext(const fcExrConfig& conf, fcIGraphicsDevice *dev);
     ~fcExrContext();
     void release() override;
-    bool beginFrame(const char *path, int width, int height) override;
-    bool addLayerTexture(void *tex, fcPixelFormat fmt, int channel, const char *name, bool flipY) override;
-    bool addLayerPixels(const void *pixels, fcPixelFormat fmt, int channel, const char *name, bool flipY) override;
-    bool endFrame() override;
+    bool beginFrame(const char *path, int width, int height, const fcExrRegion *roi) override;
+    bool beginFrameStream(fcStream *stream, int width, int height, const fcExrRegion *roi) override;
+    bool addLayerTexture(void *tex, fcPixelFormat fmt, int channel, const char *name, bool flipY, fcExrCompression compression) override;
+    bool addLayerPixels(const void *pixels, fcPixelFormat fmt, int channel, const char *name, bool flipY, fcExrCompression compression) override;
+    bool endFrame(fcExrFrameCallback callback, void *userdata) override;
 
 private:
-    bool addLayerImpl(char *pixels, fcPixelFormat fmt, int channel, const char *name);
+    bool addLayerImpl(int source, int channel, const char *name, fcExrCompression compression);
+    bool beginFrameImpl(const char *path, fcStream *stream, int width, int height, const fcExrRegion *roi);
     void endFrameTask(fcExrTaskData *exr);
+    Imath::Box2i computeDataWindow(fcExrTaskData *exr);
+    template<class Target> void writeFrame(Target& target, fcExrTaskData *exr);
+    template<class Output> void writeScanlinePart(Output& out, fcExrTaskData *exr, fcExrPartData& part);
+    template<class Output> void writeTiledPart(Output& out, fcExrTaskData *exr, fcExrPartData& part);
+    void buildFrameBuffer(Imf::FrameBuffer& fb, fcExrTaskData *exr, fcExrPartData& part, std::vector<Buffer>& chunks, int y, int num_lines);
+    void flushStreamFrame(fcExrTaskData *exr);
 
 private:
     fcExrConfig m_conf;
@@ -61,9 +244,11 @@ private:
     fcTaskGroup m_tasks;
     std::atomic_int m_active_task_count;
 
-    const void *m_frame_prev;
-    Buffer *m_src_prev;
-    fcPixelFormat m_fmt_prev;
+    // frames written to fcStream are encoded in parallel and then written to the stream in the order they were submitted
+    std::mutex m_stream_mutex;
+    std::map<int, fcExrTaskData*> m_stream_frames;
+    int m_stream_seq_submitted;
+    int m_stream_seq_written;
 };
 
 
@@ -72,14 +257,20 @@ fcExrContext::fcExrContext(const fcExrConfig& conf, fcIGraphicsDevice *dev)
     , m_dev(dev)
     , m_task(nullptr)
     , m_active_task_count(0)
-    , m_frame_prev(nullptr)
-    , m_src_prev(nullptr)
-    , m_fmt_prev()
+    , m_stream_seq_submitted(0)
+    , m_stream_seq_written(0)
 {
     m_conf = conf;
     if (m_conf.max_active_tasks <= 0) {
         m_conf.max_active_tasks = std::thread::hardware_concurrency();
     }
+    // split cores between frames (max_active_tasks) and scanline blocks within a frame (frame_threads)
+    if (m_conf.frame_threads < 0) {
+        m_conf.frame_threads = std::max<int>(std::thread::hardware_concurrency() / m_conf.max_active_tasks, 1);
+    }
+    if (m_conf.frame_threads > 0) {
+        fcExrReserveGlobalThreads(m_conf.frame_threads * m_conf.max_active_tasks);
+    }
 }
 
 fcExrContext::~fcExrContext()
@@ -93,12 +284,37 @@ void fcExrContext::release()
     delete this;
 }
 
-bool fcExrContext::beginFrame(const char *path, int width, int height)
+bool fcExrContext::beginFrame(const char *path, int width, int height, const fcExrRegion *roi)
+{
+    if (path == nullptr) {
+        fcDebugLog("fcExrContext::beginFrame(): path is null.");
+        return false;
+    }
+    return beginFrameImpl(path, nullptr, width, height, roi);
+}
+
+bool fcExrContext::beginFrameStream(fcStream *stream, int width, int height, const fcExrRegion *roi)
+{
+    if (stream == nullptr) {
+        fcDebugLog("fcExrContext::beginFrameStream(): stream is null.");
+        return false;
+    }
+    return beginFrameImpl(nullptr, stream, width, height, roi);
+}
+
+bool fcExrContext::beginFrameImpl(const char *path, fcStream *stream, int width, int height, const fcExrRegion *roi)
 {
     if (m_task != nullptr) {
         fcDebugLog("fcExrContext::beginFrame(): beginFrame() is already called. maybe you forgot to call endFrame().");
         return false;
     }
+    // an empty data window can't be written
+    if (roi && roi->width > 0 && roi->height > 0 &&
+        (roi->x >= width || roi->y >= height || roi->x + roi->width <= 0 || roi->y + roi->height <= 0))
+    {
+        fcDebugLog("fcExrContext::beginFrame(): roi is out of the frame.");
+        return false;
+    }
 
     // 実行中のタスクの数が上限に達している場合適当に待つ
     if (m_active_task_count >= m_conf.max_active_tasks)
@@ -110,11 +326,11 @@ bool fcExrContext::beginFrame(const char *path, int width, int height)
         }
     }
 
-    m_task = new fcExrTaskData(path, width, height);
+    m_task = new fcExrTaskData(path, stream, stream ? m_stream_seq_submitted++ : 0, width, height, roi);
     return true;
 }
 
-bool fcExrContext::addLayerTexture(void *tex, fcPixelFormat fmt, int channel, const char *name, bool flipY)
+bool fcExrContext::addLayerTexture(void *tex, fcPixelFormat fmt, int channel, const char *name, bool flipY, fcExrCompression compression)
 {
     if (m_dev == nullptr) {
         fcDebugLog("fcExrContext::addLayerTexture(): gfx device is null.");
@@ -125,19 +341,16 @@ bool fcExrContext::addLayerTexture(void *tex, fcPixelFormat fmt, int channel, co
         return false;
     }
 
-    Buffer *raw_frame = nullptr;
-
-    if (tex == m_frame_prev)
-    {
-        raw_frame = m_src_prev;
-        fmt = m_fmt_prev;
+    int si = m_task->findSource(tex, fmt, flipY);
+    if (si >= 0) {
+        return addLayerImpl(si, channel, name, compression);
     }
-    else
-    {
-        m_frame_prev = tex;
 
-        m_task->pixels.push_back(Buffer());
-        raw_frame = &m_task->pixels.back();
+    // only read back here. flip and conversion are done on the writer.
+    fcExrLayerSource src = { tex, fmt, flipY, m_task->findSourceData(tex, fmt) };
+    if (src.data == nullptr) {
+        m_task->pixels.emplace_back(Buffer());
+        Buffer *raw_frame = &m_task->pixels.back();
         raw_frame->resize(m_task->width * m_task->height * fcGetPixelSize(fmt));
 
         // get frame buffer
@@ -146,116 +359,85 @@ bool fcExrContext::addLayerTexture(void *tex, fcPixelFormat fmt, int channel, co
             m_task->pixels.pop_back();
             return false;
         }
-        if (flipY) {
-            fcImageFlipY(&(*raw_frame)[0], m_task->width, m_task->height, fmt);
-        }
-        m_src_prev = raw_frame;
-
-        // convert pixel format if it is not supported by exr
-        if ((fmt & fcPixelFormat_TypeMask) == fcPixelFormat_Type_u8) {
-            m_task->pixels.emplace_back(Buffer());
-            auto *buf = &m_task->pixels.back();
-
-            int channels = fmt & fcPixelFormat_ChannelMask;
-            auto src_fmt = fmt;
-            fmt = fcPixelFormat(fcPixelFormat_Type_f16 | channels);
-            buf->resize(m_task->width * m_task->height * fcGetPixelSize(fmt));
-            fcConvertPixelFormat(&(*buf)[0], fmt, &(*raw_frame)[0], src_fmt, m_task->width * m_task->height);
-
-            m_src_prev = raw_frame = buf;
-        }
-
-        m_fmt_prev = fmt;
+        src.data = &(*raw_frame)[0];
     }
-
-    return addLayerImpl(&(*raw_frame)[0], fmt, channel, name);
+    m_task->sources.push_back(src);
+    return addLayerImpl((int)m_task->sources.size() - 1, channel, name, compression);
 }
 
-bool fcExrContext::addLayerPixels(const void *pixels, fcPixelFormat fmt, int channel, const char *name, bool flipY)
+bool fcExrContext::addLayerPixels(const void *pixels, fcPixelFormat fmt, int channel, const char *name, bool flipY, fcExrCompression compression)
 {
     if (m_task == nullptr) {
         fcDebugLog("fcExrContext::addLayerPixels(): maybe beginFrame() is not called.");
         return false;
     }
 
-    Buffer *raw_frame = nullptr;
-
-    if (pixels == m_frame_prev)
-    {
-        raw_frame = m_src_prev;
-        fmt = m_fmt_prev;
+    int si = m_task->findSource(pixels, fmt, flipY);
+    if (si >= 0) {
+        return addLayerImpl(si, channel, name, compression);
     }
-    else
-    {
-        m_frame_prev = pixels;
 
+    // only copy here. flip and conversion are done on the writer.
+    fcExrLayerSource src = { pixels, fmt, flipY, m_task->findSourceData(pixels, fmt) };
+    if (src.data != nullptr) {
+        // already copied (or borrowed) with different flipY
+    }
+    else if (m_conf.borrow_pixels) {
+        // zero copy. caller keeps pixels alive until the frame's callback is called.
+        src.data = (char*)pixels;
+    }
+    else {
         m_task->pixels.emplace_back(Buffer());
-        raw_frame = &m_task->pixels.back();
-
-        // convert pixel format if it is not supported by exr
-        if ((fmt & fcPixelFormat_TypeMask) == fcPixelFormat_Type_u8) {
-            int channels = fmt & fcPixelFormat_ChannelMask;
-            auto src_fmt = fmt;
-            fmt = fcPixelFormat(fcPixelFormat_Type_f16 | channels);
-            raw_frame->resize(m_task->width * m_task->height * (2 * channels));
-            fcConvertPixelFormat(&(*raw_frame)[0], fmt, pixels, src_fmt, m_task->width * m_task->height);
-        }
-        else {
-            raw_frame->resize(m_task->width * m_task->height * fcGetPixelSize(fmt));
-            memcpy(&(*raw_frame)[0], pixels, raw_frame->size());
-        }
-        if (flipY) {
-            fcImageFlipY(&(*raw_frame)[0], m_task->width, m_task->height, fmt);
-        }
-
-        m_src_prev = raw_frame;
-        m_fmt_prev = fmt;
+        Buffer *raw_frame = &m_task->pixels.back();
+        raw_frame->assign(pixels, m_task->width * m_task->height * fcGetPixelSize(fmt));
+        src.data = &(*raw_frame)[0];
     }
-
-    return addLayerImpl(&(*raw_frame)[0], fmt, channel, name);
+    m_task->sources.push_back(src);
+    return addLayerImpl((int)m_task->sources.size() - 1, channel, name, compression);
 }
 
-bool fcExrContext::addLayerImpl(char *pixels, fcPixelFormat fmt, int channel, const char *name)
+bool fcExrContext::addLayerImpl(int source, int channel, const char *name, fcExrCompression compression)
 {
     Imf::PixelType pixel_type = Imf::HALF;
-    int channels = fmt & fcPixelFormat_ChannelMask;
-    int tsize = 0;
-    switch (fmt & fcPixelFormat_TypeMask)
+    switch (m_task->sources[source].fmt & fcPixelFormat_TypeMask)
     {
     case fcPixelFormat_Type_f16:
         pixel_type = Imf::HALF;
-        tsize = 2;
         break;
     case fcPixelFormat_Type_f32:
         pixel_type = Imf::FLOAT;
-        tsize = 4;
         break;
     case fcPixelFormat_Type_i32:
         pixel_type = Imf::UINT;
-        tsize = 4;
+        break;
+    case fcPixelFormat_Type_u8:
+        pixel_type = m_conf.store_u8_as_uint ? Imf::UINT : Imf::HALF;
         break;
     default:
         fcDebugLog("fcExrContext::addLayerPixels(): this pixel format is not supported");
         return false;
     }
-    int psize = tsize * channels;
 
-    m_task->header.channels().insert(name, Imf::Channel(pixel_type));
-    m_task->frame_buffer.insert(name, Imf::Slice(pixel_type, pixels + (tsize * channel), psize, psize * m_task->width));
+    auto& part = m_task->getPart(m_conf.multi_part ? fcExrGetPartName(name) : std::string(), m_conf);
+    if (compression != fcExrCompression_Default) {
+        part.setCompression(compression, m_conf.dwa_compression_level);
+    }
+    part.header.channels().insert(name, Imf::Channel(pixel_type));
+    part.channels.push_back({ name, source, channel, pixel_type });
     return true;
 }
 
 
-bool fcExrContext::endFrame()
+bool fcExrContext::endFrame(fcExrFrameCallback callback, void *userdata)
 {
     if (m_task == nullptr) {
         fcDebugLog("fcExrContext::endFrame(): maybe beginFrame() is not called.");
         return false;
     }
 
-    m_frame_prev = nullptr;
-
     fcExrTaskData *exr = m_task;
+    exr->callback = callback;
+    exr->callback_userdata = userdata;
     m_task = nullptr;
     ++m_active_task_count;
     m_tasks.run([this, exr](){
@@ -267,17 +449,292 @@ bool fcExrContext::endFrame()
 
 void fcExrContext::endFrameTask(fcExrTaskData *exr)
 {
+    bool ok = false;
     try {
-        Imf::OutputFile fout(exr->path.c_str(), exr->header);
-        fout.setFrameBuffer(exr->frame_buffer);
-        fout.writePixels(exr->height);
-        delete exr;
+        if (exr->parts.empty()) {
+            fcDebugLog("fcExrContext::endFrameTask(): no layers are added.");
+        }
+        else {
+            // display window stays full frame. only data window is cropped.
+            auto data_window = computeDataWindow(exr);
+            for (auto& part : exr->parts) {
+                part.header.dataWindow() = data_window;
+            }
+
+            if (exr->stream) {
+                // encode to memory here and let flushStreamFrame() append it to the stream in order
+                StdOStream buf(exr->encoded);
+                fcExrOStream os(buf);
+                writeFrame(os, exr);
+            }
+            else {
+                const char *path = exr->path.c_str();
+                writeFrame(path, exr);
+            }
+        }
+        ok = true;
+    }
+    catch (std::exception &e) {
+        fcDebugLog(e.what());
     }
     catch (std::string &e) {
         fcDebugLog(e.c_str());
     }
+
+    // pixels are no longer referred after this point
+    if (exr->callback) {
+        exr->callback(exr->callback_userdata, ok);
+    }
+
+    if (exr->stream) {
+        if (!ok) { exr->encoded.str(""); } // don't write broken exr to the stream
+        flushStreamFrame(exr);
+    }
+    else {
+        delete exr;
+    }
 }
 
+static inline bool fcExrIsAlphaChannel(const std::string& name)
+{
+    return name == "A" || (name.size() >= 2 && name.compare(name.size() - 2, 2, ".A") == 0);
+}
+
+// roi, cropped to the bounding box of non-empty pixels if fcExrConfig::auto_crop is set
+Imath::Box2i fcExrContext::computeDataWindow(fcExrTaskData *exr)
+{
+    Imath::Box2i roi = exr->roi;
+    if (m_conf.auto_crop == fcExrAutoCrop_None) { return roi; }
+
+    // channels to test. if there is no alpha channel, pixels with any non-zero channel are non-empty.
+    std::vector<const fcExrChannelData*> channels;
+    for (auto& part : exr->parts) {
+        for (auto& ch : part.channels) {
+            if (m_conf.auto_crop == fcExrAutoCrop_AnyChannel || fcExrIsAlphaChannel(ch.name)) {
+                channels.push_back(&ch);
+            }
+        }
+    }
+    if (channels.empty()) {
+        for (auto& part : exr->parts) {
+            for (auto& ch : part.channels) { channels.push_back(&ch); }
+        }
+    }
+
+    auto is_empty = [&](int x, int y) {
+        for (auto *ch : channels) {
+            auto& src = exr->sources[ch->source];
+            int tsize = fcGetPixelSize(src.fmt) / (src.fmt & fcPixelFormat_ChannelMask);
+            int sy = src.flipY ? exr->height - 1 - y : y;
+            const char *p = src.data + ((size_t)exr->width * sy + x) * fcGetPixelSize(src.fmt) + tsize * ch->channel;
+            switch (tsize) {
+            case 1: if (*(const uint8_t*)p != 0) { return false; } break;
+            case 2: if ((*(const uint16_t*)p & 0x7fff) != 0) { return false; } break; // ignore sign of zero
+            case 4:
+                if ((src.fmt & fcPixelFormat_TypeMask) == fcPixelFormat_Type_f32) {
+                    if ((*(const uint32_t*)p & 0x7fffffff) != 0) { return false; }
+                }
+                else {
+                    if (*(const uint32_t*)p != 0) { return false; }
+                }
+                break;
+            }
+        }
+        return true;
+    };
+
+    // find bounding box in parallel. each task scans a band of rows.
+    const int band_height = 32;
+    int num_bands = (roi.max.y - roi.min.y + band_height) / band_height;
+    std::vector<Imath::Box2i> band_boxes(num_bands); // default constructed Box2i is empty
+    fcTaskGroup group;
+    for (int bi = 0; bi < num_bands; ++bi) {
+        group.run([&, bi]() {
+            auto& box = band_boxes[bi];
+            int y_end = std::min<int>(roi.min.y + (bi + 1) * band_height, roi.max.y + 1);
+            for (int y = roi.min.y + bi * band_height; y < y_end; ++y) {
+                int x_begin = roi.min.x;
+                while (x_begin <= roi.max.x && is_empty(x_begin, y)) { ++x_begin; }
+                if (x_begin > roi.max.x) { continue; }
+                int x_last = roi.max.x;
+                while (x_last > x_begin && is_empty(x_last, y)) { --x_last; }
+                box.extendBy(Imath::V2i(x_begin, y));
+                box.extendBy(Imath::V2i(x_last, y));
+            }
+        });
+    }
+    group.wait();
+
+    Imath::Box2i ret;
+    for (auto& box : band_boxes) {
+        if (!box.isEmpty()) { ret.extendBy(box); }
+    }
+    if (ret.isEmpty()) {
+        // data window can't be empty
+        ret = Imath::Box2i(roi.min, roi.min);
+    }
+    return ret;
+}
+
+// Target: file path or Imf::OStream
+template<class Target>
+void fcExrContext::writeFrame(Target& target, fcExrTaskData *exr)
+{
+    if (!m_conf.multi_part) {
+        auto& part = exr->parts.front();
+        if (m_conf.tile_size > 0) {
+            Imf::TiledOutputFile fout(target, part.header, m_conf.frame_threads);
+            writeTiledPart(fout, exr, part);
+        }
+        else {
+            Imf::OutputFile fout(target, part.header, m_conf.frame_threads);
+            writeScanlinePart(fout, exr, part);
+        }
+    }
+    else {
+        // parts share one file stream and OpenEXR serializes writes to it, so parts are written in order.
+        // each part still compresses its line buffers / tiles in parallel on the IlmThread pool.
+        std::vector<Imf::Header> headers;
+        for (auto& part : exr->parts) { headers.push_back(part.header); }
+
+        Imf::MultiPartOutputFile fout(target, headers.data(), (int)headers.size(), false, m_conf.frame_threads);
+        int pi = 0;
+        for (auto& part : exr->parts) {
+            if (m_conf.tile_size > 0) {
+                Imf::TiledOutputPart out(fout, pi);
+                writeTiledPart(out, exr, part);
+            }
+            else {
+                Imf::OutputPart out(fout, pi);
+                writeScanlinePart(out, exr, part);
+            }
+            ++pi;
+        }
+    }
+}
+
+static bool fcExrPartNeedsConversion(fcExrTaskData *exr, fcExrPartData& part)
+{
+    for (auto& ch : part.channels) {
+        if (exr->sources[ch.source].needsConversion()) { return true; }
+    }
+    return false;
+}
+
+// Output: Imf::OutputFile or Imf::OutputPart
+template<class Output>
+void fcExrContext::writeScanlinePart(Output& out, fcExrTaskData *exr, fcExrPartData& part)
+{
+    // if some sources need conversion or flip, write a few compression blocks at a time so that they are
+    // converted in small pieces right before compression and the working set stays in cache.
+    int num_lines = part.header.dataWindow().max.y - part.header.dataWindow().min.y + 1;
+    if (fcExrPartNeedsConversion(exr, part)) {
+        int block = fcExrGetScanlinesPerBlock(part.header.compression());
+        num_lines = block * std::max<int>(m_conf.frame_threads, (64 + block - 1) / block);
+    }
+
+    const auto& dw = part.header.dataWindow();
+    std::vector<Buffer> chunks(exr->sources.size());
+    for (int y = dw.min.y; y <= dw.max.y; y += num_lines) {
+        int n = std::min<int>(num_lines, dw.max.y + 1 - y);
+        Imf::FrameBuffer fb;
+        buildFrameBuffer(fb, exr, part, chunks, y, n);
+        out.setFrameBuffer(fb);
+        out.writePixels(n);
+    }
+}
+
+// Output: Imf::TiledOutputFile or Imf::TiledOutputPart
+template<class Output>
+void fcExrContext::writeTiledPart(Output& out, fcExrTaskData *exr, fcExrPartData& part)
+{
+    int tile_rows = out.numYTiles();
+    int rows_per_write = tile_rows;
+    if (fcExrPartNeedsConversion(exr, part)) {
+        rows_per_write = std::max<int>(64 / m_conf.tile_size, 1);
+    }
+
+    // tiles are placed from the top-left of the data window
+    const auto& dw = part.header.dataWindow();
+    std::vector<Buffer> chunks(exr->sources.size());
+    for (int ty = 0; ty < tile_rows; ty += rows_per_write) {
+        int ty_end = std::min<int>(ty + rows_per_write, tile_rows);
+        int y = dw.min.y + ty * m_conf.tile_size;
+        int n = std::min<int>(dw.min.y + ty_end * m_conf.tile_size, dw.max.y + 1) - y;
+        Imf::FrameBuffer fb;
+        buildFrameBuffer(fb, exr, part, chunks, y, n);
+        out.setFrameBuffer(fb);
+        out.writeTiles(0, out.numXTiles() - 1, ty, ty_end - 1);
+    }
+}
+
+// make slices for scanlines [y, y + num_lines).
+// f16/f32/i32 sources without flip are referred directly.
+// others are flipped and converted to half or uint into chunks[source], one scanline at a time.
+void fcExrContext::buildFrameBuffer(Imf::FrameBuffer& fb, fcExrTaskData *exr, fcExrPartData& part, std::vector<Buffer>& chunks, int y, int num_lines)
+{
+    const int width = exr->width;
+    std::vector<bool> converted(exr->sources.size());
+
+    for (auto& ch : part.channels) {
+        auto& src = exr->sources[ch.source];
+        int channels = src.fmt & fcPixelFormat_ChannelMask;
+        bool is_u8 = (src.fmt & fcPixelFormat_TypeMask) == fcPixelFormat_Type_u8;
+        int tsize = is_u8 ? (ch.type == Imf::UINT ? 4 : 2) : fcGetPixelSize(src.fmt) / channels;
+        int psize = tsize * channels;
+        size_t dst_pitch = (size_t)psize * width;
+        char *base = src.data;
+
+        if (src.needsConversion()) {
+            auto& chunk = chunks[ch.source];
+            if (!converted[ch.source]) {
+                size_t src_pitch = (size_t)fcGetPixelSize(src.fmt) * width;
+                if (chunk.size() < dst_pitch * num_lines) { chunk.resize(dst_pitch * num_lines); }
+
+                for (int i = 0; i < num_lines; ++i) {
+                    int sy = src.flipY ? exr->height - 1 - (y + i) : y + i;
+                    const char *src_row = src.data + src_pitch * sy;
+                    char *dst_row = chunk.ptr() + dst_pitch * i;
+                    if (!is_u8) {
+                        memcpy(dst_row, src_row, src_pitch);
+                    }
+                    else if (ch.type == Imf::UINT) {
+                        uint32_t *dst = (uint32_t*)dst_row;
+                        for (size_t xi = 0; xi < (size_t)width * channels; ++xi) { dst[xi] = (uint8_t)src_row[xi]; }
+                    }
+                    else {
+                        fcConvertPixelFormat(dst_row, fcPixelFormat(fcPixelFormat_Type_f16 | channels), src_row, src.fmt, width);
+                    }
+                }
+                converted[ch.source] = true;
+            }
+            // slices are addressed by absolute y
+            base = chunk.ptr() - dst_pitch * y;
+        }
+
+        fb.insert(ch.name, Imf::Slice(ch.type, base + (tsize * ch.channel), psize, dst_pitch));
+    }
+}
+
+// write encoded frames to their streams in submission order. frames that finished early wait in m_stream_frames.
+void fcExrContext::flushStreamFrame(fcExrTaskData *exr)
+{
+    std::unique_lock<std::mutex> lock(m_stream_mutex);
+    m_stream_frames[exr->stream_seq] = exr;
+    for (;;) {
+        auto i = m_stream_frames.find(m_stream_seq_written);
+        if (i == m_stream_frames.end()) { break; }
+
+        fcExrTaskData *f = i->second;
+        std::string data = f->encoded.str();
+        if (!data.empty()) {
+            f->stream->write(data.data(), data.size());
+        }
+        delete f;
+        m_stream_frames.erase(i);
+        ++m_stream_seq_written;
+    }
+}
 
 fcCLinkage fcExport fcIExrContext* fcExrCreateContextImpl(const fcExrConfig *conf, fcIGraphicsDevice *dev)
 {
@@ -5,10 +5,11 @@ class fcIExrContext
 {
 public:
     virtual void release() = 0;
-    virtual bool beginFrame(const char *path, int width, int height) = 0;
-    virtual bool addLayerTexture(void *tex, fcPixelFormat fmt, int channel, const char *name, bool flipY) = 0;
-    virtual bool addLayerPixels(const void *pixels, fcPixelFormat fmt, int channel, const char *name, bool flipY) = 0;
-    virtual bool endFrame() = 0;
+    virtual bool beginFrame(const char *path, int width, int height, const fcExrRegion *roi) = 0;
+    virtual bool beginFrameStream(fcStream *stream, int width, int height, const fcExrRegion *roi) = 0;
+    virtual bool addLayerTexture(void *tex, fcPixelFormat fmt, int channel, const char *name, bool flipY, fcExrCompression compression) = 0;
+    virtual bool addLayerPixels(const void *pixels, fcPixelFormat fmt, int channel, const char *name, bool flipY, fcExrCompression compression) = 0;
+    virtual bool endFrame(fcExrFrameCallback callback, void *userdata) = 0;
 protected:
     virtual ~fcIExrContext() {}
 };
@@ -13,14 +13,45 @@
 #endif // fcSupportHalfPixelFormat
 
 
-typedef jo_gif_frame_t fcGifFrame;
+// palette of a keyframe. frames until the next keyframe are mapped with it.
+// tasks that need the palette are queued in waiting until it is generated.
+struct fcGifPalette
+{
+    jo_gif_palette_t palette;
+    Buffer colors; // color table to be written
+    std::mutex mutex;
+    bool ready;
+    std::vector<std::function<void()>> waiting;
+    int num_frames; // frames in the store that are mapped with this palette
+
+    fcGifPalette() : palette(), ready(false), num_frames() {}
+    ~fcGifPalette() { jo_gif_palette_release(&palette); }
+};
+typedef std::shared_ptr<fcGifPalette> fcGifPalettePtr;
+
+struct fcGifFrame : jo_gif_frame_t
+{
+    fcGifPalettePtr palette_ref;
+    size_t data_size; // bytes in the written gif, excluding color tables
+    std::atomic<bool> done;
+    std::atomic<bool> written; // written to the stream in streaming mode
+
+    fcGifFrame() : data_size(), done(false), written(false) {}
+};
+typedef std::unique_ptr<fcGifFrame> fcGifFramePtr;
+// oldest frames are evicted when fcGifConfig::max_frames or max_data_size is exceeded. see trim()
+typedef std::deque<fcGifFramePtr> fcGifFrames;
 
 struct fcGifTaskData
 {
     fcPixelFormat raw_pixel_format;
-    Buffer raw_pixels;
+    std::shared_ptr<Buffer> raw_pixels;
+    std::shared_ptr<Buffer> prev_raw_pixels; // previous frame for delta encoding. null if this frame must be a full frame
     Buffer rgba8_pixels;
+    Buffer prev_rgba8_pixels;
     fcGifFrame *gif_frame;
+    fcGifPalettePtr palette;        // palette to map this frame with
+    fcGifPalettePtr prev_palette;   // previous keyframe palette. seed of k-means, or reused if it still fits
     int frame;
     bool local_palette;
     fcTime timestamp;
@@ -29,7 +60,7 @@ struct fcGifTaskData
 class fcGifContext : public fcIGifContext
 {
 public:
-    fcGifContext(const fcGifConfig &conf, fcIGraphicsDevice *dev);
+    fcGifContext(const fcGifConfig &conf, fcIGraphicsDevice *dev, fcStream *stream);
     ~fcGifContext();
     void release() override;
 
@@ -40,6 +71,7 @@ public:
     void clearFrame() override;
     int  getFrameCount() override;
     void getFrameData(void *tex, int frame) override;
+    bool getFramePixels(void *pixels, int frame) override;
     int  getExpectedDataSize(int begin_frame, int end_frame) override;
     void eraseFrame(int begin_frame, int end_frame) override;
 
@@ -49,26 +81,84 @@ private:
 
     void addGifFrame(fcGifTaskData& data);
     void kickTask(fcGifTaskData& data);
+    void runAfter(const fcGifPalettePtr& dep, const std::function<void()>& f);
+    void setPaletteReady(fcGifPalette& pal);
+
+    void waitTasks();
+    void trim();
+    void popFrontFrame();
+    void drawEvictedFrames();
+    void recount();
+    void flushStream(bool finish);
+    void resetStreamQueue();
+
+    Buffer&     findPalette(int frame);
+    void        decodeFrame(int frame, void *pixels);
+    fcGifFrame& getSelfContainedFrame(int frame);
 
 private:
     fcGifConfig m_conf;
     fcIGraphicsDevice *m_dev;
     std::vector<fcGifTaskData> m_buffers;
     std::vector<fcGifTaskData*> m_buffers_unused;
-    std::list<fcGifFrame> m_gif_frames;
+    fcGifFrames m_gif_frames;
     jo_gif_t m_gif;
     fcTaskGroup m_tasks;
     std::mutex m_mutex;
     int m_frame;
+
+    fcGifPalettePtr m_palette; // palette of the last keyframe
+    std::deque<fcGifPalettePtr> m_palettes; // palettes of frames in m_gif_frames, in order
+    std::atomic<size_t> m_data_size; // sum of data_size of finished frames in m_gif_frames
+    Buffer m_base; // canvas evicted frames were drawn onto. the first frame is drawn over this if it is a delta frame
+    std::mutex m_base_mutex;
+    std::mutex m_evicted_mutex;
+    fcGifFrames m_evicted; // frames to be drawn onto m_base by drawEvictedFrames(). null means m_base is no longer needed
+    std::shared_ptr<Buffer> m_last_raw_pixels;
+    fcPixelFormat m_last_raw_pixel_format;
+    // full frame version of a delta frame that begins a written range. see getSelfContainedFrame()
+    const fcGifFrame *m_head_source;
+    fcGifFrame m_head;
+
+    // streaming mode. frames are written as soon as they and their predecessors are encoded. see flushStream()
+    fcStream *m_stream;
+    std::mutex m_stream_mutex;
+    std::deque<fcGifFrame*> m_stream_queue; // frames not written yet, in order
+    fcGifPalettePtr m_stream_palette; // global color table of the stream
+    int m_stream_frame;
+    int m_stream_duration;
 };
 
 
-fcGifContext::fcGifContext(const fcGifConfig &conf, fcIGraphicsDevice *dev)
+// lets jo_gif split a frame into row bands on the thread pool
+static void fcGifParallelFor(void *, int count, void (*body)(void *arg, int i), void *arg)
+{
+    fcTaskGroup group;
+    for (int i = 0; i < count; ++i) {
+        group.run([=]() { body(arg, i); });
+    }
+    group.wait();
+}
+
+fcGifContext::fcGifContext(const fcGifConfig &conf, fcIGraphicsDevice *dev, fcStream *stream)
     : m_conf(conf)
     , m_dev(dev)
     , m_frame()
+    , m_data_size()
+    , m_last_raw_pixel_format(fcPixelFormat_Unknown)
+    , m_head_source()
+    , m_stream(stream)
+    , m_stream_frame()
+    , m_stream_duration(1)
 {
     m_gif = jo_gif_start(m_conf.width, m_conf.height, 0, m_conf.num_colors);
+    m_gif.mapper = (jo_gif_mapper_t)m_conf.palette_mapper;
+    m_gif.quantizer = (jo_gif_quantizer_t)m_conf.quantizer;
+    m_gif.sample = m_conf.quantize_sample;
+    m_gif.dither = (jo_gif_dither_t)m_conf.dither;
+    m_gif.parallelFor = &fcGifParallelFor;
+    m_gif.delta = m_conf.delta_frames;
+    m_gif.reuseThreshold = m_conf.palette_reuse_threshold;
 
     // allocate working buffers
     if (m_conf.max_active_tasks <= 0) {
@@ -80,11 +170,19 @@ fcGifContext::fcGifContext(const fcGifConfig &conf, fcIGraphicsDevice *dev)
         buf.rgba8_pixels.resize(m_conf.width * m_conf.height * fcGetPixelSize(fcPixelFormat_RGBAu8));
         m_buffers_unused.push_back(&buf);
     }
+
+    if (m_stream) {
+        jo_gif_write_header(*m_stream, &m_gif);
+    }
 }
 
 fcGifContext::~fcGifContext()
 {
     m_tasks.wait();
+    if (m_stream) {
+        flushStream(true);
+        jo_gif_write_footer(*m_stream, &m_gif);
+    }
     jo_gif_end(&m_gif);
 }
 
@@ -94,20 +192,6 @@ void fcGifContext::release()
     delete this;
 }
 
-static inline void advance_palette_and_pop_front(std::list<jo_gif_frame_t>& frames)
-{
-    // 先頭のパレットをいっこ先のフレームへ移動
-    if (frames.size() >= 2)
-    {
-        auto &first = frames.front();
-        auto &second = *(++frames.begin());
-        if (!first.palette.empty() && second.palette.empty()) {
-            second.palette = first.palette;
-        }
-    }
-    frames.pop_front();
-}
-
 fcGifTaskData& fcGifContext::getTempraryVideoFrame()
 {
     fcGifTaskData *ret = nullptr;
@@ -136,42 +220,230 @@ void fcGifContext::returnTempraryVideoFrame(fcGifTaskData& v)
 
 void fcGifContext::addGifFrame(fcGifTaskData& data)
 {
+    size_t npixels = m_conf.width * m_conf.height;
     unsigned char *src = nullptr;
     if (data.raw_pixel_format == fcPixelFormat_RGBAu8) {
-        src = (unsigned char*)&data.raw_pixels[0];
+        src = (unsigned char*)data.raw_pixels->ptr();
     }
     else {
         // convert pixel format
-        size_t npixels = data.raw_pixels.size() / fcGetPixelSize(data.raw_pixel_format);
-        fcConvertPixelFormat(&data.rgba8_pixels[0], fcPixelFormat_RGBAu8, &data.raw_pixels[0], data.raw_pixel_format, npixels);
+        fcConvertPixelFormat(&data.rgba8_pixels[0], fcPixelFormat_RGBAu8, data.raw_pixels->ptr(), data.raw_pixel_format, npixels);
         src = (unsigned char*)&data.rgba8_pixels[0];
     }
 
-    jo_gif_frame(&m_gif, data.gif_frame, src, data.frame, data.local_palette);
+    fcGifPalette& pal = *data.palette;
+    bool full_frame = false;
+    if (data.local_palette) {
+        // a keyframe whose palette is the same as the previous one can still be a delta frame
+        full_frame = !jo_gif_make_palette(&m_gif, &pal.palette, src, data.prev_palette ? &data.prev_palette->palette : nullptr);
+        pal.colors.assign((char*)pal.palette.colors, jo_gif_palette_table_size(&m_gif));
+        // following frames can be mapped while this one is
+        setPaletteReady(pal);
+    }
+
+    unsigned char *prev = nullptr;
+    if (data.prev_raw_pixels && !full_frame) {
+        if (data.raw_pixel_format == fcPixelFormat_RGBAu8) {
+            prev = (unsigned char*)data.prev_raw_pixels->ptr();
+        }
+        else {
+            data.prev_rgba8_pixels.resize(data.rgba8_pixels.size());
+            fcConvertPixelFormat(&data.prev_rgba8_pixels[0], fcPixelFormat_RGBAu8, data.prev_raw_pixels->ptr(), data.raw_pixel_format, npixels);
+            prev = (unsigned char*)&data.prev_rgba8_pixels[0];
+        }
+    }
+
+    fcGifFrame& frame = *data.gif_frame;
+    jo_gif_encode_frame(&m_gif, &frame, src, &pal.palette, prev);
+    frame.data_size = frame.encoded_pixels.size() + 20;
+    m_data_size += frame.data_size;
+    frame.done = true;
+    if (m_stream) {
+        flushStream(false);
+    }
+
+    data.prev_raw_pixels.reset();
+    data.palette.reset();
+    data.prev_palette.reset();
     returnTempraryVideoFrame(data);
 }
 
+void fcGifContext::runAfter(const fcGifPalettePtr& dep, const std::function<void()>& f)
+{
+    if (dep) {
+        std::unique_lock<std::mutex> lock(dep->mutex);
+        if (!dep->ready) {
+            dep->waiting.push_back(f);
+            return;
+        }
+    }
+    m_tasks.run(f);
+}
+
+void fcGifContext::setPaletteReady(fcGifPalette& pal)
+{
+    std::vector<std::function<void()>> waiting;
+    {
+        std::unique_lock<std::mutex> lock(pal.mutex);
+        pal.ready = true;
+        waiting.swap(pal.waiting);
+    }
+    // called from a task of m_tasks. m_tasks.wait() can't return before these are queued.
+    for (auto& f : waiting) { m_tasks.run(f); }
+}
+
 void fcGifContext::kickTask(fcGifTaskData& data)
 {
     // gif データを生成
-    m_gif_frames.push_back(fcGifFrame());
-    data.gif_frame = &m_gif_frames.back();
+    m_gif_frames.emplace_back(new fcGifFrame());
+    data.gif_frame = m_gif_frames.back().get();
     data.gif_frame->timestamp = data.timestamp;
     data.frame = m_frame++;
+    data.local_palette = data.local_palette || !m_palette;
+
+    // delta frames are diffed against the source pixels of the previous frame
+    if (m_conf.delta_frames) {
+        if (m_last_raw_pixels && m_last_raw_pixel_format == data.raw_pixel_format) {
+            data.prev_raw_pixels = m_last_raw_pixels;
+        }
+        m_last_raw_pixels = data.raw_pixels;
+        m_last_raw_pixel_format = data.raw_pixel_format;
+    }
 
+    // keyframes generate a new palette. tasks wait only for the palette they need, not for all preceding tasks.
+    fcGifPalettePtr dep;
     if (data.local_palette) {
-        // パレットの更新は前後のフレームに影響をあたえるため、同期更新でなければならない
-        m_tasks.wait();
+        if (m_gif.quantizer == jo_gif_quantizer_kmeans || m_gif.reuseThreshold > 0.0f) {
+            data.prev_palette = m_palette;
+            dep = m_palette;
+        }
+        m_palette = std::make_shared<fcGifPalette>();
+    }
+    else {
+        dep = m_palette;
+    }
+    data.palette = m_palette;
+    data.gif_frame->palette_ref = m_palette;
+    if (m_palettes.empty() || m_palettes.back() != m_palette) {
+        m_palettes.push_back(m_palette);
+    }
+    ++m_palette->num_frames;
+
+    if (m_stream) {
+        std::unique_lock<std::mutex> lock(m_stream_mutex);
+        m_stream_queue.push_back(data.gif_frame);
+    }
+    runAfter(dep, [this, &data]() {
         addGifFrame(data);
+    });
+    if (m_stream) {
+        // the previous frame may be waiting for this timestamp to get its delay
+        m_tasks.run([this]() { flushStream(false); });
+    }
+    trim();
+}
+
+void fcGifContext::waitTasks()
+{
+    // trim() may queue drawEvictedFrames(). wait for it too before m_base is read.
+    m_tasks.wait();
+    trim();
+    m_tasks.wait();
+}
+
+void fcGifContext::trim()
+{
+    if (m_stream) {
+        // written frames are no longer needed. the store is bounded by frames in flight.
+        // this runs on the submitting thread. evicted frames are drawn onto m_base by the thread pool. see popFrontFrame()
+        while (!m_gif_frames.empty() && m_gif_frames.front()->written) {
+            popFrontFrame();
+        }
+        return;
+    }
+
+    // frames still being encoded can't be evicted. the store may exceed the limits by frames in flight.
+    for (;;) {
+        size_t n = m_gif_frames.size();
+        bool over =
+            (m_conf.max_frames > 0 && n > (size_t)m_conf.max_frames) ||
+            (m_conf.max_data_size > 0 && n > 1 && m_data_size > (size_t)m_conf.max_data_size);
+        if (!over || !m_gif_frames.front()->done) { break; }
+        popFrontFrame();
     }
-    else
+}
+
+void fcGifContext::popFrontFrame()
+{
+    fcGifFrame& front = *m_gif_frames.front();
+
+    m_data_size -= front.data_size;
+    if (--front.palette_ref->num_frames == 0) {
+        m_palettes.pop_front();
+    }
+    if (m_head_source == &front) {
+        m_head_source = nullptr;
+    }
+
+    // following delta frames are drawn over this. decoding it is left to the thread pool.
+    bool kick;
+    {
+        std::unique_lock<std::mutex> lock(m_evicted_mutex);
+        kick = m_evicted.empty();
+        m_evicted.push_back(std::move(m_gif_frames.front()));
+        if (m_gif_frames.size() > 1 && m_gif_frames[1]->done && !m_gif_frames[1]->isDelta()) {
+            m_evicted.emplace_back();
+        }
+    }
+    m_gif_frames.pop_front();
+    if (kick) {
+        m_tasks.run([this]() { drawEvictedFrames(); });
+    }
+}
+
+void fcGifContext::drawEvictedFrames()
+{
+    // m_base_mutex keeps batches in order. readers of m_base wait for m_tasks. see waitTasks()
+    std::unique_lock<std::mutex> base_lock(m_base_mutex);
+    fcGifFrames frames;
     {
-        m_tasks.run([this, &data]() {
-            addGifFrame(data);
-        });
+        std::unique_lock<std::mutex> lock(m_evicted_mutex);
+        frames.swap(m_evicted);
+    }
+
+    // frames before a full frame are overdrawn. skip them.
+    size_t first = 0;
+    for (size_t i = 0; i < frames.size(); ++i) {
+        if (!frames[i]) { first = i + 1; }
+    }
+    if (first > 0) {
+        m_base.clear();
+    }
+    for (size_t i = first; i < frames.size(); ++i) {
+        fcGifFrame& f = *frames[i];
+        if (m_base.empty()) {
+            m_base.resize(m_conf.width * m_conf.height * 4);
+            memset(m_base.ptr(), 0, m_base.size());
+        }
+        jo_gif_decode(m_base.ptr(), &m_gif, &f, &f.palette_ref->colors);
     }
 }
 
+void fcGifContext::recount()
+{
+    for (auto& p : m_palettes) { p->num_frames = 0; }
+    m_palettes.clear();
+    size_t data_size = 0;
+    for (auto& f : m_gif_frames) {
+        if (m_palettes.empty() || m_palettes.back() != f->palette_ref) {
+            m_palettes.push_back(f->palette_ref);
+        }
+        ++f->palette_ref->num_frames;
+        data_size += f->data_size;
+    }
+    m_data_size = data_size;
+}
+
 bool fcGifContext::addFrameTexture(void *tex, fcPixelFormat fmt, bool keyframe, fcTime timestamp)
 {
     if (m_dev == nullptr) {
@@ -180,13 +452,18 @@ bool fcGifContext::addFrameTexture(void *tex, fcPixelFormat fmt, bool keyframe,
     }
     fcGifTaskData& data = getTempraryVideoFrame();
     data.timestamp = timestamp >= 0.0 ? timestamp : GetCurrentTimeSec();
-    data.local_palette = data.frame == 0 || keyframe;
+    data.local_palette = keyframe;
 
     // フレームバッファの内容取得
-    data.raw_pixels.resize(m_conf.width * m_conf.height * fcGetPixelSize(fmt));
+    // raw pixels may still be referred as the previous frame of a delta frame. reuse only if not.
+    if (!data.raw_pixels || data.raw_pixels.use_count() > 1) {
+        data.raw_pixels = std::make_shared<Buffer>();
+    }
+    data.raw_pixels->resize(m_conf.width * m_conf.height * fcGetPixelSize(fmt));
     data.raw_pixel_format = fmt;
-    if (!m_dev->readTexture(&data.raw_pixels[0], data.raw_pixels.size(), tex, m_conf.width, m_conf.height, fmt))
+    if (!m_dev->readTexture(data.raw_pixels->ptr(), data.raw_pixels->size(), tex, m_conf.width, m_conf.height, fmt))
     {
+        returnTempraryVideoFrame(data);
         return false;
     }
 
@@ -198,9 +475,12 @@ bool fcGifContext::addFramePixels(const void *pixels, fcPixelFormat fmt, bool ke
 {
     fcGifTaskData& data = getTempraryVideoFrame();
     data.timestamp = timestamp >= 0.0 ? timestamp : GetCurrentTimeSec();
-    data.local_palette = data.frame == 0 || keyframe;
+    data.local_palette = keyframe;
     data.raw_pixel_format = fmt;
-    data.raw_pixels.assign((char*)pixels, m_conf.width * m_conf.height * fcGetPixelSize(fmt));
+    if (!data.raw_pixels || data.raw_pixels.use_count() > 1) {
+        data.raw_pixels = std::make_shared<Buffer>();
+    }
+    data.raw_pixels->assign((char*)pixels, m_conf.width * m_conf.height * fcGetPixelSize(fmt));
 
     kickTask(data);
     return true;
@@ -212,9 +492,25 @@ void fcGifContext::clearFrame()
     m_tasks.wait();
     m_gif_frames.clear();
     m_frame = 0;
+    m_palette.reset();
+    for (auto& p : m_palettes) { p->num_frames = 0; }
+    m_palettes.clear();
+    m_data_size = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_base_mutex);
+        m_base.clear();
+    }
+    m_last_raw_pixels.reset();
+    m_head_source = nullptr;
+    resetStreamQueue();
 }
 
 
+static inline bool isSamePalette(const fcGifPalettePtr& a, const fcGifPalettePtr& b)
+{
+    return a == b || (a->colors.size() == b->colors.size() && memcmp(a->colors.ptr(), b->colors.ptr(), a->colors.size()) == 0);
+}
+
 static inline void adjust_frame(int &begin_frame, int &end_frame, int max_frame)
 {
     begin_frame = std::max<int>(begin_frame, 0);
@@ -229,29 +525,29 @@ static inline void adjust_frame(int &begin_frame, int &end_frame, int max_frame)
 
 bool fcGifContext::write(fcStream& os, int begin_frame, int end_frame)
 {
-    m_tasks.wait();
+    waitTasks();
 
     adjust_frame(begin_frame, end_frame, (int)m_gif_frames.size());
-    auto begin = m_gif_frames.begin();
-    auto end = m_gif_frames.begin();
-    std::advance(begin, begin_frame);
-    std::advance(end, end_frame);
-
-    // パレット探索
-    auto palette = begin;
-    while (palette->palette.empty()) { --palette; }
+    // a gif without frames would have no global color table. the header says it has one.
+    if (begin_frame >= end_frame) { return false; }
 
     int frame = 0;
     int duration = 1; // unit: centi-second
     jo_gif_write_header(os, &m_gif);
-    for (auto i = begin; i != end; ++i) {
-        jo_gif_frame_t *pal = frame == 0 ? &(*palette) : nullptr;
+    for (int i = begin_frame; i < end_frame; ++i) {
+        fcGifFrame& f = *m_gif_frames[i];
+        // the first frame has nothing to be drawn over. it must be a full frame.
+        jo_gif_frame_t *fdata = i == begin_frame ? &getSelfContainedFrame(i) : &f;
+        Buffer *pal = nullptr;
+        if (frame == 0 || !isSamePalette(f.palette_ref, m_gif_frames[begin_frame]->palette_ref)) {
+            // global color table, or local one if the global one is not the one this frame is mapped with
+            pal = &findPalette(i);
+        }
 
-        auto next = i; ++next;
-        if (next != end) {
-            duration = int((next->timestamp - i->timestamp) * 100.0); // seconds to centi-seconds
+        if (i + 1 < end_frame) {
+            duration = int((m_gif_frames[i + 1]->timestamp - f.timestamp) * 100.0); // seconds to centi-seconds
         }
-        jo_gif_write_frame(os, &m_gif, &(*i), pal, frame++, duration);
+        jo_gif_write_frame(os, &m_gif, fdata, pal, frame++, duration);
     }
     jo_gif_write_footer(os, &m_gif);
 
@@ -261,78 +557,200 @@ bool fcGifContext::write(fcStream& os, int begin_frame, int end_frame)
 
 int fcGifContext::getFrameCount()
 {
+    trim();
     return (int)m_gif_frames.size();
 }
 
 void fcGifContext::getFrameData(void *tex, int frame)
 {
-    if (frame >= 0 && size_t(frame) >= m_gif_frames.size()) { return; }
-    m_tasks.wait();
-
-    jo_gif_frame_t *fdata, *palette;
-    {
-        auto it = m_gif_frames.begin();
-        std::advance(it, frame);
-        fdata = &(*it);
-        for (;; --it)
-        {
-            if (!it->palette.empty())
-            {
-                palette = &(*it);
-                break;
-            }
-        }
+    if (m_dev == nullptr) {
+        fcDebugLog("fcGifContext::getFrameData(): gfx device is null.");
+        return;
     }
 
     std::string raw_pixels;
     raw_pixels.resize(m_conf.width * m_conf.height * 4);
-    jo_gif_decode(&raw_pixels[0], fdata, palette);
-    m_dev->writeTexture(tex, m_gif.width, m_gif.height, fcPixelFormat_RGBAu8, &raw_pixels[0], raw_pixels.size());
+    if (getFramePixels(&raw_pixels[0], frame)) {
+        m_dev->writeTexture(tex, m_gif.width, m_gif.height, fcPixelFormat_RGBAu8, &raw_pixels[0], raw_pixels.size());
+    }
+}
+
+bool fcGifContext::getFramePixels(void *pixels, int frame)
+{
+    waitTasks();
+    if (frame < 0 || size_t(frame) >= m_gif_frames.size()) { return false; }
+
+    decodeFrame(frame, pixels);
+    return true;
+}
+
+Buffer& fcGifContext::findPalette(int frame)
+{
+    return m_gif_frames[frame]->palette_ref->colors;
+}
+
+void fcGifContext::decodeFrame(int frame, void *pixels)
+{
+    // delta frames are drawn over the previous frames. start from the last full frame.
+    int first = frame;
+    while (first > 0 && m_gif_frames[first]->isDelta()) { --first; }
+    if (m_gif_frames[first]->isDelta()) {
+        std::unique_lock<std::mutex> lock(m_base_mutex);
+        if (!m_base.empty()) {
+            memcpy(pixels, m_base.ptr(), m_base.size());
+        }
+    }
+    if (first == frame) {
+        jo_gif_decode(pixels, &m_gif, m_gif_frames[frame].get(), &findPalette(frame));
+        return;
+    }
+
+    // lzw decoding of each frame is independent. do it on the thread pool, and then draw in order.
+    std::vector<size_t> offsets;
+    size_t total = 0;
+    for (int i = first; i <= frame; ++i) {
+        offsets.push_back(total);
+        total += m_gif_frames[i]->w * m_gif_frames[i]->h;
+    }
+    Buffer indices(total);
+    unsigned char *dst = (unsigned char*)indices.ptr();
+    fcTaskGroup group;
+    for (int i = first; i <= frame; ++i) {
+        const fcGifFrame *f = m_gif_frames[i].get();
+        unsigned char *d = dst + offsets[i - first];
+        group.run([f, d]() { jo_gif_decode_indices(f, d); });
+    }
+    group.wait();
+
+    for (int i = first; i <= frame; ++i) {
+        jo_gif_decode(pixels, &m_gif, m_gif_frames[i].get(), &findPalette(i), dst + offsets[i - first]);
+    }
+}
+
+fcGifFrame& fcGifContext::getSelfContainedFrame(int frame)
+{
+    fcGifFrame& f = *m_gif_frames[frame];
+    if (!f.isDelta()) { return f; }
+    if (m_head_source == &f) { return m_head; }
+
+    Buffer pixels(m_conf.width * m_conf.height * 4);
+    decodeFrame(frame, pixels.ptr());
+    m_head.timestamp = f.timestamp;
+    m_head.palette_ref = f.palette_ref;
+    jo_gif_frame_full(&m_gif, &m_head, (unsigned char*)pixels.ptr(), &f.palette_ref->palette);
+    m_head_source = &f;
+    return m_head;
 }
 
 
 int fcGifContext::getExpectedDataSize(int begin_frame, int end_frame)
 {
-    adjust_frame(begin_frame, end_frame, (int)m_gif_frames.size());
-    auto begin = m_gif_frames.begin();
-    auto end = m_gif_frames.begin();
-    std::advance(begin, begin_frame);
-    std::advance(end, end_frame);
+    waitTasks();
 
+    int num_frames = (int)m_gif_frames.size();
+    adjust_frame(begin_frame, end_frame, num_frames);
 
+    if (begin_frame >= end_frame) { return 0; } // nothing is written. see write()
     size_t size = 14; // gif header + footer size
-    for (auto i = begin; i != end; ++i)
-    {
-        if (i == begin) {
-            if (m_gif.repeat >= 0) { size += 19; }
-            // パレット探索
-            if (begin->palette.empty())
-            {
-                auto palette = begin;
-                while (palette->palette.empty()) { --palette; }
-                size += palette->palette.size();
+
+    const fcGifPalettePtr& global_palette = m_gif_frames[begin_frame]->palette_ref;
+    if (m_gif.repeat >= 0) { size += 19; }
+    size += findPalette(begin_frame).size() + getSelfContainedFrame(begin_frame).encoded_pixels.size() + 20;
+
+    if (begin_frame == 0 && end_frame == num_frames) {
+        // whole store. use the running total
+        size += m_data_size - m_gif_frames.front()->data_size;
+        for (auto& p : m_palettes) {
+            if (!isSamePalette(p, global_palette)) {
+                size += p->colors.size() * p->num_frames; // local color tables. see write()
             }
         }
+        return (int)size;
+    }
 
-        size += i->palette.size() + i->encoded_pixels.size() + 20;
+    for (int i = begin_frame + 1; i < end_frame; ++i) {
+        fcGifFrame& f = *m_gif_frames[i];
+        if (!isSamePalette(f.palette_ref, global_palette)) {
+            size += findPalette(i).size(); // local color table. see write()
+        }
+        size += f.data_size;
     }
     return (int)size;
 }
 
 void fcGifContext::eraseFrame(int begin_frame, int end_frame)
 {
-    m_tasks.wait();
+    waitTasks();
 
     adjust_frame(begin_frame, end_frame, (int)m_gif_frames.size());
-    auto begin = m_gif_frames.begin();
-    auto end = m_gif_frames.begin();
-    std::advance(begin, begin_frame);
-    std::advance(end, end_frame);
-    m_gif_frames.erase(begin, end);
+    if (begin_frame >= end_frame) { return; }
+
+    if (end_frame < (int)m_gif_frames.size() && m_gif_frames[end_frame]->isDelta()) {
+        // the first remaining frame is drawn over erased frames. make it a full frame.
+        fcGifFrame& f = *m_gif_frames[end_frame];
+        Buffer pixels(m_conf.width * m_conf.height * 4);
+        decodeFrame(end_frame, pixels.ptr());
+        jo_gif_frame_full(&m_gif, &f, (unsigned char*)pixels.ptr(), &f.palette_ref->palette);
+        f.data_size = f.encoded_pixels.size() + 20;
+    }
+    else if (end_frame == (int)m_gif_frames.size()) {
+        // next frame can't be a delta of the erased last frame
+        m_last_raw_pixels.reset();
+    }
+    m_gif_frames.erase(m_gif_frames.begin() + begin_frame, m_gif_frames.begin() + end_frame);
+    if (begin_frame == 0) {
+        // the first frame is a full frame now
+        std::unique_lock<std::mutex> lock(m_base_mutex);
+        m_base.clear();
+    }
+    recount();
+    m_head_source = nullptr;
+    resetStreamQueue();
+}
+
+void fcGifContext::flushStream(bool finish)
+{
+    std::unique_lock<std::mutex> lock(m_stream_mutex);
+    while (!m_stream_queue.empty()) {
+        fcGifFrame *f = m_stream_queue.front();
+        if (!f->done) { break; }
+
+        // delay of a frame is known when the next frame is added. the last frame reuses the previous delay like write()
+        fcGifFrame *next = m_stream_queue.size() > 1 ? m_stream_queue[1] : nullptr;
+        if (next) {
+            m_stream_duration = int((next->timestamp - f->timestamp) * 100.0); // seconds to centi-seconds
+        }
+        else if (!finish) {
+            break;
+        }
+
+        Buffer *pal = nullptr;
+        if (m_stream_frame == 0) {
+            m_stream_palette = f->palette_ref;
+            pal = &f->palette_ref->colors;
+        }
+        else if (!isSamePalette(f->palette_ref, m_stream_palette)) {
+            pal = &f->palette_ref->colors;
+        }
+        jo_gif_write_frame(*m_stream, &m_gif, f, pal, m_stream_frame++, m_stream_duration);
+        f->written = true;
+        m_stream_queue.pop_front();
+    }
+}
+
+void fcGifContext::resetStreamQueue()
+{
+    // all remaining frames are not written yet. see trim()
+    if (!m_stream) { return; }
+    std::unique_lock<std::mutex> lock(m_stream_mutex);
+    m_stream_queue.clear();
+    for (auto& f : m_gif_frames) {
+        m_stream_queue.push_back(f.get());
+    }
 }
 
 
-fcCLinkage fcExport fcIGifContext* fcGifCreateContextImpl(const fcGifConfig &conf, fcIGraphicsDevice *dev)
+fcCLinkage fcExport fcIGifContext* fcGifCreateContextImpl(const fcGifConfig &conf, fcIGraphicsDevice *dev, fcStream *stream)
 {
-    return new fcGifContext(conf, dev);
+    return new fcGifContext(conf, dev, stream);
 }
@@ -13,12 +13,14 @@ public:
     virtual void clearFrame() = 0;
     virtual int  getFrameCount() = 0;
     virtual void getFrameData(void *tex, int frame) = 0;
+    virtual bool getFramePixels(void *pixels, int frame) = 0;
     virtual int  getExpectedDataSize(int begin_frame, int end_frame) = 0;
     virtual void eraseFrame(int begin_frame, int end_frame) = 0;
 
 protected:
     virtual ~fcIGifContext() {}
 };
-typedef fcIGifContext* (*fcGifCreateContextImplT)(const fcGifConfig &conf, fcIGraphicsDevice*);
+// stream is optional. if not null, frames are written to it as they are encoded, and the trailer is written on release().
+typedef fcIGifContext* (*fcGifCreateContextImplT)(const fcGifConfig &conf, fcIGraphicsDevice*, fcStream *stream);
 
 #endif // fcGifFile_h
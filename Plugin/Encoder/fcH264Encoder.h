@@ -8,8 +8,19 @@ struct fcH264EncoderConfig
     int height;
     int target_bitrate;
     int max_framerate;
+    int num_threads; // 0 = one per core
+    int keyframe_interval;
+    fcMP4UsageType usage;
+    fcMP4Complexity complexity;
+    fcMP4SliceMode slice_mode;
+    int slice_count;
+    int slice_size;
 
-    fcH264EncoderConfig() : width(), height(), target_bitrate(), max_framerate() {}
+    fcH264EncoderConfig()
+        : width(), height(), target_bitrate(), max_framerate(), num_threads(), keyframe_interval()
+        , usage(fcMP4UsageType_ScreenRealtime), complexity(fcMP4Complexity_Medium)
+        , slice_mode(fcMP4SliceMode_FixedCount), slice_count(), slice_size()
+    {}
 };
 
 class fcIH264Encoder
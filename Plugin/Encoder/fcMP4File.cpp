@@ -6,6 +6,7 @@
 #include "fcH264Encoder.h"
 #include "fcAACEncoder.h"
 #include "fcMP4StreamWriter.h"
+#include "fcMP4ReplayBuffer.h"
 #include "GraphicsDevice/fcGraphicsDevice.h"
 #ifdef fcWindows
     #pragma comment(lib, "yuv.lib")
@@ -24,20 +25,38 @@ public:
     const char* getAudioEncoderInfo() override;
     const char* getVideoEncoderInfo() override;
 
-    void addOutputStream(fcStream *s) override;
+    void addOutputStream(fcStream *s, fcMP4DropPolicy policy, int max_queued_frames) override;
+    bool getOutputStreamStats(fcStream *s, fcMP4OutputStreamStats& stats) override;
+    void getVideoStats(fcMP4VideoStats& stats) override;
+    bool dumpReplay(fcStream *s, fcTime seconds, bool delete_stream) override;
+    bool isDumpingReplay() override;
     bool addVideoFrameTexture(void *tex, fcPixelFormat fmt, fcTime timestamp) override;
     bool addVideoFramePixels(const void *pixels, fcPixelFormat fmt, fcTime timestamps) override;
     bool addAudioFrame(const float *samples, int num_samples, fcTime timestamp) override;
 
 private:
-    typedef std::pair<fcVideoFrame, fcH264Frame> VideoFrame;
-    typedef std::pair<fcAudioFrame, fcAACFrame> AudioFrame;
+    // video frames go through 3 stages:
+    // RGBA -> I420 in row bands on the thread pool, H264 encode on m_video_worker, and muxing on m_mux_worker.
+    // conversion of a frame overlaps encoding of the previous one. sequence numbers keep the order.
+    struct VideoFrame
+    {
+        fcVideoFrame raw;
+        fcTaskGroup conversion;
+        uint64_t sequence;
+        bool rgba2i420;
+
+        VideoFrame() : sequence(), rgba2i420() {}
+    };
+    typedef std::unique_ptr<VideoFrame> VideoFramePtr;
+    typedef fcAudioFrame AudioFrame;
     typedef std::unique_ptr<fcMP4StreamWriter> StreamWriterPtr;
 
-    void enqueueVideoTask(const std::function<void()> &f);
+    void enqueueVideoFrame(VideoFrame& vf);
     void enqueueAudioTask(const std::function<void()> &f);
+    void enqueueMuxPacket(uint64_t sequence, const fcFrameDataPtr& packet);
     void processVideoTasks();
     void processAudioTasks();
+    void processMuxTasks();
 
     VideoFrame& getTempraryVideoFrame();
     void        returnTempraryVideoFrame(VideoFrame& v);
@@ -46,7 +65,9 @@ private:
 
     void resetEncoders();
     void waitAllTasksFinished();
-    void encodeVideoFrame(VideoFrame& vf, bool rgba2i420);
+    void beginConversion(VideoFrame& vf);
+    fcFrameDataPtr encodeVideoFrame(VideoFrame& vf);
+    void addStageTime(fcTime fcMP4VideoStats::*stage, fcTime begin);
 
     template<class Body>
     void eachStreams(const Body &b)
@@ -57,9 +78,9 @@ private:
 private:
     fcMP4Config m_conf;
     fcIGraphicsDevice *m_dev;
-    bool m_stop;
+    std::atomic_bool m_stop;
 
-    std::vector<VideoFrame>     m_tmp_video_frames;
+    std::vector<VideoFramePtr>  m_tmp_video_frames;
     std::vector<AudioFrame>     m_tmp_audio_frames;
     std::vector<VideoFrame*>    m_tmp_video_frames_unused;
     std::vector<AudioFrame*>    m_tmp_audio_frames_unused;
@@ -73,6 +94,22 @@ private:
     std::mutex m_video_mutex;
     std::condition_variable m_video_condition;
     std::deque<std::function<void()>> m_video_tasks;
+    uint64_t m_video_sequence;
+
+    std::atomic_int m_mux_pending_count;
+    std::thread m_mux_worker;
+    std::mutex m_mux_mutex;
+    std::condition_variable m_mux_condition;
+    std::condition_variable m_mux_space_condition;
+    std::map<uint64_t, fcFrameDataPtr> m_mux_packets; // sequence -> packet
+    uint64_t m_mux_next_sequence;
+
+    std::mutex m_stats_mutex;
+    fcMP4VideoStats m_video_stats;
+
+    std::unique_ptr<fcMP4ReplayBuffer> m_replay;
+    std::atomic_int m_replay_dump_count;
+    fcTime m_last_keyframe_time;
 
     std::atomic_int m_audio_active_task_count;
     std::thread m_audio_worker;
@@ -93,21 +130,31 @@ fcMP4Context::fcMP4Context(fcMP4Config &conf, fcIGraphicsDevice *dev)
     , m_dev(dev)
     , m_stop(false)
     , m_video_active_task_count(0)
+    , m_video_sequence(0)
+    , m_mux_pending_count(0)
+    , m_mux_next_sequence(0)
+    , m_replay_dump_count(0)
+    , m_last_keyframe_time(-1.0)
     , m_audio_active_task_count(0)
 {
     if (m_conf.video_max_buffers == 0) {
         m_conf.video_max_buffers = fcMP4DefaultMaxBuffers;
     }
+    if (m_conf.replay_duration > 0.0f) {
+        m_replay.reset(new fcMP4ReplayBuffer(m_conf.replay_duration, (size_t)std::max<int>(m_conf.replay_max_bytes, 0)));
+    }
 
     // allocate temporary buffers and start encoder threads
     if (m_conf.video) {
         m_tmp_video_frames.resize(m_conf.video_max_buffers);
         for (auto& v : m_tmp_video_frames) {
-            v.first.allocate(m_conf.video_width, m_conf.video_height);
-            m_tmp_video_frames_unused.push_back(&v);
+            v.reset(new VideoFrame());
+            v->raw.allocate(m_conf.video_width, m_conf.video_height);
+            m_tmp_video_frames_unused.push_back(v.get());
         }
 
         m_video_worker = std::thread([this]() { processVideoTasks(); });
+        m_mux_worker = std::thread([this]() { processMuxTasks(); });
     }
     if (m_conf.audio) {
         m_tmp_audio_frames.resize(m_conf.video_max_buffers);
@@ -138,17 +185,25 @@ fcMP4Context::fcMP4Context(fcMP4Config &conf, fcIGraphicsDevice *dev)
 
 fcMP4Context::~fcMP4Context()
 {
-    // stop encoder threads
+    // finish queued frames and stop encoder threads
+    waitAllTasksFinished();
+    while (m_replay_dump_count > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
     m_stop = true;
+    // a worker between its m_stop check and wait() holds its mutex. taking it makes sure the notification is not lost.
+    auto stop_worker = [](std::thread& worker, std::mutex& mutex, std::condition_variable& cond) {
+        { std::unique_lock<std::mutex> lock(mutex); }
+        cond.notify_all();
+        worker.join();
+    };
     if (m_conf.video) {
-        m_video_condition.notify_all();
-        m_video_worker.join();
+        stop_worker(m_video_worker, m_video_mutex, m_video_condition);
+        stop_worker(m_mux_worker, m_mux_mutex, m_mux_condition);
     }
     if (m_conf.audio) {
-        m_audio_condition.notify_all();
-        m_audio_worker.join();
+        stop_worker(m_audio_worker, m_audio_mutex, m_audio_condition);
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
 #ifndef fcMaster
     m_dbg_h264_out.reset();
@@ -170,6 +225,13 @@ void fcMP4Context::resetEncoders()
         h264conf.height = m_conf.video_height;
         h264conf.max_framerate = m_conf.video_max_framerate;
         h264conf.target_bitrate = m_conf.video_bitrate;
+        h264conf.num_threads = m_conf.video_threads;
+        h264conf.keyframe_interval = m_conf.video_keyframe_interval;
+        h264conf.usage = m_conf.video_usage;
+        h264conf.complexity = m_conf.video_complexity;
+        h264conf.slice_mode = m_conf.video_slice_mode;
+        h264conf.slice_count = m_conf.video_slice_count;
+        h264conf.slice_size = m_conf.video_slice_size;
 
         fcIH264Encoder *enc = nullptr;
         // try to create hardware encoder
@@ -198,11 +260,23 @@ void fcMP4Context::resetEncoders()
     }
 }
 
-void fcMP4Context::enqueueVideoTask(const std::function<void()> &f)
+void fcMP4Context::enqueueVideoFrame(VideoFrame& vf)
 {
+    ++m_video_active_task_count;
+    if (vf.rgba2i420) {
+        beginConversion(vf);
+    }
     {
+        // sequence numbers follow the order of the encode queue
         std::unique_lock<std::mutex> lock(m_video_mutex);
-        m_video_tasks.push_back(std::function<void()>(f));
+        vf.sequence = m_video_sequence++;
+        m_video_tasks.push_back([this, &vf]() {
+            auto packet = encodeVideoFrame(vf);
+            uint64_t sequence = vf.sequence;
+            returnTempraryVideoFrame(vf);
+            enqueueMuxPacket(sequence, packet);
+            --m_video_active_task_count;
+        });
     }
     m_video_condition.notify_one();
 }
@@ -216,9 +290,23 @@ void fcMP4Context::enqueueAudioTask(const std::function<void()> &f)
     m_audio_condition.notify_one();
 }
 
+void fcMP4Context::enqueueMuxPacket(uint64_t sequence, const fcFrameDataPtr& packet)
+{
+    {
+        // keep encoded packets bounded if output streams block
+        std::unique_lock<std::mutex> lock(m_mux_mutex);
+        while (m_mux_packets.size() >= (size_t)m_conf.video_max_buffers) {
+            m_mux_space_condition.wait(lock);
+        }
+        m_mux_packets[sequence] = packet;
+        ++m_mux_pending_count;
+    }
+    m_mux_condition.notify_one();
+}
+
 void fcMP4Context::waitAllTasksFinished()
 {
-    while (m_video_active_task_count > 0 || m_audio_active_task_count > 0) {
+    while (m_video_active_task_count > 0 || m_mux_pending_count > 0 || m_audio_active_task_count > 0) {
         std::this_thread::yield();
     }
 }
@@ -296,6 +384,41 @@ void fcMP4Context::processVideoTasks()
     }
 }
 
+void fcMP4Context::processMuxTasks()
+{
+    while (!m_stop)
+    {
+        fcFrameDataPtr packet;
+        {
+            // deliver packets in sequence order
+            std::unique_lock<std::mutex> lock(m_mux_mutex);
+            while (!m_stop && (m_mux_packets.empty() || m_mux_packets.begin()->first != m_mux_next_sequence)) {
+                m_mux_condition.wait(lock);
+            }
+            if (m_stop) { return; }
+
+            packet = m_mux_packets.begin()->second;
+            m_mux_packets.erase(m_mux_packets.begin());
+            ++m_mux_next_sequence;
+        }
+        m_mux_space_condition.notify_one();
+
+        fcTime begin = GetCurrentTimeSec();
+        if (packet) {
+            eachStreams([&](auto& s) { s.addFrame(packet); });
+            if (m_replay) {
+                m_replay->addFrame(packet);
+            }
+        }
+        addStageTime(&fcMP4VideoStats::mux_time, begin);
+        {
+            std::unique_lock<std::mutex> lock(m_stats_mutex);
+            ++m_video_stats.num_frames;
+        }
+        --m_mux_pending_count;
+    }
+}
+
 void fcMP4Context::processAudioTasks()
 {
     while (!m_stop)
@@ -333,44 +456,136 @@ const char* fcMP4Context::getVideoEncoderInfo()
     return m_h264_encoder->getEncoderInfo();
 }
 
-void fcMP4Context::addOutputStream(fcStream *s)
+void fcMP4Context::addOutputStream(fcStream *s, fcMP4DropPolicy policy, int max_queued_frames)
 {
-    auto writer = new fcMP4StreamWriter(*s, m_conf);
+    if (!s) { return; }
+
+    auto writer = new fcMP4StreamWriter(*s, m_conf, policy, max_queued_frames);
     if (m_aac_encoder) {
         writer->setAACEncoderInfo(m_aac_encoder->getDecoderSpecificInfo());
     }
     m_streams.emplace_back(StreamWriterPtr(writer));
 }
 
-void fcMP4Context::encodeVideoFrame(VideoFrame& vf, bool rgba2i420)
+bool fcMP4Context::getOutputStreamStats(fcStream *s, fcMP4OutputStreamStats& stats)
 {
-    auto& raw = vf.first;
-    auto& h264 = vf.second;
+    for (auto& w : m_streams) {
+        if (&w->getStream() == s) {
+            w->getStats(stats);
+            return true;
+        }
+    }
+    return false;
+}
 
-    // 必要であれば RGBA -> I420 変換
-    int width = m_conf.video_width;
-    int frame_size = m_conf.video_width * m_conf.video_height;
-    uint8 *y = (uint8*)raw.i420.y;
-    uint8 *u = (uint8*)raw.i420.u;
-    uint8 *v = (uint8*)raw.i420.v;
-    if (rgba2i420) {
-        libyuv::ABGRToI420(
-            (uint8*)&raw.rgba[0], width * 4,
-            y, width,
-            u, width >> 1,
-            v, width >> 1,
-            m_conf.video_width, m_conf.video_height );
+void fcMP4Context::addStageTime(fcTime fcMP4VideoStats::*stage, fcTime begin)
+{
+    fcTime elapsed = GetCurrentTimeSec() - begin;
+    std::unique_lock<std::mutex> lock(m_stats_mutex);
+    m_video_stats.*stage += elapsed;
+}
+
+void fcMP4Context::getVideoStats(fcMP4VideoStats& stats)
+{
+    std::unique_lock<std::mutex> lock(m_stats_mutex);
+    stats = m_video_stats;
+}
+
+void fcMP4Context::beginConversion(VideoFrame& vf)
+{
+    // RGBA -> I420 in row bands. band height must be even because chroma planes are subsampled vertically.
+    const int band_height = 64;
+    const int width = m_conf.video_width;
+    const int height = m_conf.video_height;
+    int num_bands = (height + band_height - 1) / band_height;
+    for (int bi = 0; bi < num_bands; ++bi) {
+        vf.conversion.run([this, &vf, bi, band_height, width, height]() {
+            fcTime begin = GetCurrentTimeSec();
+            auto& raw = vf.raw;
+            int y = bi * band_height;
+            libyuv::ABGRToI420(
+                (uint8*)&raw.rgba[width * 4 * y], width * 4,
+                (uint8*)raw.i420.y + width * y, width,
+                (uint8*)raw.i420.u + (width >> 1) * (y >> 1), width >> 1,
+                (uint8*)raw.i420.v + (width >> 1) * (y >> 1), width >> 1,
+                width, std::min<int>(band_height, height - y));
+            addStageTime(&fcMP4VideoStats::convert_time, begin);
+        });
+    }
+}
+
+fcFrameDataPtr fcMP4Context::encodeVideoFrame(VideoFrame& vf)
+{
+    auto& raw = vf.raw;
+
+    // conversion of this frame started when it was queued. it is usually done by now.
+    if (vf.rgba2i420) {
+        fcTime begin = GetCurrentTimeSec();
+        vf.conversion.wait();
+        addStageTime(&fcMP4VideoStats::convert_wait_time, begin);
     }
 
     // I420 のピクセルデータを H264 へエンコード
-    h264.clear();
-    h264.timestamp = raw.timestamp;
-    m_h264_encoder->encode(h264, raw.i420, raw.timestamp);
+    // the encoded frame is shared by all output streams. each stream writes it on its own thread.
+    // the replay buffer is cut at keyframes. force them so that any window can start close to where it is asked.
+    bool force_keyframe = m_replay && m_conf.replay_keyframe_interval > 0.0f &&
+        (m_last_keyframe_time < 0.0 || raw.timestamp - m_last_keyframe_time >= m_conf.replay_keyframe_interval);
+    // streams that dropped frames wait for a keyframe
+    eachStreams([&](auto& s) { force_keyframe |= s.takeKeyframeRequest(); });
+
+    fcTime begin = GetCurrentTimeSec();
+    auto h264 = std::make_shared<fcH264Frame>();
+    h264->timestamp = raw.timestamp;
+    m_h264_encoder->encode(*h264, raw.i420, raw.timestamp, force_keyframe);
+    addStageTime(&fcMP4VideoStats::encode_time, begin);
+    if (h264->h264_type == fcH264FrameType_IDR) {
+        m_last_keyframe_time = raw.timestamp;
+    }
 
-    eachStreams([&](auto& s) { s.addFrame(h264); });
 #ifndef fcMaster
-    m_dbg_h264_out->write(h264.data.ptr(), h264.data.size());
+    m_dbg_h264_out->write(h264->data.ptr(), h264->data.size());
 #endif // fcMaster
+    return h264;
+}
+
+
+bool fcMP4Context::dumpReplay(fcStream *s, fcTime seconds, bool delete_stream)
+{
+    if (!m_replay) {
+        fcDebugLog("fcMP4Context::dumpReplay(): replay is not enabled.");
+        if (delete_stream) { delete s; }
+        return false;
+    }
+
+    // take the packets now. they are shared with the buffer, so this doesn't copy frame data.
+    auto packets = std::make_shared<std::vector<fcFrameDataPtr>>();
+    m_replay->getWindow(seconds, *packets);
+    if (packets->empty()) {
+        fcDebugLog("fcMP4Context::dumpReplay(): replay buffer is empty.");
+        if (delete_stream) { delete s; }
+        return false;
+    }
+
+    ++m_replay_dump_count;
+    std::thread([this, s, packets, delete_stream]() {
+        {
+            fcMP4StreamWriter writer(*s, m_conf);
+            if (m_aac_encoder) {
+                writer.setAACEncoderInfo(m_aac_encoder->getDecoderSpecificInfo());
+            }
+            for (auto& p : *packets) {
+                writer.addFrame(p);
+            }
+        }
+        if (delete_stream) { delete s; }
+        --m_replay_dump_count;
+    }).detach();
+    return true;
+}
+
+bool fcMP4Context::isDumpingReplay()
+{
+    return m_replay_dump_count > 0;
 }
 
 
@@ -386,8 +601,7 @@ bool fcMP4Context::addVideoFrameTexture(void *tex, fcPixelFormat fmt, fcTime tim
     }
 
     VideoFrame& vf = getTempraryVideoFrame();
-    auto& raw = vf.first;
-    auto& h264 = vf.second;
+    auto& raw = vf.raw;
     raw.timestamp = timestamp >= 0.0 ? timestamp : GetCurrentTimeSec();
 
     // フレームバッファの内容取得
@@ -410,12 +624,8 @@ bool fcMP4Context::addVideoFrameTexture(void *tex, fcPixelFormat fmt, fcTime tim
     }
 
     // h264 データを生成
-    ++m_video_active_task_count;
-    enqueueVideoTask([this, &vf](){
-        encodeVideoFrame(vf, true);
-        returnTempraryVideoFrame(vf);
-        --m_video_active_task_count;
-    });
+    vf.rgba2i420 = true;
+    enqueueVideoFrame(vf);
 
     return true;
 }
@@ -428,13 +638,12 @@ bool fcMP4Context::addVideoFramePixels(const void *pixels, fcPixelFormat fmt, fc
     }
 
     VideoFrame& vf = getTempraryVideoFrame();
-    auto& raw = vf.first;
-    auto& h264 = vf.second;
+    auto& raw = vf.raw;
     raw.timestamp = timestamp >= 0.0 ? timestamp : GetCurrentTimeSec();
 
-    bool rgba2i420 = true;
+    vf.rgba2i420 = true;
     if (fmt == fcPixelFormat_I420) {
-        rgba2i420 = false;
+        vf.rgba2i420 = false;
 
         int frame_size = m_conf.video_width * m_conf.video_height;
         const uint8_t *src_y = (const uint8_t*)pixels;
@@ -452,12 +661,7 @@ bool fcMP4Context::addVideoFramePixels(const void *pixels, fcPixelFormat fmt, fc
     }
 
     // h264 データを生成
-    ++m_video_active_task_count;
-    enqueueVideoTask([this, &vf, rgba2i420](){
-        encodeVideoFrame(vf, rgba2i420);
-        returnTempraryVideoFrame(vf);
-        --m_video_active_task_count;
-    });
+    enqueueVideoFrame(vf);
 
     return true;
 }
@@ -469,17 +673,15 @@ bool fcMP4Context::addAudioFrame(const float *samples, int num_samples, fcTime t
         return false;
     }
 
-    AudioFrame& af = getTempraryAudioFrame();
-    auto& raw = af.first;
-    auto& aac = af.second;
+    AudioFrame& raw = getTempraryAudioFrame();
     raw.timestamp = timestamp >= 0.0 ? timestamp : GetCurrentTimeSec();
     raw.data = Buffer(samples, sizeof(float)*num_samples);
 
     // aac encode
     ++m_audio_active_task_count;
-    enqueueAudioTask([this, &aac, &raw, &af](){
-        aac.clear();
-        aac.timestamp = raw.timestamp;
+    enqueueAudioTask([this, &raw](){
+        auto aac = std::make_shared<fcAACFrame>();
+        aac->timestamp = raw.timestamp;
 
         // apply audio_scale
         if (m_conf.audio_scale != 1.0f) {
@@ -488,14 +690,18 @@ bool fcMP4Context::addAudioFrame(const float *samples, int num_samples, fcTime t
             fcScaleArray(samples, num_samples, m_conf.audio_scale);
         }
 
-        m_aac_encoder->encode(aac, (float*)raw.data.ptr(), raw.data.size() / sizeof(float));
+        m_aac_encoder->encode(*aac, (float*)raw.data.ptr(), raw.data.size() / sizeof(float));
 
-        eachStreams([&](auto& s) { s.addFrame(aac); });
+        fcFrameDataPtr frame = aac;
+        eachStreams([&](auto& s) { s.addFrame(frame); });
+        if (m_replay) {
+            m_replay->addFrame(frame);
+        }
 #ifndef fcMaster
-        m_dbg_aac_out->write(aac.data.ptr(), aac.data.size());
+        m_dbg_aac_out->write(aac->data.ptr(), aac->data.size());
 #endif // fcMaster
 
-        returnTempraryAudioFrame(af);
+        returnTempraryAudioFrame(raw);
         --m_audio_active_task_count;
     });
 
@@ -9,7 +9,14 @@ public:
     virtual const char* getAudioEncoderInfo() = 0;
     virtual const char* getVideoEncoderInfo() = 0;
 
-    virtual void addOutputStream(fcStream *s) = 0;
+    // frames are written to s by its own thread. the queue is bounded by max_queued_frames (0 = unbounded).
+    virtual void addOutputStream(fcStream *s, fcMP4DropPolicy policy = fcMP4DropPolicy_Block, int max_queued_frames = 0) = 0;
+    virtual bool getOutputStreamStats(fcStream *s, fcMP4OutputStreamStats& stats) = 0;
+    virtual void getVideoStats(fcMP4VideoStats& stats) = 0;
+
+    // s is deleted when the dump is done if delete_stream is true
+    virtual bool dumpReplay(fcStream *s, fcTime seconds, bool delete_stream) = 0;
+    virtual bool isDumpingReplay() = 0;
 
     // assume texture format is RGBA8.
     // timestamp=-1 is treated as current time.
@@ -152,6 +152,9 @@ struct fcAACFrame : public fcFrameData
     }
 };
 
+// encoded frames are shared by all output streams
+typedef std::shared_ptr<fcFrameData> fcFrameDataPtr;
+
 
 struct fcFrameInfo
 {
@@ -0,0 +1,170 @@
+#include "pch.h"
+#include <openh264/codec_api.h>
+#include "fcMP4Internal.h"
+#include "fcMP4ReplayBuffer.h"
+
+
+namespace {
+
+// only IDR frames are random access points. decoding from a non-IDR I frame may refer to frames before it.
+bool fcIsKeyframe(const fcFrameData& frame)
+{
+    if (frame.type != fcFrameType_H264) { return false; }
+    return ((const fcH264Frame&)frame).h264_type == fcH264FrameType_IDR;
+}
+
+bool fcHasParameterSets(const fcH264Frame& frame)
+{
+    bool ret = false;
+    frame.eachNALs([&](const char *data, int size) {
+        if (fcH264NALHeader(data[4]).nal_unit_type == NAL_SPS) { ret = true; }
+    });
+    return ret;
+}
+
+} // namespace
+
+
+fcMP4ReplayBuffer::fcMP4ReplayBuffer(fcTime duration, size_t max_bytes)
+    : m_duration(duration), m_max_bytes(max_bytes)
+    , m_video_bytes(), m_audio_bytes()
+{
+}
+
+void fcMP4ReplayBuffer::addFrame(const fcFrameDataPtr& frame)
+{
+    if (!frame || frame->data.empty()) { return; }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (frame->type == fcFrameType_H264) {
+        const auto& h264 = (const fcH264Frame&)*frame;
+        if (fcIsKeyframe(h264)) {
+            m_gops.push_back(GOP());
+        }
+        // frames before the first keyframe can't be decoded
+        if (m_gops.empty()) { return; }
+
+        // keep sps / pps. the first frame of a window may not have them.
+        if (fcHasParameterSets(h264)) {
+            m_parameter_sets.clear();
+            m_parameter_set_sizes.clear();
+            h264.eachNALs([&](const char *data, int size) {
+                auto type = fcH264NALHeader(data[4]).nal_unit_type;
+                if (type == NAL_SPS || type == NAL_PPS) {
+                    m_parameter_sets.append(data, size);
+                    m_parameter_set_sizes.push_back(size);
+                }
+            });
+        }
+
+        auto& gop = m_gops.back();
+        gop.frames.push_back(frame);
+        gop.bytes += frame->data.size();
+        m_video_bytes += frame->data.size();
+    }
+    else if (frame->type == fcFrameType_AAC) {
+        m_audio.push_back(frame);
+        m_audio_bytes += frame->data.size();
+    }
+    trim();
+}
+
+void fcMP4ReplayBuffer::trim()
+{
+    auto pop_audio = [this]() {
+        m_audio_bytes -= m_audio.front()->data.size();
+        m_audio.pop_front();
+    };
+
+    if (!m_gops.empty()) {
+        // drop the oldest GOP while the rest still covers the duration, or the buffer is too large.
+        // the newest GOP is never dropped, so a GOP larger than m_max_bytes exceeds the limit.
+        fcTime newest = m_gops.back().frames.back()->timestamp;
+        while (m_gops.size() > 1) {
+            bool too_long = newest - m_gops[1].frames.front()->timestamp >= m_duration;
+            bool too_large = m_max_bytes > 0 && m_video_bytes + m_audio_bytes > m_max_bytes;
+            if (!too_long && !too_large) { break; }
+            m_video_bytes -= m_gops.front().bytes;
+            m_gops.pop_front();
+        }
+
+        // keep audio from the frame that overlaps the first video frame
+        fcTime begin = m_gops.front().frames.front()->timestamp;
+        while (m_audio.size() > 1 && m_audio[1]->timestamp <= begin) {
+            pop_audio();
+        }
+    }
+    else if (!m_audio.empty()) {
+        fcTime newest = m_audio.back()->timestamp;
+        while (m_audio.size() > 1) {
+            bool too_long = newest - m_audio[1]->timestamp >= m_duration;
+            bool too_large = m_max_bytes > 0 && m_audio_bytes > m_max_bytes;
+            if (!too_long && !too_large) { break; }
+            pop_audio();
+        }
+    }
+}
+
+size_t fcMP4ReplayBuffer::getSize()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_video_bytes + m_audio_bytes;
+}
+
+void fcMP4ReplayBuffer::getWindow(fcTime seconds, std::vector<fcFrameDataPtr>& dst)
+{
+    std::vector<fcFrameDataPtr> video;
+    std::vector<fcFrameDataPtr> audio;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        fcTime begin = 0.0;
+        if (!m_gops.empty()) {
+            // start at the latest keyframe that gives at least 'seconds'
+            size_t first = 0;
+            if (seconds > 0.0) {
+                fcTime end = m_gops.back().frames.back()->timestamp;
+                for (size_t gi = m_gops.size(); gi-- > 0; ) {
+                    if (end - m_gops[gi].frames.front()->timestamp >= seconds) {
+                        first = gi;
+                        break;
+                    }
+                }
+            }
+            for (size_t gi = first; gi < m_gops.size(); ++gi) {
+                video.insert(video.end(), m_gops[gi].frames.begin(), m_gops[gi].frames.end());
+            }
+            begin = video.front()->timestamp;
+
+            for (size_t ai = 0; ai < m_audio.size(); ++ai) {
+                if (ai + 1 < m_audio.size() && m_audio[ai + 1]->timestamp <= begin) { continue; }
+                audio.push_back(m_audio[ai]);
+            }
+        }
+        else if (!m_audio.empty()) {
+            begin = seconds > 0.0 ? m_audio.back()->timestamp - seconds : m_audio.front()->timestamp;
+            for (auto& a : m_audio) {
+                if (a->timestamp >= begin) { audio.push_back(a); }
+            }
+        }
+
+        // the first frame must carry sps / pps to make the window a standalone stream
+        if (!video.empty() && !fcHasParameterSets((const fcH264Frame&)*video.front()) && !m_parameter_sets.empty()) {
+            const auto& src = (const fcH264Frame&)*video.front();
+            auto first = std::make_shared<fcH264Frame>();
+            first->timestamp = src.timestamp;
+            first->h264_type = src.h264_type;
+            first->data.append(m_parameter_sets.ptr(), m_parameter_sets.size());
+            first->data.append(src.data.ptr(), src.data.size());
+            first->nal_sizes = m_parameter_set_sizes;
+            first->nal_sizes.insert(first->nal_sizes.end(), src.nal_sizes.begin(), src.nal_sizes.end());
+            video.front() = first;
+        }
+    }
+
+    // interleave by timestamp
+    dst.clear();
+    dst.reserve(video.size() + audio.size());
+    std::merge(video.begin(), video.end(), audio.begin(), audio.end(), std::back_inserter(dst),
+        [](const fcFrameDataPtr& a, const fcFrameDataPtr& b) { return a->timestamp < b->timestamp; });
+}
@@ -0,0 +1,40 @@
+#ifndef fcMP4ReplayBuffer_h
+#define fcMP4ReplayBuffer_h
+
+// keeps the latest encoded packets for instant replay.
+// video is kept in whole GOPs so that the oldest packet is always an IDR frame.
+class fcMP4ReplayBuffer
+{
+public:
+    // max_bytes=0 means no limit. the latest GOP is always kept even if it is larger than max_bytes.
+    fcMP4ReplayBuffer(fcTime duration, size_t max_bytes);
+    void addFrame(const fcFrameDataPtr& frame); // thread safe
+
+    // packets of the last 'seconds' (all if <= 0) in timestamp order. video starts with a keyframe.
+    void getWindow(fcTime seconds, std::vector<fcFrameDataPtr>& dst);
+    size_t getSize();
+
+private:
+    struct GOP
+    {
+        std::vector<fcFrameDataPtr> frames;
+        size_t bytes;
+
+        GOP() : bytes() {}
+    };
+
+    void trim();
+
+private:
+    std::mutex m_mutex;
+    fcTime m_duration;
+    size_t m_max_bytes;
+    std::deque<GOP> m_gops;
+    std::deque<fcFrameDataPtr> m_audio;
+    size_t m_video_bytes;
+    size_t m_audio_bytes;
+    Buffer m_parameter_sets; // latest sps / pps NALs
+    std::vector<int> m_parameter_set_sizes;
+};
+
+#endif // fcMP4ReplayBuffer_h
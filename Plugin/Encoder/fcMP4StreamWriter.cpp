@@ -4,6 +4,8 @@
 #include "fcMP4StreamWriter.h"
 
 #define fcMP464BitLength
+#define fcMP4DefaultFragmentDuration 2.0f
+#define fcMP4RelocationBlockSize (4 * 1024 * 1024)
 
 
 namespace {
@@ -33,6 +35,66 @@ private:
 };
 
 
+// write-only stream on top of std::vector. used to build boxes in memory so that
+// the output stream only ever gets appended to.
+class VectorStream : public BinaryStream
+{
+public:
+    VectorStream(std::vector<u8>& buf) : m_buf(buf), m_wpos(buf.size()) {}
+
+    size_t tellg() override { return 0; }
+    void seekg(size_t /*pos*/) override {}
+    size_t read(void* /*dst*/, size_t /*len*/) override { return 0; }
+
+    size_t tellp() override { return m_wpos; }
+    void seekp(size_t pos) override { m_wpos = std::min<size_t>(pos, m_buf.size()); }
+    size_t write(const void *data, size_t len) override
+    {
+        if (m_buf.size() < m_wpos + len) {
+            m_buf.resize(m_wpos + len);
+        }
+        memcpy(&m_buf[m_wpos], data, len);
+        m_wpos += len;
+        return len;
+    }
+
+private:
+    std::vector<u8>& m_buf;
+    size_t m_wpos;
+};
+
+
+const u32 fcMP4SyncSampleFlags      = 0x02000000; // sample_depends_on = 2 (I-frame)
+const u32 fcMP4NonSyncSampleFlags   = 0x01010000; // sample_depends_on = 1, sample_is_non_sync_sample = 1
+
+inline void fcAppendBE(std::vector<u8>& dst, u32 v)
+{
+    u32 be = u32_be(v);
+    dst.insert(dst.end(), (const u8*)&be, (const u8*)&be + 4);
+}
+
+// serializes a table as big endian with one write. body fills tmp with native values.
+template<class T, class Body>
+void fcWriteTable(BinaryStream& bs, TBuffer<T>& tmp, size_t num, const Body& body)
+{
+    if (num == 0) { return; }
+    if (tmp.size() < num) {
+        tmp.resize(num);
+    }
+    body(tmp.ptr());
+    fcSwapBytesArray(tmp.ptr(), num);
+    bs.write(tmp.ptr(), sizeof(T) * num);
+}
+
+// streams created by fcCreateCustomStream() have no read functions
+bool fcIsReadable(BinaryStream& s)
+{
+    if (auto *cs = dynamic_cast<CustomStream*>(&s)) {
+        return cs->get().read != nullptr && cs->get().seekg != nullptr;
+    }
+    return true;
+}
+
 time_t fcGetMacTime()
 {
     return time(0) + 2082844800;
@@ -41,30 +103,177 @@ time_t fcGetMacTime()
 } // namespace
 
 
-fcMP4StreamWriter::fcMP4StreamWriter(BinaryStream& stream, const fcMP4Config &conf)
+fcMP4StreamWriter::fcMP4StreamWriter(BinaryStream& stream, const fcMP4Config &conf, fcMP4DropPolicy policy, int max_queued_frames)
     : m_stream(stream)
     , m_conf(conf)
-    , m_mdat_begin(), m_mdat_end()
+    , m_drop_policy(policy), m_max_queued_frames((size_t)std::max<int>(max_queued_frames, 0))
+    , m_stop(false), m_waiting_keyframe(false), m_keyframe_requested(false), m_audio_gap()
+    , m_queued_bytes(), m_written_frames(), m_dropped_frames(), m_max_lag()
+    , m_moov_space_begin(), m_mdat_begin(), m_mdat_end()
+    , m_frag_sequence(), m_frag_moov_written(), m_frag_has_audio(), m_frag_has_video(), m_frag_keyframe_requested()
+    , m_video_time_base(-1.0), m_video_decode_time(), m_video_last_duration(), m_audio_decode_time()
 {
+    if (m_conf.fragment_duration <= 0.0f) {
+        m_conf.fragment_duration = fcMP4DefaultFragmentDuration;
+    }
     mp4Begin();
+    m_writer = std::thread([this]() { processFrames(); });
 }
 
 fcMP4StreamWriter::~fcMP4StreamWriter()
 {
+    // write remaining frames and stop the writer thread
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_queue_condition.notify_all();
+    m_writer.join();
+
     mp4End();
 }
 
+void fcMP4StreamWriter::addFrame(const fcFrameDataPtr& frame)
+{
+    if (!frame || frame->data.empty()) { return; }
+
+    bool is_video = frame->type == fcFrameType_H264;
+    bool keyframe = false;
+    if (is_video) {
+        auto type = ((const fcH264Frame&)*frame).h264_type;
+        keyframe = type == fcH264FrameType_IDR || type == fcH264FrameType_I;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto drop = [&]() {
+        ++m_dropped_frames;
+        if (is_video) {
+            // the encoder may not emit keyframes on its own. ask for one so that video can resume.
+            m_waiting_keyframe = true;
+            m_keyframe_requested = true;
+        }
+        else if (frame->type == fcFrameType_AAC) {
+            // keep audio decode times in sync
+            for (int raw_size : ((const fcAACFrame&)*frame).raw_block_sizes) {
+                m_audio_gap += raw_size;
+            }
+        }
+    };
+
+    if (m_max_queued_frames > 0 && m_queue.size() >= m_max_queued_frames) {
+        if (m_drop_policy == fcMP4DropPolicy_DropUntilKeyframe) {
+            drop();
+            return;
+        }
+        while (m_queue.size() >= m_max_queued_frames) {
+            m_space_condition.wait(lock);
+        }
+    }
+    if (is_video && m_waiting_keyframe) {
+        if (!keyframe) {
+            drop();
+            return;
+        }
+        m_waiting_keyframe = false;
+    }
+
+    QueuedFrame qf;
+    qf.frame = frame;
+    qf.queued_time = GetCurrentTimeSec();
+    if (frame->type == fcFrameType_AAC) {
+        qf.audio_gap = m_audio_gap;
+        m_audio_gap = 0;
+    }
+    m_queue.push_back(qf);
+    m_queued_bytes += frame->data.size();
+    lock.unlock();
+    m_queue_condition.notify_one();
+}
+
+void fcMP4StreamWriter::processFrames()
+{
+    for (;;) {
+        QueuedFrame qf;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (!m_stop && m_queue.empty()) {
+                m_queue_condition.wait(lock);
+            }
+            if (m_queue.empty()) { return; } // stopped and all frames are written
+
+            qf = m_queue.front();
+            m_queue.pop_front();
+            m_queued_bytes -= qf.frame->data.size();
+        }
+        m_space_condition.notify_one();
+
+        if (qf.audio_gap > 0) {
+            skipAudio(qf.audio_gap);
+        }
+        writeFrame(*qf.frame);
+        qf.frame.reset();
+
+        fcTime lag = GetCurrentTimeSec() - qf.queued_time;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        ++m_written_frames;
+        m_max_lag = std::max<fcTime>(m_max_lag, lag);
+    }
+}
+
+void fcMP4StreamWriter::getStats(fcMP4OutputStreamStats& dst)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    dst.queued_frames = (int)m_queue.size();
+    dst.written_frames = m_written_frames;
+    dst.dropped_frames = m_dropped_frames;
+    dst.queued_bytes = m_queued_bytes;
+    dst.lag = m_queue.empty() ? 0.0 : GetCurrentTimeSec() - m_queue.front().queued_time;
+    dst.max_lag = m_max_lag;
+}
+
+bool fcMP4StreamWriter::hasAudioTrack() const
+{
+    return m_conf.fragmented ? m_frag_has_audio : !m_audio_frame_info.empty();
+}
+
+bool fcMP4StreamWriter::hasVideoTrack() const
+{
+    return m_conf.fragmented ? m_frag_has_video : !m_video_frame_info.empty();
+}
+
 void fcMP4StreamWriter::mp4Begin()
 {
     BinaryStream& os = m_stream;
+    if (m_conf.fragmented) {
+        // moov is written along with the first fragment because avcC needs sps / pps
+        os  << u32_be(0x1C)
+            << u32_be('ftyp')
+            << u32_be('iso5')
+            << u32_be(0x00)
+            << u32_be('iso5')
+            << u32_be('iso6')
+            << u32_be('mp41');
+        return;
+    }
+
     os  << u32_be(0x18)
         << u32_be('ftyp')
         << u32_be('mp42')
         << u32_be(0x00)
         << u32_be('mp42')
-        << u32_be('isom')
-        << u32_be(0x8)
+        << u32_be('isom');
+
+    // with faststart, moov is written over this free box if it fits
+    m_moov_space_begin = os.tellp();
+    u32 reserved = m_conf.faststart ? (u32)std::max<int>(m_conf.moov_reserved_size, 0) : 0;
+    os  << u32_be(0x8 + reserved)
         << u32_be('free');
+    if (reserved > 0) {
+        std::vector<u8> zeros(std::min<u32>(reserved, 0x10000));
+        for (u32 pos = 0; pos < reserved; pos += (u32)zeros.size()) {
+            os.write(zeros.data(), std::min<u32>(reserved - pos, (u32)zeros.size()));
+        }
+    }
 
     m_mdat_begin = os.tellp();
 
@@ -76,11 +285,12 @@ void fcMP4StreamWriter::mp4Begin()
         ;
 }
 
-void fcMP4StreamWriter::addFrame(const fcFrameData& frame)
+void fcMP4StreamWriter::writeFrame(const fcFrameData& frame)
 {
-    if (frame.data.empty()) { return; }
-
-    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_conf.fragmented) {
+        addFragmentFrame(frame);
+        return;
+    }
     BinaryStream& os = m_stream;
 
     // video frame
@@ -90,7 +300,7 @@ void fcMP4StreamWriter::addFrame(const fcFrameData& frame)
         info.file_offset = os.tellp();
         info.timestamp = frame.timestamp;
 
-        if (h264.h264_type == fcH264FrameType_I) {
+        if (h264.h264_type == fcH264FrameType_IDR || h264.h264_type == fcH264FrameType_I) {
             m_iframe_ids.push_back((uint32_t)m_video_frame_info.size() + 1);
         }
 
@@ -137,31 +347,243 @@ void fcMP4StreamWriter::addFrame(const fcFrameData& frame)
     }
 }
 
+void fcMP4StreamWriter::skipAudio(u32 num_samples)
+{
+    // flat mp4 computes durations from timestamps. fragments advance by sample count and need the gap.
+    if (!m_conf.fragmented) { return; }
+
+    auto& t = m_frag_audio;
+    if (!t.durations.empty()) {
+        t.durations.back() += num_samples;
+    }
+    m_audio_decode_time += num_samples;
+}
+
 void fcMP4StreamWriter::setAACEncoderInfo(const Buffer& aacheader)
 {
+    std::unique_lock<std::mutex> lock(m_mutex);
     u8 *ptr = (u8*)aacheader.ptr();
     m_audio_encoder_info.assign(ptr, ptr + aacheader.size());
 }
 
+void fcMP4StreamWriter::addFragmentFrame(const fcFrameData& frame)
+{
+    // video frame
+    if (frame.type == fcFrameType_H264) {
+        const auto& h264 = (const fcH264Frame&)frame;
+        const u64 fragment_length = u64(m_conf.fragment_duration * 1000.0); // sec to millisec
+        bool keyframe = h264.h264_type == fcH264FrameType_IDR || h264.h264_type == fcH264FrameType_I;
+        auto& t = m_frag_video;
+
+        // decode times are computed from the first timestamp to avoid accumulating rounding errors
+        if (m_video_time_base < 0.0) {
+            m_video_time_base = frame.timestamp;
+        }
+        u64 decode_time = (u64)std::max<fcTime>(std::round((frame.timestamp - m_video_time_base) * 1000.0), 0.0);
+        decode_time = std::max<u64>(decode_time, m_video_decode_time);
+
+        if (!t.sizes.empty()) {
+            // duration of the previous sample is known now
+            m_video_last_duration = u32(decode_time - m_video_decode_time);
+            t.durations.back() = m_video_last_duration;
+
+            // cut at keyframes. ask the encoder for one when the fragment is long enough, so that each fragment can be
+            // played from its start. if it doesn't come in time, cut anyway to keep memory bounded.
+            u64 elapsed = decode_time - t.decode_time;
+            if ((keyframe && elapsed >= fragment_length) || elapsed >= fragment_length * 2) {
+                flushFragment(t.sizes.size(), false);
+                m_frag_keyframe_requested = false;
+            }
+            else if (!keyframe && elapsed >= fragment_length && !m_frag_keyframe_requested) {
+                m_keyframe_requested = true;
+                m_frag_keyframe_requested = true;
+            }
+        }
+        if (t.sizes.empty()) {
+            t.decode_time = decode_time;
+        }
+
+        u32 sample_size = 0;
+        h264.eachNALs([&](const char *data, int size) {
+            const int offset = 4; // 0x00000001
+            size -= offset;
+
+            fcH264NALHeader nalh(data[4]);
+            if (nalh.nal_unit_type == NAL_SPS) {
+                m_sps.assign(&data[offset], &data[offset] + size);
+            }
+            else if (nalh.nal_unit_type == NAL_PPS) {
+                m_pps.assign(&data[offset], &data[offset] + size);
+            }
+            else {
+                fcAppendBE(t.data, size);
+                t.data.insert(t.data.end(), (const u8*)&data[offset], (const u8*)&data[offset] + size);
+                sample_size += size + 4;
+            }
+        });
+
+        t.sizes.push_back(sample_size);
+        t.durations.push_back(0);
+        t.flags.push_back(keyframe ? fcMP4SyncSampleFlags : fcMP4NonSyncSampleFlags);
+        m_video_decode_time = decode_time;
+    }
+    // audio frame
+    else if (frame.type == fcFrameType_AAC) {
+        const auto& aac = (const fcAACFrame&)frame;
+        const u64 fragment_length = u64(m_conf.fragment_duration * m_conf.audio_sample_rate);
+        auto& t = m_frag_audio;
+
+        aac.eachBlocks([&](const char *data, int size, int raw_size) {
+            const int offset = 7;
+            size -= offset;
+
+            if (t.sizes.empty()) {
+                t.decode_time = m_audio_decode_time;
+            }
+            t.data.insert(t.data.end(), (const u8*)data + offset, (const u8*)data + offset + size);
+            t.sizes.push_back(size);
+            t.durations.push_back(raw_size);
+            t.flags.push_back(fcMP4SyncSampleFlags);
+            m_audio_decode_time += raw_size;
+        });
+
+        // with video, fragments are cut by video keyframes. audio cuts only if video stalls.
+        // the last video sample stays because its duration is not known yet.
+        u64 pending = m_audio_decode_time - t.decode_time;
+        if (!t.sizes.empty() && pending >= (m_conf.video ? fragment_length * 2 : fragment_length)) {
+            flushFragment(m_frag_video.sizes.empty() ? 0 : m_frag_video.sizes.size() - 1, false);
+        }
+    }
+}
+
+void fcMP4StreamWriter::flushFragment(size_t num_video_samples, bool finish)
+{
+    if (!m_frag_moov_written) {
+        // avcC needs sps / pps. they come with the first video frame.
+        if (!finish && m_conf.video && (m_sps.empty() || m_pps.empty())) { return; }
+
+        m_frag_has_audio = m_conf.audio && !m_audio_encoder_info.empty();
+        m_frag_has_video = m_conf.video && !m_sps.empty() && !m_pps.empty();
+        if (m_conf.video && !m_frag_has_video) {
+            fcDebugLog("fcMP4StreamWriter::flushFragment(): no sps / pps. video track is omitted.\n");
+        }
+
+        m_frag_header.clear();
+        VectorStream vs(m_frag_header);
+        writeMoov(vs, TrackTables(), TrackTables());
+        m_stream.write(m_frag_header.data(), m_frag_header.size());
+        m_frag_moov_written = true;
+    }
+
+    // consume samples of the fragment. data of the remaining samples are moved to the front.
+    auto consume = [](FragmentTrack& t, size_t n) {
+        size_t bytes = 0;
+        for (size_t i = 0; i < n; ++i) {
+            bytes += t.sizes[i];
+            t.decode_time += t.durations[i];
+        }
+        t.data.erase(t.data.begin(), t.data.begin() + bytes);
+        t.sizes.erase(t.sizes.begin(), t.sizes.begin() + n);
+        t.durations.erase(t.durations.begin(), t.durations.begin() + n);
+        t.flags.erase(t.flags.begin(), t.flags.begin() + n);
+    };
+
+    size_t num_audio_samples = m_frag_has_audio ? m_frag_audio.sizes.size() : 0;
+    if (!m_frag_has_audio) { consume(m_frag_audio, m_frag_audio.sizes.size()); }
+    if (!m_frag_has_video) { consume(m_frag_video, m_frag_video.sizes.size()); num_video_samples = 0; }
+    if (num_audio_samples == 0 && num_video_samples == 0) { return; }
+
+    size_t audio_bytes = 0;
+    size_t video_bytes = 0;
+    for (size_t i = 0; i < num_audio_samples; ++i) { audio_bytes += m_frag_audio.sizes[i]; }
+    for (size_t i = 0; i < num_video_samples; ++i) { video_bytes += m_frag_video.sizes[i]; }
+
+    m_frag_header.clear();
+    VectorStream bs(m_frag_header);
+    Box box = Box(bs);
+
+    // returns position of data offset field in trun
+    auto write_traf = [&](const FragmentTrack& t, u32 track_id, size_t n, bool sample_flags) -> size_t {
+        size_t data_offset_pos = 0;
+        box(u32_be('traf'), [&]() {
+            box(u32_be('tfhd'), [&]() {
+                bs << u32_be(0x00020000);   // version (0) and flags (default-base-is-moof)
+                bs << u32_be(track_id);     // track ID
+            }); // tfhd
+            box(u32_be('tfdt'), [&]() {
+                bs << u32_be(0x01000000);   // version (1) and flags (none)
+                bs << u64_be(t.decode_time);// base media decode time
+            }); // tfdt
+            box(u32_be('trun'), [&]() {
+                // version (0) and flags (data offset, sample duration, sample size and sample flags)
+                bs << u32_be(sample_flags ? 0x00000701 : 0x00000301);
+                bs << u32_be(n);            // sample count
+                data_offset_pos = bs.tellp();
+                bs << u32(0);               // data offset (patched later)
+                for (size_t i = 0; i < n; ++i) {
+                    bs << u32_be(t.durations[i]);
+                    bs << u32_be(t.sizes[i]);
+                    if (sample_flags) {
+                        bs << u32_be(t.flags[i]);
+                    }
+                }
+            }); // trun
+        }); // traf
+        return data_offset_pos;
+    };
+
+    size_t audio_offset_pos = 0;
+    size_t video_offset_pos = 0;
+    box(u32_be('moof'), [&]() {
+        box(u32_be('mfhd'), [&]() {
+            bs << u32(0);                       // version and flags (none)
+            bs << u32_be(++m_frag_sequence);    // sequence number
+        }); // mfhd
+        if (num_audio_samples > 0) {
+            audio_offset_pos = write_traf(m_frag_audio, 1, num_audio_samples, false);
+        }
+        if (num_video_samples > 0) {
+            video_offset_pos = write_traf(m_frag_video, m_frag_has_audio ? 2 : 1, num_video_samples, true);
+        }
+    }); // moof
+
+    // data offsets are relative to the beginning of moof. mdat has audio then video.
+    size_t data_begin = m_frag_header.size() + 8;
+    auto patch = [&](size_t pos, size_t offset) {
+        u32 v = u32_be(offset);
+        memcpy(&m_frag_header[pos], &v, sizeof(v));
+    };
+    if (num_audio_samples > 0) { patch(audio_offset_pos, data_begin); }
+    if (num_video_samples > 0) { patch(video_offset_pos, data_begin + audio_bytes); }
+
+    bs << u32_be(8 + audio_bytes + video_bytes) << u32_be('mdat');
+    m_stream.write(m_frag_header.data(), m_frag_header.size());
+    if (audio_bytes > 0) { m_stream.write(m_frag_audio.data.data(), audio_bytes); }
+    if (video_bytes > 0) { m_stream.write(m_frag_video.data.data(), video_bytes); }
+
+    consume(m_frag_audio, num_audio_samples);
+    consume(m_frag_video, num_video_samples);
+}
+
 void fcMP4StreamWriter::mp4End()
 {
-    const char audio_track_name[] = "UTJ Sound Media Handler";
-    const char video_track_name[] = "UTJ Video Media Handler";
-    const char video_compression_name[31] = "AVC Coding";
+    if (m_conf.fragmented) {
+        // duration of the last video sample is unknown. assume it is the same as the previous one.
+        auto& t = m_frag_video;
+        if (!t.sizes.empty()) {
+            if (m_video_last_duration == 0 && m_conf.video_max_framerate > 0) {
+                m_video_last_duration = 1000 / m_conf.video_max_framerate;
+            }
+            t.durations.back() = m_video_last_duration;
+        }
+        flushFragment(t.sizes.size(), true);
 
-    const fcMP4Config& c = m_conf;
-    const u32 ctime = (u32)fcGetMacTime();
-    const u32 unit_duration = 1000; // millisec
-    u32 video_duration = 0;
-    u32 audio_duration = 0;
-    u32 duration = 0;
+        fcDebugLog("fcMP4StreamWriter::mp4End() done.\n");
+        return;
+    }
 
-    std::vector<fcSampleToChunk> video_samples_to_chunk;
-    std::vector<fcSampleToChunk> audio_samples_to_chunk;
-    std::vector<fcOffsetValue> video_decode_times;
-    std::vector<fcOffsetValue> audio_decode_times;
-    std::vector<u64> video_chunks;
-    std::vector<u64> audio_chunks;
+    TrackTables audio;
+    TrackTables video;
 
     // there must be at least 1 I-frame
     if (m_iframe_ids.empty()) {
@@ -192,9 +614,8 @@ void fcMP4StreamWriter::mp4End()
         }
         return total_duration_ms;
     };
-    video_duration = compute_decode_times(m_video_frame_info, video_decode_times);
-    audio_duration = compute_decode_times(m_audio_frame_info, audio_decode_times);
-    duration = std::max<u32>(video_duration, audio_duration);
+    video.duration = compute_decode_times(m_video_frame_info, video.decode_times);
+    audio.duration = compute_decode_times(m_audio_frame_info, audio.decode_times);
 
     // compute chunk data
     auto compute_chunk_data = [](
@@ -221,18 +642,134 @@ void fcMP4StreamWriter::mp4End()
             }
         }
     };
-    compute_chunk_data(m_video_frame_info, video_chunks, video_samples_to_chunk);
-    compute_chunk_data(m_audio_frame_info, audio_chunks, audio_samples_to_chunk);
+    compute_chunk_data(m_video_frame_info, video.chunks, video.samples_to_chunk);
+    compute_chunk_data(m_audio_frame_info, audio.chunks, audio.samples_to_chunk);
+
+
+    m_mdat_end = m_stream.tellp();
+    patchMdatSize();
+    if (!m_conf.faststart || !writeMoovFaststart(audio, video)) {
+        // build moov in memory and write it at once
+        std::vector<u8> moov;
+        moov.reserve(estimateMoovSize(audio, video));
+        VectorStream vs(moov);
+        writeMoov(vs, audio, video);
+        m_stream.write(moov.data(), moov.size());
+    }
 
+    fcDebugLog("fcMP4StreamWriter::mp4End() done.\n");
+}
+
+void fcMP4StreamWriter::patchMdatSize()
+{
+    BinaryStream& bs = m_stream;
+    size_t pos = bs.tellp();
+#ifdef fcMP464BitLength
+    // 64bit mdat length
+    u64 mdat_size = u64_be(m_mdat_end - m_mdat_begin);
+    bs.seekp(m_mdat_begin + 8);
+    bs.write(&mdat_size, sizeof(mdat_size));
+#else
+    // 32bit mdat length
+    u32 mdat_size = u32_be(m_mdat_end - m_mdat_begin);
+    bs.seekp(m_mdat_begin);
+    bs.write(&mdat_size, sizeof(mdat_size));
+#endif
+    bs.seekp(pos);
+}
 
-    //------------------------------------------------------
-    // moov section
-    //------------------------------------------------------
+// upper bound. tables are most of moov and the rest is less than 4KB.
+size_t fcMP4StreamWriter::estimateMoovSize(const TrackTables& audio, const TrackTables& video) const
+{
+    size_t size = 0x1000 + m_sps.size() + m_pps.size() + m_audio_encoder_info.size();
+    for (auto *t : { &audio, &video }) {
+        size += sizeof(fcOffsetValue) * t->decode_times.size();
+        size += sizeof(fcSampleToChunk) * t->samples_to_chunk.size();
+        size += sizeof(u64) * t->chunks.size();
+    }
+    size += sizeof(u32) * (m_audio_frame_info.size() + m_video_frame_info.size() + m_iframe_ids.size());
+    return size;
+}
 
+bool fcMP4StreamWriter::writeMoovFaststart(TrackTables& audio, TrackTables& video)
+{
     BinaryStream& bs = m_stream;
-    Box box = Box(bs);
-    m_mdat_end = bs.tellp();
+    const size_t space = m_mdat_begin - m_moov_space_begin;
+
+    // moov goes to the free box in front of mdat. if it doesn't fit, mdat is moved forward and
+    // chunk offsets are shifted accordingly. that may turn stco into co64 and grow moov, so repeat until it settles.
+    std::vector<u8> moov;
+    moov.reserve(estimateMoovSize(audio, video));
+    size_t shift = 0;
+    for (;;) {
+        moov.clear();
+        VectorStream vs(moov);
+        writeMoov(vs, audio, video);
+
+        size_t m = moov.size();
+        size_t required = 0; // the rest of the space must be empty or large enough for a free box
+        if (m > space) { required = m - space; }
+        else if (m != space && m + 8 > space) { required = m + 8 - space; }
+        if (required == shift) { break; }
+
+        for (auto& c : audio.chunks) { c += required - shift; }
+        for (auto& c : video.chunks) { c += required - shift; }
+        shift = required;
+    }
+
+    if (shift > 0 && !fcIsReadable(bs)) {
+        for (auto& c : audio.chunks) { c -= shift; }
+        for (auto& c : video.chunks) { c -= shift; }
+        fcDebugLog("fcMP4StreamWriter::writeMoovFaststart(): stream is not readable and reserved space is too small. moov is written at the end.\n");
+        return false;
+    }
+
+    if (shift > 0) {
+        std::vector<u8> block(std::min<size_t>(fcMP4RelocationBlockSize, std::max<size_t>(m_mdat_end - m_mdat_begin, shift)));
+
+        // extend the stream first. memory streams can't seek past the end.
+        bs.seekp(m_mdat_end);
+        for (size_t n = 0; n < shift; n += block.size()) {
+            bs.write(block.data(), std::min<size_t>(shift - n, block.size()));
+        }
+
+        // move mdat. copy from the end so that no data is overwritten before it is read.
+        size_t end = m_mdat_end;
+        while (end > m_mdat_begin) {
+            size_t n = std::min<size_t>(block.size(), end - m_mdat_begin);
+            size_t pos = end - n;
+            bs.seekg(pos);
+            bs.read(block.data(), n);
+            bs.seekp(pos + shift);
+            bs.write(block.data(), n);
+            end = pos;
+        }
+    }
+
+    bs.seekp(m_moov_space_begin);
+    bs.write(moov.data(), moov.size());
+    size_t rest = space + shift - moov.size();
+    if (rest > 0) {
+        bs << u32_be(rest) << u32_be('free');
+    }
+    bs.seekp(m_mdat_end + shift);
+    return true;
+}
+
+void fcMP4StreamWriter::writeMoov(BinaryStream& bs, const TrackTables& audio, const TrackTables& video)
+{
+    const char audio_track_name[] = "UTJ Sound Media Handler";
+    const char video_track_name[] = "UTJ Video Media Handler";
+    const char video_compression_name[31] = "AVC Coding";
+
+    const fcMP4Config& c = m_conf;
+    const u32 ctime = (u32)fcGetMacTime();
+    const u32 unit_duration = 1000; // millisec
+    const u32 duration = std::max<u32>(audio.duration, video.duration);
 
+    Box box = Box(bs);
+    TBuffer<u32> tmp32;
+    TBuffer<u64> tmp64;
     u32 track_index = 0;
 
     box(u32_be('moov'), [&]() {
@@ -259,17 +796,17 @@ void fcMP4StreamWriter::mp4End()
             bs << u32(0);   // selection(?) start time (time base units)
             bs << u32(0);   // selection(?) duration (time base units)
             bs << u32(0);   // current time (0, time base units)
-            bs << u32_be(!m_audio_frame_info.empty() ? 3 : 2);// next free track id (1-based rather than 0-based)
+            bs << u32_be(hasAudioTrack() ? 3 : 2);// next free track id (1-based rather than 0-based)
         });
 
         //------------------------------------------------------
         // audio track
         //------------------------------------------------------
-        if (!m_audio_frame_info.empty()) {
+        if (hasAudioTrack()) {
             ++track_index;
 
             if (m_audio_encoder_info.empty()) {
-                fcDebugLog("fcMP4StreamWriter::mp4End(): m_audio_encoder_info is not set!\n");
+                fcDebugLog("fcMP4StreamWriter::writeMoov(): m_audio_encoder_info is not set!\n");
             }
 
             Buffer dd_buf; // decoder descriptor
@@ -304,7 +841,7 @@ void fcMP4StreamWriter::mp4End()
                     bs << u32_be(ctime);        // modified time
                     bs << u32_be(track_index);  // track ID
                     bs << u32(0);               // reserved
-                    bs << u32_be(audio_duration);// duration (in time base units)
+                    bs << u32_be(audio.duration);// duration (in time base units)
                     bs << u64(0);               // reserved
                     bs << u16(0);               // video layer (0)
                     bs << u16_be(0);            // quicktime alternate track id
@@ -322,7 +859,7 @@ void fcMP4StreamWriter::mp4End()
                         bs << u32_be(ctime);                // creation time
                         bs << u32_be(ctime);                // modified time
                         bs << u32_be(c.audio_sample_rate);  // time scale
-                        bs << u32_be(unit_duration);
+                        bs << u32_be(u64(audio.duration) * c.audio_sample_rate / unit_duration);
                         bs << u32_be(0x55C40000);
                     }); // mdhd
                     box(u32_be('hdlr'), [&]() {
@@ -375,47 +912,50 @@ void fcMP4StreamWriter::mp4End()
 
                             box(u32_be('stts'), [&]() {
                                 bs << u32(0);   // version and flags (none)
-                                bs << u32_be(audio_decode_times.size());
-                                for (auto& v : audio_decode_times) {
-                                    bs << u32_be(v.count) << u32_be(v.value * c.audio_sample_rate / unit_duration);
-                                }
+                                bs << u32_be(audio.decode_times.size());
+                                fcWriteTable(bs, tmp32, audio.decode_times.size() * 2, [&](u32 *dst) {
+                                    for (auto& v : audio.decode_times) {
+                                        *dst++ = v.count;
+                                        *dst++ = v.value * c.audio_sample_rate / unit_duration;
+                                    }
+                                });
                             });
 
                             box(u32_be('stsc'), [&]() {
                                 bs << u32(0);   // version and flags (none)
-                                bs << u32_be(audio_samples_to_chunk.size());
-                                for (auto& v : audio_samples_to_chunk) {
-                                    bs << u32_be(v.first_chunk_ID) << u32_be(v.samples_per_chunk) << u32(u32_be(1));
-                                }
+                                bs << u32_be(audio.samples_to_chunk.size());
+                                fcWriteTable(bs, tmp32, audio.samples_to_chunk.size() * 3, [&](u32 *dst) {
+                                    memcpy(dst, audio.samples_to_chunk.data(), sizeof(fcSampleToChunk) * audio.samples_to_chunk.size());
+                                });
                             });
 
                             box(u32_be('stsz'), [&]() {
                                 bs << u32(0);   // version and flags (none)
                                 bs << u32(0);   // block size for all (0 if differing sizes)
                                 bs << u32_be(m_audio_frame_info.size());
-                                for (auto& v : m_audio_frame_info) {
-                                    bs << u32_be(v.size);
-                                }
+                                fcWriteTable(bs, tmp32, m_audio_frame_info.size(), [&](u32 *dst) {
+                                    for (auto& v : m_audio_frame_info) { *dst++ = (u32)v.size; }
+                                });
                             });
 
-                            if (!audio_chunks.empty() && audio_chunks.back() > 0xFFFFFFFFLL)
+                            if (!audio.chunks.empty() && audio.chunks.back() > 0xFFFFFFFFLL)
                             {
                                 box(u32_be('co64'), [&]() {
                                     bs << u32(0); // version and flags (none)
-                                    bs << u32_be(audio_chunks.size());
-                                    for (auto &v : audio_chunks) {
-                                        bs << u64_be(v);
-                                    }
+                                    bs << u32_be(audio.chunks.size());
+                                    fcWriteTable(bs, tmp64, audio.chunks.size(), [&](u64 *dst) {
+                                        memcpy(dst, audio.chunks.data(), sizeof(u64) * audio.chunks.size());
+                                    });
                                 });
                             }
                             else
                             {
                                 box(u32_be('stco'), [&]() {
                                     bs << u32(0); // version and flags (none)
-                                    bs << u32_be(audio_chunks.size());
-                                    for (auto &v : audio_chunks) {
-                                        bs << u32_be(v);
-                                    }
+                                    bs << u32_be(audio.chunks.size());
+                                    fcWriteTable(bs, tmp32, audio.chunks.size(), [&](u32 *dst) {
+                                        for (auto v : audio.chunks) { *dst++ = (u32)v; }
+                                    });
                                 });
                             }
                         }); // stbl
@@ -427,7 +967,7 @@ void fcMP4StreamWriter::mp4End()
         //------------------------------------------------------
         // video track
         //------------------------------------------------------
-        if (!m_video_frame_info.empty()) {
+        if (hasVideoTrack()) {
             ++track_index;
             box(u32_be('trak'), [&]() {
                 box(u32_be('tkhd'), [&]() {
@@ -436,7 +976,7 @@ void fcMP4StreamWriter::mp4End()
                     bs << u32_be(ctime);            // modified time
                     bs << u32_be(track_index);      // track ID
                     bs << u32(0);                   // reserved
-                    bs << u32_be(video_duration);   // duration (in time base units)
+                    bs << u32_be(video.duration);   // duration (in time base units)
                     bs << u64(0);                   // reserved
                     bs << u16(0);                   // video layer (0)
                     bs << u16(0);                   // quicktime alternate track id (0)
@@ -455,7 +995,7 @@ void fcMP4StreamWriter::mp4End()
                         bs << u32_be(ctime);    // creation time
                         bs << u32_be(ctime);    // modified time
                         bs << u32_be(unit_duration);  // time scale
-                        bs << u32_be(video_duration);
+                        bs << u32_be(video.duration);
                         bs << u32_be(0x55c40000);
                     }); // mdhd
                     box(u32_be('hdlr'), [&]() {
@@ -526,12 +1066,10 @@ void fcMP4StreamWriter::mp4End()
 
                             box(u32_be('stts'), [&]() {
                                 bs << u32(0); // version and flags (none)
-                                bs << u32_be(video_decode_times.size());
-                                for (auto& v : video_decode_times)
-                                {
-                                    bs << u32_be(v.count);
-                                    bs << u32_be(v.value);
-                                }
+                                bs << u32_be(video.decode_times.size());
+                                fcWriteTable(bs, tmp32, video.decode_times.size() * 2, [&](u32 *dst) {
+                                    memcpy(dst, video.decode_times.data(), sizeof(fcOffsetValue) * video.decode_times.size());
+                                });
                             }); // stts
 
                             if (m_iframe_ids.size())
@@ -539,48 +1077,45 @@ void fcMP4StreamWriter::mp4End()
                                 box(u32_be('stss'), [&]() {
                                     bs << u32(0); // version and flags (none)
                                     bs << u32_be(m_iframe_ids.size());
-                                    for (u32 v : m_iframe_ids) {
-                                        bs << u32_be(v);
-                                    }
+                                    fcWriteTable(bs, tmp32, m_iframe_ids.size(), [&](u32 *dst) {
+                                        memcpy(dst, m_iframe_ids.data(), sizeof(u32) * m_iframe_ids.size());
+                                    });
                                 }); // stss
                             }
 
                             box(u32_be('stsc'), [&]() {
                                 bs << u32(0); // version and flags (none)
-                                bs << u32_be(video_samples_to_chunk.size());
-                                for (auto& v : video_samples_to_chunk)
-                                {
-                                    bs << u32_be(v.first_chunk_ID);
-                                    bs << u32_be(v.samples_per_chunk);
-                                    bs << u32_be(v.sample_description_ID);
-                                }
+                                bs << u32_be(video.samples_to_chunk.size());
+                                fcWriteTable(bs, tmp32, video.samples_to_chunk.size() * 3, [&](u32 *dst) {
+                                    memcpy(dst, video.samples_to_chunk.data(), sizeof(fcSampleToChunk) * video.samples_to_chunk.size());
+                                });
                             }); // stsc
 
                             box(u32_be('stsz'), [&]() {
                                 bs << u32(0); // version and flags (none)
                                 bs << u32(0); // block size for all (0 if differing sizes)
                                 bs << u32_be(m_video_frame_info.size());
-                                for (auto& v : m_video_frame_info) {
-                                    bs << u32_be(v.size);
-                                }
+                                fcWriteTable(bs, tmp32, m_video_frame_info.size(), [&](u32 *dst) {
+                                    for (auto& v : m_video_frame_info) { *dst++ = (u32)v.size; }
+                                });
                             }); // stsz
 
-                            if (!video_chunks.empty() && video_chunks.back() > 0xFFFFFFFFLL) {
+                            if (!video.chunks.empty() && video.chunks.back() > 0xFFFFFFFFLL) {
                                 box(u32_be('co64'), [&]() {
                                     bs << u32(0); // version and flags (none)
-                                    bs << u32_be(video_chunks.size());
-                                    for (auto& v : video_chunks) {
-                                        bs << u64_be(v);
-                                    }
+                                    bs << u32_be(video.chunks.size());
+                                    fcWriteTable(bs, tmp64, video.chunks.size(), [&](u64 *dst) {
+                                        memcpy(dst, video.chunks.data(), sizeof(u64) * video.chunks.size());
+                                    });
                                 }); // co64
                             }
                             else {
                                 box(u32_be('stco'), [&]() {
                                     bs << u32(0); // version and flags (none)
-                                    bs << u32_be(video_chunks.size());
-                                    for (auto& v : video_chunks) {
-                                        bs << u32_be(v);
-                                    }
+                                    bs << u32_be(video.chunks.size());
+                                    fcWriteTable(bs, tmp32, video.chunks.size(), [&](u32 *dst) {
+                                        for (auto v : video.chunks) { *dst++ = (u32)v; }
+                                    });
                                 }); // stco
                             }
                         }); // stbl
@@ -588,23 +1123,23 @@ void fcMP4StreamWriter::mp4End()
                 }); // mdia
             }); // trak
         }
-    }); // moov
 
-    {
-        size_t pos = bs.tellp();
-#ifdef fcMP464BitLength
-        // 64bit mdat length
-        u64 mdat_size = u64_be(m_mdat_end - m_mdat_begin);
-        bs.seekp(m_mdat_begin + 8);
-        bs.write(&mdat_size, sizeof(mdat_size));
-#else
-        // 32bit mdat length
-        u32 mdat_size = u32_be(m_mdat_end - m_mdat_begin);
-        bs.seekp(m_mdat_begin);
-        bs.write(&mdat_size, sizeof(mdat_size));
-#endif
-        bs.seekp(pos);
-    }
-
-    fcDebugLog("fcMP4StreamWriter::mp4End() done.\n");
+        //------------------------------------------------------
+        // fragment defaults
+        //------------------------------------------------------
+        if (c.fragmented) {
+            box(u32_be('mvex'), [&]() {
+                for (u32 id = 1; id <= track_index; ++id) {
+                    box(u32_be('trex'), [&]() {
+                        bs << u32(0);       // version and flags (none)
+                        bs << u32_be(id);   // track ID
+                        bs << u32_be(1);    // default sample description index
+                        bs << u32(0);       // default sample duration
+                        bs << u32(0);       // default sample size
+                        bs << u32(0);       // default sample flags
+                    });
+                }
+            }); // mvex
+        }
+    }); // moov
 }
@@ -4,19 +4,86 @@
 class fcMP4StreamWriter
 {
 public:
-    fcMP4StreamWriter(BinaryStream &stream, const fcMP4Config &conf);
+    // frames are queued and written by a dedicated thread. max_queued_frames=0 means unbounded.
+    fcMP4StreamWriter(BinaryStream &stream, const fcMP4Config &conf,
+        fcMP4DropPolicy policy = fcMP4DropPolicy_Block, int max_queued_frames = 0);
     virtual ~fcMP4StreamWriter();
-    void addFrame(const fcFrameData& buf); // thread safe
-    void setAACEncoderInfo(const Buffer& aacheader);
+    void addFrame(const fcFrameDataPtr& frame); // thread safe
+    void setAACEncoderInfo(const Buffer& aacheader); // call before adding frames
+    void getStats(fcMP4OutputStreamStats& dst);
+    // true if this stream needs a keyframe to continue. the request is cleared. thread safe
+    bool takeKeyframeRequest() { return m_keyframe_requested.exchange(false); }
+    BinaryStream& getStream() { return m_stream; }
 
 private:
+    struct QueuedFrame
+    {
+        fcFrameDataPtr frame;
+        fcTime queued_time;
+        u32 audio_gap; // samples of audio frames dropped right before this frame
+
+        QueuedFrame() : queued_time(), audio_gap() {}
+    };
+
+    struct TrackTables
+    {
+        std::vector<fcOffsetValue> decode_times;
+        std::vector<fcSampleToChunk> samples_to_chunk;
+        std::vector<u64> chunks;
+        u32 duration;
+
+        TrackTables() : duration() {}
+    };
+
+    // samples of the fragment being built. data is kept until the fragment is flushed.
+    struct FragmentTrack
+    {
+        std::vector<u8> data;
+        std::vector<u32> sizes;
+        std::vector<u32> durations;
+        std::vector<u32> flags;
+        u64 decode_time; // decode time of the first sample
+
+        FragmentTrack() : decode_time() {}
+    };
+
+    void processFrames();
+    void writeFrame(const fcFrameData& frame);
+    void skipAudio(u32 num_samples);
+
     void mp4Begin();
     void mp4End();
+    void writeMoov(BinaryStream& bs, const TrackTables& audio, const TrackTables& video);
+    bool writeMoovFaststart(TrackTables& audio, TrackTables& video);
+    size_t estimateMoovSize(const TrackTables& audio, const TrackTables& video) const;
+    void patchMdatSize();
+    bool hasAudioTrack() const;
+    bool hasVideoTrack() const;
+
+    void addFragmentFrame(const fcFrameData& frame);
+    void flushFragment(size_t num_video_samples, bool finish);
 
 private:
     BinaryStream& m_stream;
     fcMP4Config m_conf;
+
+    // writer thread
+    fcMP4DropPolicy m_drop_policy;
+    size_t m_max_queued_frames;
+    std::thread m_writer;
     std::mutex m_mutex;
+    std::condition_variable m_queue_condition;
+    std::condition_variable m_space_condition;
+    std::deque<QueuedFrame> m_queue;
+    bool m_stop;
+    bool m_waiting_keyframe; // video frames are dropped until the next keyframe
+    std::atomic_bool m_keyframe_requested; // polled by the encoder. see takeKeyframeRequest()
+    u32 m_audio_gap;
+    u64 m_queued_bytes;
+    int m_written_frames;
+    int m_dropped_frames;
+    fcTime m_max_lag;
+
     std::vector<fcFrameInfo> m_video_frame_info;
     std::vector<fcFrameInfo> m_audio_frame_info;
     std::vector<u8> m_pps;
@@ -24,8 +91,23 @@ private:
     std::vector<u32> m_iframe_ids;
     std::vector<u8> m_audio_encoder_info;
 
+    size_t m_moov_space_begin;
     size_t m_mdat_begin;
     size_t m_mdat_end;
+
+    // fragmented mode
+    FragmentTrack m_frag_audio;
+    FragmentTrack m_frag_video;
+    std::vector<u8> m_frag_header;
+    u32 m_frag_sequence;
+    bool m_frag_moov_written;
+    bool m_frag_has_audio;
+    bool m_frag_has_video;
+    bool m_frag_keyframe_requested; // the current fragment asked for a keyframe to be cut at
+    fcTime m_video_time_base;
+    u64 m_video_decode_time; // decode time of the last video sample
+    u32 m_video_last_duration;
+    u64 m_audio_decode_time;
 };
 
 #endif // fcMP4StreamWriter_h
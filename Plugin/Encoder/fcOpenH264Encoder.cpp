@@ -7,6 +7,7 @@
 #include <openh264/codec_api.h>
 
 #define OpenH264Version "1.5.0"
+#define OpenH264MaxThreads 4 // MAX_THREADS_NUM of OpenH264. not in the public headers
 #ifdef fcWindows
     #if defined(_M_AMD64)
         #define OpenH264URL "http://ciscobinary.openh264.org/openh264-" OpenH264Version "-win64msvc.dll.bz2"
@@ -15,6 +16,9 @@
         #define OpenH264URL "http://ciscobinary.openh264.org/openh264-" OpenH264Version "-win32msvc.dll.bz2"
         #define OpenH264DLL "openh264-" OpenH264Version "-win32msvc.dll"
     #endif
+#elif defined(fcLinux)
+    #define OpenH264URL "http://ciscobinary.openh264.org/libopenh264-" OpenH264Version "-linux64.so.bz2"
+    #define OpenH264DLL "libopenh264-" OpenH264Version "-linux64.so"
 #else 
     // Mac
     #define OpenH264URL "http://ciscobinary.openh264.org/libopenh264-" OpenH264Version "-osx64.dylib.bz2"
@@ -30,6 +34,7 @@ public:
     ~fcOpenH264Encoder();
     const char* getEncoderInfo() override;
     bool encode(fcH264Frame& dst, const fcI420Image& image, fcTime timestamp, bool force_keyframe) override;
+    bool isValid() const { return m_encoder != nullptr; }
 
 private:
     fcH264EncoderConfig m_conf;
@@ -39,7 +44,13 @@ private:
 fcIH264Encoder* fcCreateOpenH264Encoder(const fcH264EncoderConfig& conf)
 {
     if (!fcLoadOpenH264Module()) { return nullptr; }
-    return new fcOpenH264Encoder(conf);
+    fcOpenH264Encoder *ret = new fcOpenH264Encoder(conf);
+    if (!ret->isValid()) {
+        // e.g. slice or thread settings OpenH264 doesn't accept
+        delete ret;
+        return nullptr;
+    }
+    return ret;
 }
 
 
@@ -82,31 +93,75 @@ fcOpenH264Encoder::fcOpenH264Encoder(const fcH264EncoderConfig& conf)
     fcLoadOpenH264Module();
     if (g_mod_h264 == nullptr) { return; }
 
-    WelsCreateSVCEncoder_i(&m_encoder);
+    if (WelsCreateSVCEncoder_i(&m_encoder) != 0 || m_encoder == nullptr) {
+        fcDebugLog("fcOpenH264Encoder::fcOpenH264Encoder(): WelsCreateSVCEncoder() failed.");
+        m_encoder = nullptr;
+        return;
+    }
+
+    int num_threads = conf.num_threads > 0 ? conf.num_threads : (int)std::thread::hardware_concurrency();
+    num_threads = std::min<int>(std::max<int>(num_threads, 1), OpenH264MaxThreads);
 
-    SEncParamBase param;
-    memset(&param, 0, sizeof(SEncParamBase));
-    param.iUsageType = SCREEN_CONTENT_REAL_TIME;
+    SEncParamExt param;
+    m_encoder->GetDefaultParams(&param);
+    param.iUsageType = (EUsageType)conf.usage;
     param.fMaxFrameRate = (float)conf.max_framerate;
     param.iPicWidth = conf.width;
     param.iPicHeight = conf.height;
     param.iTargetBitrate = conf.target_bitrate;
     param.iRCMode = RC_BITRATE_MODE;
-    m_encoder->Initialize(&param);
+    param.iComplexityMode = (ECOMPLEXITY_MODE)conf.complexity;
+    param.uiIntraPeriod = (unsigned int)std::max<int>(conf.keyframe_interval, 0);
+
+    // threads work on slices. a frame with one slice is encoded by one thread.
+    auto& layer = param.sSpatialLayers[0];
+    layer.iVideoWidth = conf.width;
+    layer.iVideoHeight = conf.height;
+    layer.fFrameRate = (float)conf.max_framerate;
+    layer.iSpatialBitrate = conf.target_bitrate;
+    switch (conf.slice_mode) {
+    case fcMP4SliceMode_Single:
+        layer.sSliceCfg.uiSliceMode = SM_SINGLE_SLICE;
+        num_threads = 1;
+        break;
+    case fcMP4SliceMode_FixedSize:
+        // dynamic slicing is single threaded in OpenH264
+        layer.sSliceCfg.uiSliceMode = SM_DYN_SLICE;
+        layer.sSliceCfg.sSliceArgument.uiSliceSizeConstraint = std::max<int>(conf.slice_size, 128);
+        param.uiMaxNalSize = layer.sSliceCfg.sSliceArgument.uiSliceSizeConstraint;
+        num_threads = 1;
+        break;
+    default:
+        layer.sSliceCfg.uiSliceMode = SM_FIXEDSLCNUM_SLICE;
+        layer.sSliceCfg.sSliceArgument.uiSliceNum = std::min<int>(conf.slice_count > 0 ? conf.slice_count : num_threads, MAX_SLICES_NUM_TMP);
+        break;
+    }
+    param.iMultipleThreadIdc = (unsigned short)num_threads;
+
+    if (m_encoder->InitializeExt(&param) != 0) {
+        fcDebugLog("fcOpenH264Encoder::fcOpenH264Encoder(): InitializeExt() failed.");
+        WelsDestroySVCEncoder_i(m_encoder);
+        m_encoder = nullptr;
+    }
 }
 
 fcOpenH264Encoder::~fcOpenH264Encoder()
 {
-    if (g_mod_h264 == nullptr) { return; }
+    if (g_mod_h264 == nullptr || m_encoder == nullptr) { return; }
 
     WelsDestroySVCEncoder_i(m_encoder);
 }
 const char* fcOpenH264Encoder::getEncoderInfo() { return "OpenH264 (by Cisco Systems, Inc)"; }
 
-bool fcOpenH264Encoder::encode(fcH264Frame& dst, const fcI420Image& image, fcTime timestamp, bool /*force_keyframe*/)
+bool fcOpenH264Encoder::encode(fcH264Frame& dst, const fcI420Image& image, fcTime timestamp, bool force_keyframe)
 {
     if (!m_encoder) { return false; }
 
+    if (force_keyframe) {
+        // IDR comes with sps / pps, so the stream can be decoded from this frame
+        m_encoder->ForceIntraFrame(true);
+    }
+
     SSourcePicture src;
     memset(&src, 0, sizeof(src));
     src.iPicWidth = m_conf.width;
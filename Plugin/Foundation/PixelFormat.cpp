@@ -59,6 +59,8 @@ void fcScaleArray(uint16_t *data, size_t size, float scale) { ispc::ScaleI16(dat
 void fcScaleArray(int32_t *data, size_t size, float scale)  { ispc::ScaleI32(data, (uint32_t)size, scale); }
 void fcScaleArray(half *data, size_t size, float scale)     { ispc::ScaleF16((int16_t*)data, (uint32_t)size, scale); }
 void fcScaleArray(float *data, size_t size, float scale)    { ispc::ScaleF32(data, (uint32_t)size, scale); }
+void fcSwapBytesArray(uint32_t *data, size_t size)          { ispc::SwapBytes32(data, (uint32_t)size); }
+void fcSwapBytesArray(uint64_t *data, size_t size)          { ispc::SwapBytes64(data, (uint32_t)size); }
 
 const void* fcConvertPixelFormat_ISPC(void *dst, fcPixelFormat dstfmt, const void *src, fcPixelFormat srcfmt, size_t size_)
 {
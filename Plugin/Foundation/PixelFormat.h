@@ -12,6 +12,9 @@ void fcScaleArray(uint16_t *data, size_t size, float scale);
 void fcScaleArray(int32_t *data, size_t size, float scale);
 void fcScaleArray(half *data, size_t size, float scale);
 void fcScaleArray(float *data, size_t size, float scale);
+// convert to big endian (or back). size is number of elements
+void fcSwapBytesArray(uint32_t *data, size_t size);
+void fcSwapBytesArray(uint64_t *data, size_t size);
 const void* fcConvertPixelFormat(void *dst, fcPixelFormat dstfmt, const void *src, fcPixelFormat srcfmt, size_t size);
 
 #endif // PixelFormat
@@ -40,7 +40,11 @@ fcThreadPool::fcThreadPool(size_t threads)
 
 fcThreadPool::~fcThreadPool()
 {
-    m_stop = true;
+    {
+        // workers check m_stop under the lock. setting it outside could lose the wakeup.
+        std::unique_lock<std::mutex> lock(m_queue_mutex);
+        m_stop = true;
+    }
     m_condition.notify_all();
 
     for (auto& worker : m_workers) {
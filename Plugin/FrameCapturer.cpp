@@ -232,28 +232,34 @@ fcCLinkage fcExport void fcExrDestroyContext(fcIExrContext *ctx)
     ctx->release();
 }
 
-fcCLinkage fcExport bool fcExrBeginFrame(fcIExrContext *ctx, const char *path, int width, int height)
+fcCLinkage fcExport bool fcExrBeginFrame(fcIExrContext *ctx, const char *path, int width, int height, const fcExrRegion *roi)
 {
     if (!ctx) { return false; }
-    return ctx->beginFrame(path, width, height);
+    return ctx->beginFrame(path, width, height, roi);
 }
 
-fcCLinkage fcExport bool fcExrAddLayerPixels(fcIExrContext *ctx, const void *pixels, fcPixelFormat fmt, int ch, const char *name, bool flipY)
+fcCLinkage fcExport bool fcExrBeginFrameStream(fcIExrContext *ctx, fcStream *stream, int width, int height, const fcExrRegion *roi)
 {
     if (!ctx) { return false; }
-    return ctx->addLayerPixels(pixels, fmt, ch, name, flipY);
+    return ctx->beginFrameStream(stream, width, height, roi);
 }
 
-fcCLinkage fcExport bool fcExrAddLayerTexture(fcIExrContext *ctx, void *tex, fcPixelFormat fmt, int ch, const char *name, bool flipY)
+fcCLinkage fcExport bool fcExrAddLayerPixels(fcIExrContext *ctx, const void *pixels, fcPixelFormat fmt, int ch, const char *name, bool flipY, fcExrCompression compression)
 {
     if (!ctx) { return false; }
-    return ctx->addLayerTexture(tex, fmt, ch, name, flipY);
+    return ctx->addLayerPixels(pixels, fmt, ch, name, flipY, compression);
 }
 
-fcCLinkage fcExport bool fcExrEndFrame(fcIExrContext *ctx)
+fcCLinkage fcExport bool fcExrAddLayerTexture(fcIExrContext *ctx, void *tex, fcPixelFormat fmt, int ch, const char *name, bool flipY, fcExrCompression compression)
 {
     if (!ctx) { return false; }
-    return ctx->endFrame();
+    return ctx->addLayerTexture(tex, fmt, ch, name, flipY, compression);
+}
+
+fcCLinkage fcExport bool fcExrEndFrame(fcIExrContext *ctx, fcExrFrameCallback callback, void *userdata)
+{
+    if (!ctx) { return false; }
+    return ctx->endFrame(callback, userdata);
 }
 
 #ifndef fcStaticLink
@@ -262,16 +268,24 @@ fcCLinkage fcExport int fcExrBeginFrameDeferred(fcIExrContext *ctx, const char *
     if (!ctx) { return 0; }
     std::string path = path_;
     return fcAddDeferredCall([=]() {
-        return ctx->beginFrame(path.c_str(), width, height);
+        return ctx->beginFrame(path.c_str(), width, height, nullptr);
     }, id);
 }
 
-fcCLinkage fcExport int fcExrAddLayerTextureDeferred(fcIExrContext *ctx, void *tex, fcPixelFormat fmt, int ch, const char *name_, bool flipY, int id)
+fcCLinkage fcExport int fcExrBeginFrameStreamDeferred(fcIExrContext *ctx, fcStream *stream, int width, int height, int id)
+{
+    if (!ctx) { return 0; }
+    return fcAddDeferredCall([=]() {
+        return ctx->beginFrameStream(stream, width, height, nullptr);
+    }, id);
+}
+
+fcCLinkage fcExport int fcExrAddLayerTextureDeferred(fcIExrContext *ctx, void *tex, fcPixelFormat fmt, int ch, const char *name_, bool flipY, fcExrCompression compression, int id)
 {
     if (!ctx) { return 0; }
     std::string name = name_;
     return fcAddDeferredCall([=]() {
-        return ctx->addLayerTexture(tex, fmt, ch, name.c_str(), flipY);
+        return ctx->addLayerTexture(tex, fmt, ch, name.c_str(), flipY, compression);
     }, id);
 }
 
@@ -279,7 +293,7 @@ fcCLinkage fcExport int fcExrEndFrameDeferred(fcIExrContext *ctx, int id)
 {
     if (!ctx) { return 0; }
     return fcAddDeferredCall([=]() {
-        return ctx->endFrame();
+        return ctx->endFrame(nullptr, nullptr);
     }, id);
 }
 #endif // fcStaticLink
@@ -298,25 +312,36 @@ fcCLinkage fcExport int fcExrEndFrameDeferred(fcIExrContext *ctx, int id)
     static module_t fcGifModule;
     fcGifCreateContextImplT fcGifCreateContextImpl;
 #else
-    fcCLinkage fcExport fcIGifContext* fcGifCreateContextImpl(const fcGifConfig &conf, fcIGraphicsDevice *dev);
+    fcCLinkage fcExport fcIGifContext* fcGifCreateContextImpl(const fcGifConfig &conf, fcIGraphicsDevice *dev, fcStream *stream);
 #endif
 
 
-fcCLinkage fcExport fcIGifContext* fcGifCreateContext(const fcGifConfig *conf)
+static fcIGifContext* fcGifCreateContextCommon(const fcGifConfig *conf, fcStream *stream)
 {
 #ifdef fcGIFSplitModule
     if (!fcGifModule) {
         fcGifModule = DLLLoad(fcGIFModuleName);
         if (fcGifModule) {
-            (void*&)fcExrCreateContextImpl = DLLGetSymbol(fcGifModule, "fcGifCreateContextImpl");
+            (void*&)fcGifCreateContextImpl = DLLGetSymbol(fcGifModule, "fcGifCreateContextImpl");
         }
     }
-    return fcExrCreateContextImpl ? fcExrCreateContextImpl(*conf, fcGetGraphicsDevice()) : nullptr;
+    return fcGifCreateContextImpl ? fcGifCreateContextImpl(*conf, fcGetGraphicsDevice(), stream) : nullptr;
 #else
-    return fcGifCreateContextImpl(*conf, fcGetGraphicsDevice());
+    return fcGifCreateContextImpl(*conf, fcGetGraphicsDevice(), stream);
 #endif
 }
 
+fcCLinkage fcExport fcIGifContext* fcGifCreateContext(const fcGifConfig *conf)
+{
+    return fcGifCreateContextCommon(conf, nullptr);
+}
+
+fcCLinkage fcExport fcIGifContext* fcGifCreateStreamingContext(const fcGifConfig *conf, fcStream *stream)
+{
+    if (!stream) { return nullptr; }
+    return fcGifCreateContextCommon(conf, stream);
+}
+
 fcCLinkage fcExport void fcGifDestroyContext(fcIGifContext *ctx)
 {
     if (!ctx) { return; }
@@ -367,6 +392,12 @@ fcCLinkage fcExport void fcGifGetFrameData(fcIGifContext *ctx, void *tex, int fr
     return ctx->getFrameData(tex, frame);
 }
 
+fcCLinkage fcExport bool fcGifGetFramePixels(fcIGifContext *ctx, void *pixels, int frame)
+{
+    if (!ctx || !pixels) { return false; }
+    return ctx->getFramePixels(pixels, frame);
+}
+
 fcCLinkage fcExport int fcGifGetExpectedDataSize(fcIGifContext *ctx, int begin_frame, int end_frame)
 {
     if (!ctx) { return 0; }
@@ -487,6 +518,43 @@ fcCLinkage fcExport void fcMP4AddOutputStream(fcIMP4Context *ctx, fcStream *stre
     ctx->addOutputStream(stream);
 }
 
+fcCLinkage fcExport void fcMP4AddOutputStreamWithPolicy(fcIMP4Context *ctx, fcStream *stream, fcMP4DropPolicy policy, int max_queued_frames)
+{
+    if (!ctx) { return; }
+    ctx->addOutputStream(stream, policy, max_queued_frames);
+}
+
+fcCLinkage fcExport bool fcMP4GetOutputStreamStats(fcIMP4Context *ctx, fcStream *stream, fcMP4OutputStreamStats *stats)
+{
+    if (!ctx || !stats) { return false; }
+    return ctx->getOutputStreamStats(stream, *stats);
+}
+
+fcCLinkage fcExport bool fcMP4GetVideoStats(fcIMP4Context *ctx, fcMP4VideoStats *stats)
+{
+    if (!ctx || !stats) { return false; }
+    ctx->getVideoStats(*stats);
+    return true;
+}
+
+fcCLinkage fcExport bool fcMP4DumpReplay(fcIMP4Context *ctx, fcStream *stream, fcTime seconds)
+{
+    if (!ctx || !stream) { return false; }
+    return ctx->dumpReplay(stream, seconds, false);
+}
+
+fcCLinkage fcExport bool fcMP4DumpReplayFile(fcIMP4Context *ctx, const char *path, fcTime seconds)
+{
+    if (!ctx || !path) { return false; }
+    return ctx->dumpReplay(fcCreateFileStream(path), seconds, true);
+}
+
+fcCLinkage fcExport bool fcMP4IsDumpingReplay(fcIMP4Context *ctx)
+{
+    if (!ctx) { return false; }
+    return ctx->isDumpingReplay();
+}
+
 fcCLinkage fcExport bool fcMP4AddVideoFramePixels(fcIMP4Context *ctx, const void *pixels, fcPixelFormat fmt, fcTime timestamp)
 {
     if (!ctx) { return false; }
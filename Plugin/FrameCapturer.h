@@ -118,33 +118,123 @@ fcCLinkage fcExport bool            fcPngExportTexture(fcIPngContext *ctx, const
 // EXR Exporter
 // -------------------------------------------------------------
 
+enum fcExrCompression
+{
+    fcExrCompression_Default = -1, // use fcExrConfig::compression
+    fcExrCompression_None = 0,
+    fcExrCompression_RLE,
+    fcExrCompression_ZipS,  // zlib, 1 scanline per block
+    fcExrCompression_Zip,   // zlib, 16 scanlines per block
+    fcExrCompression_PIZ,
+    fcExrCompression_PXR24, // lossy
+    fcExrCompression_B44,   // lossy
+    fcExrCompression_B44A,  // lossy
+    fcExrCompression_DWAA,  // lossy. quality is controlled by dwa_compression_level
+    fcExrCompression_DWAB,  // lossy. quality is controlled by dwa_compression_level
+};
+
+enum fcExrAutoCrop
+{
+    fcExrAutoCrop_None,
+    fcExrAutoCrop_Alpha,      // crop to pixels with non-zero "A" or "*.A" channel. if there is no alpha channel, same as AnyChannel
+    fcExrAutoCrop_AnyChannel, // crop to pixels with any non-zero channel
+};
+
+// region in pixels. y=0 is the top row of the output image.
+struct fcExrRegion
+{
+    int x, y, width, height;
+    fcExrRegion() : x(), y(), width(), height() {}
+    fcExrRegion(int x_, int y_, int w, int h) : x(x_), y(y_), width(w), height(h) {}
+};
+
 struct fcExrConfig
 {
     int max_active_tasks;
-    fcExrConfig() : max_active_tasks(8) {}
+    fcExrCompression compression;
+    float dwa_compression_level; // larger value = smaller file & lower quality. 45.0 is OpenEXR's default
+    int frame_threads; // number of scanline blocks compressed in parallel within one frame. -1: auto (cores / max_active_tasks), 0: disabled
+    bool multi_part; // write each layer group (e.g. "Albedo" of "Albedo.R") as a separate part. channels without group go to part "rgba"
+    int tile_size; // 0: scanline image, >0: tiled image with tile_size x tile_size tiles
+    bool borrow_pixels; // if true, pixels given to fcExrAddLayerPixels() are not copied.
+                        // they must be kept alive until the frame's callback (see fcExrEndFrame()) is called.
+    bool store_u8_as_uint; // u8 layers are written as half (0.0-1.0) by default. if true, they are written as uint (0-255).
+    fcExrAutoCrop auto_crop; // write only the bounding box of non-empty pixels as data window. display window is kept full frame.
+    fcExrConfig()
+        : max_active_tasks(8), compression(fcExrCompression_ZipS), dwa_compression_level(45.0f), frame_threads(-1)
+        , multi_part(false), tile_size(0), borrow_pixels(false), store_u8_as_uint(false), auto_crop(fcExrAutoCrop_None) {}
 };
+// called from a worker thread when the frame is written (succeeded=true) or failed. pixels of the frame are no longer referred after this.
+typedef void(*fcExrFrameCallback)(void *userdata, bool succeeded);
 fcCLinkage fcExport fcIExrContext*  fcExrCreateContext(const fcExrConfig *conf = nullptr);
 fcCLinkage fcExport void            fcExrDestroyContext(fcIExrContext *ctx);
-fcCLinkage fcExport bool            fcExrBeginFrame(fcIExrContext *ctx, const char *path, int width, int height);
-fcCLinkage fcExport bool            fcExrAddLayerPixels(fcIExrContext *ctx, const void *pixels, fcPixelFormat fmt, int ch, const char *name, bool flipY = false);
-fcCLinkage fcExport bool            fcExrAddLayerTexture(fcIExrContext *ctx, void *tex, fcPixelFormat fmt, int ch, const char *name, bool flipY = false);
-fcCLinkage fcExport bool            fcExrEndFrame(fcIExrContext *ctx);
+// roi: if not null, only this region is written as data window. display window is always width x height.
+fcCLinkage fcExport bool            fcExrBeginFrame(fcIExrContext *ctx, const char *path, int width, int height, const fcExrRegion *roi = nullptr);
+// write the frame to stream instead of a file. frames are appended to the stream in the order they are begun.
+// stream must be kept alive until fcExrDestroyContext() is called.
+fcCLinkage fcExport bool            fcExrBeginFrameStream(fcIExrContext *ctx, fcStream *stream, int width, int height, const fcExrRegion *roi = nullptr);
+// each pixels / texture is copied (or read back) only once per frame, no matter how many channels refer it.
+// pixel format conversion and flipY are done on worker threads while the frame is compressed.
+// compression: overrides fcExrConfig::compression for the current frame.
+// compression method is per part. in single part mode, if layers specify different methods the last one wins.
+// in multi part mode, the last method specified for a layer group is used for that group's part.
+fcCLinkage fcExport bool            fcExrAddLayerPixels(fcIExrContext *ctx, const void *pixels, fcPixelFormat fmt, int ch, const char *name, bool flipY = false, fcExrCompression compression = fcExrCompression_Default);
+fcCLinkage fcExport bool            fcExrAddLayerTexture(fcIExrContext *ctx, void *tex, fcPixelFormat fmt, int ch, const char *name, bool flipY = false, fcExrCompression compression = fcExrCompression_Default);
+fcCLinkage fcExport bool            fcExrEndFrame(fcIExrContext *ctx, fcExrFrameCallback callback = nullptr, void *userdata = nullptr);
 
 
 // -------------------------------------------------------------
 // GIF Exporter
 // -------------------------------------------------------------
 
+enum fcGifPaletteMapper
+{
+    fcGifPaletteMapper_Exhaustive, // compare every pixel against all palette colors
+    fcGifPaletteMapper_Exact,      // pruned search + cache. same result as Exhaustive
+    fcGifPaletteMapper_InverseMap, // 15 bit inverse color map. fastest, approximate
+};
+
+enum fcGifQuantizer
+{
+    fcGifQuantizer_NeuQuant,
+    fcGifQuantizer_Octree,
+    fcGifQuantizer_MedianCut,
+    fcGifQuantizer_KMeans,    // a few k-means iterations seeded from the previous keyframe's palette
+};
+
+enum fcGifDither
+{
+    fcGifDither_None,
+    fcGifDither_FloydSteinberg, // serial over the whole frame
+    fcGifDither_Ordered,        // 8x8 bayer. row bands of a frame are mapped on all cores
+};
+
 struct fcGifConfig
 {
     int width;
     int height;
     int num_colors;
     int max_active_tasks;
+    fcGifPaletteMapper palette_mapper;
+    fcGifQuantizer quantizer;
+    int quantize_sample; // palettes are learned from about 1/quantize_sample of pixels. 1 is the best quality
+    fcGifDither dither;
+    bool delta_frames; // encode only the changed rectangle of non-keyframes, with unchanged pixels transparent
+    int max_frames; // oldest frames are discarded when exceeded. 0 is unlimited
+    int max_data_size; // in bytes. oldest frames are discarded when encoded data exceeds this. 0 is unlimited
+    // keyframes keep the current palette if its rms error per channel (0-255) on the frame is at most this much
+    // worse than on the keyframe it was made from. saves quantization and local color tables on static scenes.
+    // 0 always makes a new palette. 1 or so is a good start
+    float palette_reuse_threshold;
     fcGifConfig()
-        : width(), height(), num_colors(256), max_active_tasks(8) {}
+        : width(), height(), num_colors(256), max_active_tasks(8), palette_mapper(fcGifPaletteMapper_Exact)
+        , quantizer(fcGifQuantizer_NeuQuant), quantize_sample(1), dither(fcGifDither_FloydSteinberg), delta_frames(true)
+        , max_frames(0), max_data_size(0), palette_reuse_threshold(0.0f) {}
 };
 fcCLinkage fcExport fcIGifContext*  fcGifCreateContext(const fcGifConfig *conf);
+// frames are written to stream in order as soon as they are encoded, and the trailer is written on fcGifDestroyContext().
+// written frames are discarded, so memory doesn't grow with the clip. stream must outlive the context.
+fcCLinkage fcExport fcIGifContext*  fcGifCreateStreamingContext(const fcGifConfig *conf, fcStream *stream);
 fcCLinkage fcExport void            fcGifDestroyContext(fcIGifContext *ctx);
 // timestamp=-1 is treated as current time.
 fcCLinkage fcExport bool            fcGifAddFramePixels(fcIGifContext *ctx, const void *pixels, fcPixelFormat fmt, bool keyframe = false, fcTime timestamp = -1.0);
@@ -155,6 +245,8 @@ fcCLinkage fcExport bool            fcGifWrite(fcIGifContext *ctx, fcStream *str
 fcCLinkage fcExport void            fcGifClearFrame(fcIGifContext *ctx);
 fcCLinkage fcExport int             fcGifGetFrameCount(fcIGifContext *ctx);
 fcCLinkage fcExport void            fcGifGetFrameData(fcIGifContext *ctx, void *tex, int frame);
+// pixels must be width * height RGBAu8
+fcCLinkage fcExport bool            fcGifGetFramePixels(fcIGifContext *ctx, void *pixels, int frame);
 fcCLinkage fcExport int             fcGifGetExpectedDataSize(fcIGifContext *ctx, int begin_frame, int end_frame);
 fcCLinkage fcExport void            fcGifEraseFrame(fcIGifContext *ctx, int begin_frame, int end_frame);
 
@@ -163,6 +255,28 @@ fcCLinkage fcExport void            fcGifEraseFrame(fcIGifContext *ctx, int begi
 // MP4 Exporter
 // -------------------------------------------------------------
 
+// software (OpenH264) encoder settings. hardware encoders ignore these.
+enum fcMP4UsageType
+{
+    fcMP4UsageType_CameraRealtime,
+    fcMP4UsageType_ScreenRealtime,
+    fcMP4UsageType_CameraNonRealtime,
+};
+
+enum fcMP4Complexity
+{
+    fcMP4Complexity_Low,    // fastest
+    fcMP4Complexity_Medium,
+    fcMP4Complexity_High,   // best quality
+};
+
+enum fcMP4SliceMode
+{
+    fcMP4SliceMode_Single,     // one slice per frame. can't be encoded in parallel
+    fcMP4SliceMode_FixedCount, // video_slice_count slices per frame. 0 = one per thread
+    fcMP4SliceMode_FixedSize,  // slices of up to video_slice_size bytes. single threaded
+};
+
 struct fcMP4Config
 {
     bool    video;
@@ -173,17 +287,72 @@ struct fcMP4Config
     int     video_bitrate;
     int     video_max_framerate;
     int     video_max_buffers;
+    int     video_threads; // 0 = one per core
+    int     video_keyframe_interval; // in frames. 0 = only the first frame
+    fcMP4UsageType  video_usage;
+    fcMP4Complexity video_complexity;
+    fcMP4SliceMode  video_slice_mode;
+    int     video_slice_count;
+    int     video_slice_size; // in bytes
     float   audio_scale; // useful for scaling (-1.0 - 1.0) samples to (-32767.0f - 32767.0f)
     int     audio_sample_rate;
     int     audio_num_channels;
     int     audio_bitrate;
+    bool    fragmented; // write moov first and then moof + mdat fragments. output stream needs no seek.
+    float   fragment_duration; // in seconds. fragments are cut at the first keyframe after this duration.
+    bool    faststart; // put moov in front of mdat on finish. ignored if fragmented.
+    int     moov_reserved_size; // bytes reserved in front of mdat for faststart. mdat is moved if moov doesn't fit.
+    float   replay_duration; // in seconds. keep encoded frames in memory for fcMP4DumpReplay(). 0 = disabled
+    int     replay_max_bytes; // memory cap of the replay buffer. 0 = no limit. the latest GOP is kept even if it is larger
+    float   replay_keyframe_interval; // in seconds. keyframes are forced at least this often while replay is enabled. 0 = not forced
 
     fcMP4Config()
         : video(true), audio(true)
         , video_use_hardware_encoder_if_possible(true)
         , video_width(), video_height()
         , video_bitrate(1024000), video_max_framerate(60), video_max_buffers(8)
+        , video_threads(0), video_keyframe_interval(0)
+        , video_usage(fcMP4UsageType_ScreenRealtime), video_complexity(fcMP4Complexity_Medium)
+        , video_slice_mode(fcMP4SliceMode_FixedCount), video_slice_count(0), video_slice_size(1500)
         , audio_scale(1.0f), audio_sample_rate(48000), audio_num_channels(2), audio_bitrate(64000)
+        , fragmented(false), fragment_duration(2.0f)
+        , faststart(false), moov_reserved_size(0)
+        , replay_duration(0.0f), replay_max_bytes(0), replay_keyframe_interval(1.0f)
+    {}
+};
+
+// what an output stream does when its queue is full
+enum fcMP4DropPolicy
+{
+    fcMP4DropPolicy_Block,             // wait until the writer catches up. stalls encoding
+    fcMP4DropPolicy_DropUntilKeyframe, // drop frames. video resumes from the next keyframe
+};
+
+struct fcMP4OutputStreamStats
+{
+    int         queued_frames;
+    int         written_frames;
+    int         dropped_frames;
+    uint64_t    queued_bytes;
+    fcTime      lag;     // how long the oldest queued frame has been waiting, in seconds
+    fcTime      max_lag; // longest wait of a written frame, in seconds
+
+    fcMP4OutputStreamStats()
+        : queued_frames(), written_frames(), dropped_frames(), queued_bytes(), lag(), max_lag()
+    {}
+};
+
+// accumulated time of each stage of the video pipeline, in seconds. divide by num_frames for averages.
+struct fcMP4VideoStats
+{
+    int     num_frames;        // frames that went through all stages
+    fcTime  convert_time;      // RGBA -> I420. sum of all row bands, which run in parallel
+    fcTime  convert_wait_time; // encoder waiting for conversion to finish
+    fcTime  encode_time;
+    fcTime  mux_time;          // handing packets to output streams
+
+    fcMP4VideoStats()
+        : num_frames(), convert_time(), convert_wait_time(), encode_time(), mux_time()
     {}
 };
 
@@ -202,6 +371,16 @@ fcCLinkage fcExport void            fcMP4DestroyContext(fcIMP4Context *ctx);
 fcCLinkage fcExport const char*     fcMP4GetAudioEncoderInfo(fcIMP4Context *ctx);
 fcCLinkage fcExport const char*     fcMP4GetVideoEncoderInfo(fcIMP4Context *ctx);
 fcCLinkage fcExport void            fcMP4AddOutputStream(fcIMP4Context *ctx, fcStream *stream);
+// each output stream is written by its own thread. max_queued_frames=0 means unbounded.
+fcCLinkage fcExport void            fcMP4AddOutputStreamWithPolicy(fcIMP4Context *ctx, fcStream *stream, fcMP4DropPolicy policy, int max_queued_frames);
+fcCLinkage fcExport bool            fcMP4GetOutputStreamStats(fcIMP4Context *ctx, fcStream *stream, fcMP4OutputStreamStats *stats);
+fcCLinkage fcExport bool            fcMP4GetVideoStats(fcIMP4Context *ctx, fcMP4VideoStats *stats);
+// write the last 'seconds' of the replay buffer as a standalone mp4 on a background thread. no re-encoding.
+// the stream must be kept alive until fcMP4IsDumpingReplay() returns false.
+fcCLinkage fcExport bool            fcMP4DumpReplay(fcIMP4Context *ctx, fcStream *stream, fcTime seconds);
+// same as fcMP4DumpReplay() but the file stream is created and destroyed by the context.
+fcCLinkage fcExport bool            fcMP4DumpReplayFile(fcIMP4Context *ctx, const char *path, fcTime seconds);
+fcCLinkage fcExport bool            fcMP4IsDumpingReplay(fcIMP4Context *ctx);
 // timestamp=-1 is treated as current time.
 fcCLinkage fcExport bool            fcMP4AddVideoFramePixels(fcIMP4Context *ctx, const void *pixels, fcPixelFormat fmt, fcTime timestamp = -1.0);
 // timestamp=-1 is treated as current time.
@@ -17,6 +17,96 @@ void ExrTestImpl(fcIExrContext *ctx, const char *filename)
     fcExrEndFrame(ctx);
 }
 
+// G-buffer like layout: each layer group goes to its own part
+static void ExrMultiPartTestImpl(fcIExrContext *ctx, const char *filename)
+{
+    const int Width = 320;
+    const int Height = 240;
+
+    TBuffer<RGBAf16> video_frame(Width * Height);
+    CreateVideoData(&video_frame[0], Width, Height, 0);
+    fcExrBeginFrame(ctx, filename, Width, Height);
+    fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, 0, "R");
+    fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, 1, "G");
+    fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, 2, "B");
+    fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, 0, "Albedo.R", false, fcExrCompression_PIZ);
+    fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, 1, "Albedo.G", false, fcExrCompression_PIZ);
+    fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, 2, "Albedo.B", false, fcExrCompression_PIZ);
+    fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, 3, "Depth.R", false, fcExrCompression_Zip);
+    fcExrEndFrame(ctx);
+}
+
+
+// HDR-ish test image: smooth gradients with values above 1.0 and some noise
+static void CreateHDRVideoData(RGBAf16 *pixels, int width, int height, int frame)
+{
+    uint32_t seed = 12345 + frame;
+    for (int iy = 0; iy < height; iy++) {
+        for (int ix = 0; ix < width; ix++) {
+            seed = seed * 1664525 + 1013904223;
+            float noise = float(seed >> 16) / 65535.0f * 0.05f;
+            float u = float(ix) / float(width);
+            float v = float(iy) / float(height);
+            float sun = std::max<float>(0.0f, 1.0f - std::sqrt((u - 0.7f)*(u - 0.7f) + (v - 0.3f)*(v - 0.3f)) * 4.0f);
+            pixels[iy * width + ix] = RGBAf16(
+                u * 2.0f + sun * 8.0f + noise,
+                v * 1.5f + sun * 6.0f + noise,
+                (1.0f - v) * 0.8f + sun * 4.0f + noise,
+                1.0f);
+        }
+    }
+}
+
+void ExrCompressionBenchmark()
+{
+    printf("ExrCompressionBenchmark begin\n");
+
+    const int Width = 1920;
+    const int Height = 1080;
+    const int NumFrames = 16;
+    const char *channel_names[] = { "R", "G", "B", "A" };
+    struct Codec { fcExrCompression compression; const char *name; };
+    const Codec codecs[] = {
+        { fcExrCompression_None,  "None" },
+        { fcExrCompression_RLE,   "RLE" },
+        { fcExrCompression_ZipS,  "ZipS" },
+        { fcExrCompression_Zip,   "Zip" },
+        { fcExrCompression_PIZ,   "PIZ" },
+        { fcExrCompression_PXR24, "PXR24" },
+        { fcExrCompression_B44,   "B44" },
+        { fcExrCompression_B44A,  "B44A" },
+        { fcExrCompression_DWAA,  "DWAA" },
+        { fcExrCompression_DWAB,  "DWAB" },
+    };
+
+    TBuffer<RGBAf16> video_frame(Width * Height);
+    CreateHDRVideoData(&video_frame[0], Width, Height, 0);
+
+    for (auto& codec : codecs) {
+        fcExrConfig conf;
+        conf.compression = codec.compression;
+        fcIExrContext *ctx = fcExrCreateContext(&conf);
+        fcStream *mstream = fcCreateMemoryStream(); // measure codec cost without disk I/O
+
+        fcTime begin = fcGetTime();
+        for (int f = 0; f < NumFrames; ++f) {
+            fcExrBeginFrameStream(ctx, mstream, Width, Height);
+            for (int i = 0; i < 4; ++i) {
+                fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, i, channel_names[i]);
+            }
+            fcExrEndFrame(ctx);
+        }
+        fcExrDestroyContext(ctx); // wait all tasks
+        fcTime elapsed = fcGetTime() - begin;
+
+        printf("    %-6s: %8.2f ms/frame, %10zu bytes/frame\n",
+            codec.name, elapsed * 1000.0 / NumFrames, (size_t)(fcStreamGetWrittenSize(mstream) / NumFrames));
+        fcDestroyStream(mstream);
+    }
+
+    printf("ExrCompressionBenchmark end\n");
+}
+
 void ExrTest()
 {
     printf("ExrTest begin\n");
@@ -27,5 +117,100 @@ void ExrTest()
     ExrTestImpl<RGBAf32>(ctx, "RGBAf32.exr");
     fcExrDestroyContext(ctx);
 
+    fcExrConfig conf;
+    conf.store_u8_as_uint = true;
+    ctx = fcExrCreateContext(&conf);
+    ExrTestImpl<RGBAu8>(ctx, "RGBAu8_UInt.exr");
+    fcExrDestroyContext(ctx);
+
+    conf = fcExrConfig();
+    conf.multi_part = true;
+    ctx = fcExrCreateContext(&conf);
+    ExrMultiPartTestImpl(ctx, "MultiPart.exr");
+    fcExrDestroyContext(ctx);
+
+    conf.tile_size = 64;
+    ctx = fcExrCreateContext(&conf);
+    ExrMultiPartTestImpl(ctx, "MultiPartTiled.exr");
+    fcExrDestroyContext(ctx);
+
+    // sparse image: auto crop and explicit roi
+    {
+        const int Width = 320;
+        const int Height = 240;
+        const char *channel_names[] = { "R", "G", "B", "A" };
+        TBuffer<RGBAf16> video_frame(Width * Height);
+        CreateVideoData(&video_frame[0], Width, Height, 0);
+        for (int iy = 0; iy < Height; ++iy) {
+            for (int ix = 0; ix < Width; ++ix) {
+                bool inside = ix >= 100 && ix < 180 && iy >= 60 && iy < 150;
+                if (!inside) { video_frame[iy * Width + ix] = RGBAf16(0.0f, 0.0f, 0.0f, 0.0f); }
+            }
+        }
+
+        fcExrConfig cconf;
+        cconf.auto_crop = fcExrAutoCrop_Alpha;
+        ctx = fcExrCreateContext(&cconf);
+        fcExrBeginFrame(ctx, "RGBAf16_AutoCrop.exr", Width, Height);
+        for (int i = 0; i < 4; ++i) {
+            fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, i, channel_names[i]);
+        }
+        fcExrEndFrame(ctx);
+
+        fcExrRegion roi(120, 80, 40, 40);
+        fcExrBeginFrame(ctx, "RGBAf16_ROI.exr", Width, Height, &roi);
+        for (int i = 0; i < 4; ++i) {
+            fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, i, channel_names[i]);
+        }
+        fcExrEndFrame(ctx);
+        fcExrDestroyContext(ctx);
+    }
+
+    // borrowed pixels: released by the frame callback
+    {
+        const int Width = 320;
+        const int Height = 240;
+        const char *channel_names[] = { "R", "G", "B", "A" };
+        auto *video_frame = new TBuffer<RGBAf16>(Width * Height);
+        CreateVideoData(&(*video_frame)[0], Width, Height, 0);
+
+        fcExrConfig bconf;
+        bconf.borrow_pixels = true;
+        ctx = fcExrCreateContext(&bconf);
+        fcExrBeginFrame(ctx, "RGBAf16_Borrowed.exr", Width, Height);
+        for (int i = 0; i < 4; ++i) {
+            fcExrAddLayerPixels(ctx, &(*video_frame)[0], fcPixelFormat_RGBAf16, i, channel_names[i]);
+        }
+        fcExrEndFrame(ctx, [](void *userdata, bool succeeded) {
+            if (!succeeded) { printf("    RGBAf16_Borrowed.exr failed\n"); }
+            delete (TBuffer<RGBAf16>*)userdata;
+        }, video_frame);
+        fcExrDestroyContext(ctx);
+    }
+
+    // memory stream
+    {
+        const int Width = 320;
+        const int Height = 240;
+        const char *channel_names[] = { "R", "G", "B", "A" };
+        TBuffer<RGBAf16> video_frame(Width * Height);
+        CreateVideoData(&video_frame[0], Width, Height, 0);
+
+        fcStream *mstream = fcCreateMemoryStream();
+        ctx = fcExrCreateContext();
+        fcExrBeginFrameStream(ctx, mstream, Width, Height);
+        for (int i = 0; i < 4; ++i) {
+            fcExrAddLayerPixels(ctx, &video_frame[0], fcPixelFormat_RGBAf16, i, channel_names[i]);
+        }
+        fcExrEndFrame(ctx);
+        fcExrDestroyContext(ctx);
+
+        fcBufferData data = fcStreamGetBufferData(mstream);
+        if (data.data) {
+            std::ofstream("RGBAf16_MemoryStream.exr", std::ios::binary).write((const char*)data.data, data.size);
+        }
+        fcDestroyStream(mstream);
+    }
+
     printf("ExrTest end\n");
 }
@@ -26,6 +26,437 @@ void GifTestImpl(const char *filename)
     fcGifDestroyContext(ctx);
 }
 
+// gameplay-ish test image: gradients, a moving disc and some noise. needs the whole palette.
+static void CreateColorfulVideoData(RGBAu8 *pixels, int width, int height, int frame)
+{
+    uint32_t seed = 777 + frame;
+    float cx = 0.5f + 0.3f * std::cos(frame * 0.1f);
+    float cy = 0.5f + 0.3f * std::sin(frame * 0.1f);
+    for (int iy = 0; iy < height; iy++) {
+        for (int ix = 0; ix < width; ix++) {
+            seed = seed * 1664525 + 1013904223;
+            int noise = (seed >> 24) & 15;
+            float u = float(ix) / float(width);
+            float v = float(iy) / float(height);
+            int r = int(255 * u), g = int(255 * v), b = int(255 * (1.0f - u));
+            if ((u - cx)*(u - cx) + (v - cy)*(v - cy) < 0.15f*0.15f) { r = 255; g = 200; b = 40; }
+            if (((ix / 40) + (iy / 40)) % 7 == 0) { r /= 2; g = 255 - g; }
+            pixels[iy * width + ix] = RGBAu8(
+                (u8)std::min<int>(255, r + noise),
+                (u8)std::min<int>(255, g + noise),
+                (u8)std::min<int>(255, b + noise),
+                255);
+        }
+    }
+}
+
+// encode frames into memory. returns elapsed time and stores encoded gif to *dst.
+// if psnr is not null, frames are decoded and compared with the source.
+static fcTime GifEncodeToMemory(const fcGifConfig& conf, const std::vector<TBuffer<RGBAu8>>& frames, bool keyframes, std::string *dst, double *psnr = nullptr)
+{
+    fcTime begin = fcGetTime();
+    fcIGifContext *ctx = fcGifCreateContext(&conf);
+    fcTime t = 0;
+    for (auto& frame : frames) {
+        fcGifAddFramePixels(ctx, &frame[0], fcPixelFormat_RGBAu8, keyframes, t);
+        t += 1.0 / 30.0;
+    }
+    fcStream *mstream = fcCreateMemoryStream();
+    fcGifWrite(ctx, mstream);
+    fcTime elapsed = fcGetTime() - begin;
+
+    fcBufferData data = fcStreamGetBufferData(mstream);
+    dst->assign((const char*)data.data, data.size);
+    fcDestroyStream(mstream);
+
+    if (psnr) {
+        double se = 0.0;
+        size_t n = 0;
+        TBuffer<RGBAu8> decoded(conf.width * conf.height);
+        for (int i = 0; i < (int)frames.size(); ++i) {
+            fcGifGetFramePixels(ctx, &decoded[0], i);
+            for (int pi = 0; pi < conf.width * conf.height; ++pi) {
+                const RGBAu8 &a = frames[i][pi], &b = decoded[pi];
+                double dr = a.r - b.r, dg = a.g - b.g, db = a.b - b.b;
+                se += dr*dr + dg*dg + db*db;
+            }
+            n += conf.width * conf.height * 3;
+        }
+        double mse = se / double(n);
+        *psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
+    }
+    fcGifDestroyContext(ctx);
+    return elapsed;
+}
+
+void GifPaletteMapperBenchmark()
+{
+    printf("GifPaletteMapperBenchmark begin\n");
+
+    const int Width = 640;
+    const int Height = 360;
+    const int NumFrames = 30;
+    struct Mapper { fcGifPaletteMapper mapper; const char *name; };
+    const Mapper mappers[] = {
+        { fcGifPaletteMapper_Exhaustive, "Exhaustive" },
+        { fcGifPaletteMapper_Exact,      "Exact" },
+        { fcGifPaletteMapper_InverseMap, "InverseMap" },
+    };
+
+    std::vector<TBuffer<RGBAu8>> frames(NumFrames);
+    for (int i = 0; i < NumFrames; ++i) {
+        frames[i].resize(Width * Height);
+        CreateColorfulVideoData(&frames[i][0], Width, Height, i);
+    }
+
+    std::string reference;
+    for (auto& m : mappers) {
+        fcGifConfig conf;
+        conf.width = Width;
+        conf.height = Height;
+        conf.palette_mapper = m.mapper;
+
+        std::string encoded;
+        fcTime elapsed = GifEncodeToMemory(conf, frames, false, &encoded);
+        if (m.mapper == fcGifPaletteMapper_Exhaustive) { reference = encoded; }
+
+        printf("    %-10s: %8.2f ms/frame, %10zu bytes, %s\n",
+            m.name, elapsed * 1000.0 / NumFrames, encoded.size(),
+            encoded == reference ? "identical to Exhaustive" : "differs from Exhaustive");
+    }
+
+    printf("GifPaletteMapperBenchmark end\n");
+}
+
+void GifQuantizerBenchmark()
+{
+    printf("GifQuantizerBenchmark begin\n");
+
+    const int Width = 640;
+    const int Height = 360;
+    const int NumFrames = 30;
+    struct Quantizer { fcGifQuantizer quantizer; const char *name; };
+    const Quantizer quantizers[] = {
+        { fcGifQuantizer_NeuQuant,  "NeuQuant" },
+        { fcGifQuantizer_Octree,    "Octree" },
+        { fcGifQuantizer_MedianCut, "MedianCut" },
+        { fcGifQuantizer_KMeans,    "KMeans" },
+    };
+    const int samples[] = { 1, 4, 16 };
+
+    std::vector<TBuffer<RGBAu8>> frames(NumFrames);
+    for (int i = 0; i < NumFrames; ++i) {
+        frames[i].resize(Width * Height);
+        CreateColorfulVideoData(&frames[i][0], Width, Height, i);
+    }
+
+    for (auto& q : quantizers) {
+        for (int sample : samples) {
+            fcGifConfig conf;
+            conf.width = Width;
+            conf.height = Height;
+            conf.quantizer = q.quantizer;
+            conf.quantize_sample = sample;
+
+            // every frame is a keyframe to measure palette generation
+            std::string encoded;
+            double psnr = 0.0;
+            fcTime elapsed = GifEncodeToMemory(conf, frames, true, &encoded, &psnr);
+            printf("    %-9s sample %2d: %8.2f ms/frame, PSNR %6.2f dB, %10zu bytes\n",
+                q.name, sample, elapsed * 1000.0 / NumFrames, psnr, encoded.size());
+        }
+    }
+
+    printf("GifQuantizerBenchmark end\n");
+}
+
+void GifDitherBenchmark()
+{
+    printf("GifDitherBenchmark begin\n");
+
+    const int Width = 1280;
+    const int Height = 720;
+    const int NumFrames = 30;
+    struct Dither { fcGifDither dither; const char *name; };
+    const Dither dithers[] = {
+        { fcGifDither_None,           "None" },
+        { fcGifDither_FloydSteinberg, "FloydSteinberg" },
+        { fcGifDither_Ordered,        "Ordered" },
+    };
+
+    std::vector<TBuffer<RGBAu8>> frames(NumFrames);
+    for (int i = 0; i < NumFrames; ++i) {
+        frames[i].resize(Width * Height);
+        CreateColorfulVideoData(&frames[i][0], Width, Height, i);
+    }
+
+    for (auto& d : dithers) {
+        fcGifConfig conf;
+        conf.width = Width;
+        conf.height = Height;
+        conf.quantizer = fcGifQuantizer_MedianCut;
+        conf.dither = d.dither;
+        conf.max_active_tasks = 1; // one frame at a time to see how a frame scales across cores
+
+        std::string encoded;
+        double psnr = 0.0;
+        fcTime elapsed = GifEncodeToMemory(conf, frames, true, &encoded, &psnr);
+        printf("    %-14s: %8.2f ms/frame, PSNR %6.2f dB, %10zu bytes\n",
+            d.name, elapsed * 1000.0 / NumFrames, psnr, encoded.size());
+    }
+
+    printf("GifDitherBenchmark end\n");
+}
+
+// settings that leave most of the time to lzw encoding and decoding.
+// frames are decoded back and compared with the source. a broken lzw stream decodes to garbage.
+void GifLzwBenchmark()
+{
+    printf("GifLzwBenchmark begin\n");
+
+    const int Width = 1920;
+    const int Height = 1080;
+    const int NumFrames = 30;
+    struct Content { int noise; const char *name; };
+    const Content contents[] = {
+        { 0,   "Smooth" },
+        { 64,  "Noisy" },
+    };
+
+    for (auto& c : contents) {
+        std::vector<TBuffer<RGBAu8>> frames(NumFrames);
+        for (int i = 0; i < NumFrames; ++i) {
+            frames[i].resize(Width * Height);
+            CreateColorfulVideoData(&frames[i][0], Width, Height, i);
+            uint32_t seed = i + 1;
+            for (auto& p : frames[i]) {
+                seed = seed * 1103515245 + 12345;
+                int noise = c.noise ? (seed >> 16) % c.noise : 0;
+                p.r = (u8)std::min<int>(255, p.r + noise);
+            }
+        }
+
+        fcGifConfig conf;
+        conf.width = Width;
+        conf.height = Height;
+        conf.palette_mapper = fcGifPaletteMapper_InverseMap;
+        conf.quantize_sample = 16;
+        conf.dither = fcGifDither_None;
+        conf.delta_frames = false;
+
+        std::string encoded;
+        double psnr = 0.0;
+        fcTime elapsed = GifEncodeToMemory(conf, frames, false, &encoded, &psnr);
+        printf("    %-6s: %8.2f ms/frame, PSNR %6.2f dB, %10zu bytes\n", c.name, elapsed * 1000.0 / NumFrames, psnr, encoded.size());
+        if (psnr < 20.0) {
+            printf("    %s failed: decoded frames don't match the source\n", c.name);
+        }
+    }
+
+    printf("GifLzwBenchmark end\n");
+}
+
+// every frame is a keyframe. static scene keeps its palette when reuse is enabled
+void GifPaletteReuseBenchmark()
+{
+    printf("GifPaletteReuseBenchmark begin\n");
+
+    const int Width = 640;
+    const int Height = 360;
+    const int NumFrames = 30;
+    const float thresholds[] = { 0.0f, 0.5f, 1.0f, 2.0f };
+
+    std::vector<TBuffer<RGBAu8>> frames(NumFrames);
+    for (int i = 0; i < NumFrames; ++i) {
+        frames[i].resize(Width * Height);
+        CreateColorfulVideoData(&frames[i][0], Width, Height, i);
+    }
+
+    for (float threshold : thresholds) {
+        fcGifConfig conf;
+        conf.width = Width;
+        conf.height = Height;
+        conf.palette_reuse_threshold = threshold;
+
+        std::string encoded;
+        double psnr = 0.0;
+        fcTime elapsed = GifEncodeToMemory(conf, frames, true, &encoded, &psnr);
+        printf("    threshold %.1f: %8.2f ms/frame, PSNR %6.2f dB, %10zu bytes\n",
+            threshold, elapsed * 1000.0 / NumFrames, psnr, encoded.size());
+    }
+
+    printf("GifPaletteReuseBenchmark end\n");
+}
+
+// PSNR of rgb channels in [x0,x1) x [y0,y1)
+static double GifRegionPSNR(const RGBAu8 *a, const RGBAu8 *b, int width, int x0, int y0, int x1, int y1)
+{
+    double se = 0.0;
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            const RGBAu8 &pa = a[y * width + x], &pb = b[y * width + x];
+            double dr = pa.r - pb.r, dg = pa.g - pb.g, db = pa.b - pb.b;
+            se += dr*dr + dg*dg + db*db;
+        }
+    }
+    double mse = se / double((x1 - x0) * (y1 - y0) * 3);
+    return mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : 99.0;
+}
+
+// mostly static clip: checks delta frames and that expected data size matches what is written
+static void GifDeltaTestImpl(bool delta_frames, const char *filename)
+{
+    const int Width = 320;
+    const int Height = 240;
+    const int frame_count = 30;
+    const int probe_frame = 20; // delta frame after the keyframe at 15
+
+    fcGifConfig conf;
+    conf.width = Width;
+    conf.height = Height;
+    conf.delta_frames = delta_frames;
+    fcIGifContext *ctx = fcGifCreateContext(&conf);
+
+    fcTime t = 0;
+    TBuffer<RGBAu8> video_frame(Width * Height);
+    TBuffer<RGBAu8> probe_source(Width * Height);
+    for (int i = 0; i < frame_count; ++i) {
+        CreateColorfulVideoData(&video_frame[0], Width, Height, 0);
+        // moving square over static background
+        for (int y = 0; y < 32; ++y) {
+            for (int x = 0; x < 32; ++x) {
+                video_frame[(100 + y) * Width + i * 8 + x] = RGBAu8(255, 255, 255, 255);
+            }
+        }
+        if (i == probe_frame) { probe_source = video_frame; }
+        fcGifAddFramePixels(ctx, &video_frame[0], fcPixelFormat_RGBAu8, i == 15, t);
+        t += 1.0 / 30.0;
+    }
+
+    int expected = fcGifGetExpectedDataSize(ctx, 0, -1);
+    fcStream *fstream = fcCreateFileStream(filename);
+    fcGifWrite(ctx, fstream);
+    uint64_t written = fcStreamGetWrittenSize(fstream);
+    fcDestroyStream(fstream);
+    printf("    %s: %d bytes (expected %d)\n", filename, (int)written, expected);
+    if (written != (uint64_t)expected) {
+        printf("    %s failed: written size doesn't match expected data size\n", filename);
+    }
+
+    // range that begins with a delta frame
+    int expected_range = fcGifGetExpectedDataSize(ctx, 10, 20);
+    fcStream *mstream = fcCreateMemoryStream();
+    fcGifWrite(ctx, mstream, 10, 20);
+    uint64_t written_range = fcStreamGetWrittenSize(mstream);
+    fcDestroyStream(mstream);
+    printf("    %s [10,20): %d bytes (expected %d)\n", filename, (int)written_range, expected_range);
+    if (written_range != (uint64_t)expected_range) {
+        printf("    %s [10,20) failed: written size doesn't match expected data size\n", filename);
+    }
+
+    // decode the delta frame back. stale pixels left behind by the square show up around it.
+    TBuffer<RGBAu8> decoded(Width * Height);
+    fcGifGetFramePixels(ctx, &decoded[0], probe_frame);
+    double psnr_frame = GifRegionPSNR(&probe_source[0], &decoded[0], Width, 0, 0, Width, Height);
+    double psnr_square = GifRegionPSNR(&probe_source[0], &decoded[0], Width, (probe_frame - 1) * 8, 100, probe_frame * 8 + 32, 132);
+    printf("    %s frame %d: PSNR %6.2f dB, around the square %6.2f dB\n", filename, probe_frame, psnr_frame, psnr_square);
+    if (psnr_frame < 20.0 || psnr_square < 20.0) {
+        printf("    %s failed: decoded frame %d doesn't match the source\n", filename, probe_frame);
+    }
+
+    fcGifDestroyContext(ctx);
+}
+
+// keeps only the last frames like a replay buffer
+static void GifRollingTestImpl(int max_frames, int max_data_size, const char *filename)
+{
+    const int Width = 320;
+    const int Height = 240;
+    const int frame_count = 90;
+
+    fcGifConfig conf;
+    conf.width = Width;
+    conf.height = Height;
+    conf.max_frames = max_frames;
+    conf.max_data_size = max_data_size;
+    fcIGifContext *ctx = fcGifCreateContext(&conf);
+
+    fcTime t = 0;
+    TBuffer<RGBAu8> video_frame(Width * Height);
+    for (int i = 0; i < frame_count; ++i) {
+        CreateColorfulVideoData(&video_frame[0], Width, Height, i);
+        fcGifAddFramePixels(ctx, &video_frame[0], fcPixelFormat_RGBAu8, i % 30 == 0, t);
+        t += 1.0 / 30.0;
+    }
+
+    int expected = fcGifGetExpectedDataSize(ctx, 0, -1);
+    fcStream *fstream = fcCreateFileStream(filename);
+    fcGifWrite(ctx, fstream);
+    uint64_t written = fcStreamGetWrittenSize(fstream);
+    fcDestroyStream(fstream);
+    printf("    %s: %d frames, %d bytes (expected %d)\n", filename, fcGifGetFrameCount(ctx), (int)written, expected);
+    if (written != (uint64_t)expected) {
+        printf("    %s failed: written size doesn't match expected data size\n", filename);
+    }
+
+    fcGifDestroyContext(ctx);
+}
+
+// frames go to the file as soon as they are encoded.
+// the same frames are also fed to a regular context; the streamed file must be identical to its output.
+static void GifStreamingTestImpl(const char *filename)
+{
+    const int Width = 320;
+    const int Height = 240;
+    const int frame_count = 90;
+
+    fcGifConfig conf;
+    conf.width = Width;
+    conf.height = Height;
+    fcStream *fstream = fcCreateFileStream(filename);
+    fcIGifContext *ctx = fcGifCreateStreamingContext(&conf, fstream);
+    fcIGifContext *ref = fcGifCreateContext(&conf);
+
+    fcTime t = 0;
+    int max_frames = 0;
+    TBuffer<RGBAu8> video_frame(Width * Height);
+    for (int i = 0; i < frame_count; ++i) {
+        CreateColorfulVideoData(&video_frame[0], Width, Height, i);
+        fcGifAddFramePixels(ctx, &video_frame[0], fcPixelFormat_RGBAu8, i % 30 == 0, t);
+        fcGifAddFramePixels(ref, &video_frame[0], fcPixelFormat_RGBAu8, i % 30 == 0, t);
+        max_frames = std::max<int>(max_frames, fcGifGetFrameCount(ctx));
+        t += 1.0 / 30.0;
+    }
+    fcGifDestroyContext(ctx);
+
+    uint64_t written = fcStreamGetWrittenSize(fstream);
+    fcDestroyStream(fstream);
+
+    int expected = fcGifGetExpectedDataSize(ref, 0, -1);
+    fcStream *mstream = fcCreateMemoryStream();
+    fcGifWrite(ref, mstream);
+    fcBufferData ref_data = fcStreamGetBufferData(mstream);
+    std::string reference((const char*)ref_data.data, ref_data.size);
+    fcDestroyStream(mstream);
+    fcGifDestroyContext(ref);
+
+    std::string streamed;
+    if (FILE *f = fopen(filename, "rb")) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) { streamed.append(buf, n); }
+        fclose(f);
+    }
+
+    printf("    %s: %d bytes (expected %d), up to %d frames were kept\n", filename, (int)written, expected, max_frames);
+    if (written != (uint64_t)expected || reference.size() != (size_t)expected) {
+        printf("    %s failed: written size doesn't match expected data size\n", filename);
+    }
+    if (streamed != reference) {
+        printf("    %s failed: streamed file differs from the regular context's output\n", filename);
+    }
+}
+
 void GifTest()
 {
     printf("GifTest begin\n");
@@ -39,6 +470,12 @@ void GifTest()
     group.run([]() { GifTestImpl<RGBAf32>("RGBAf32.gif"); });
     group.wait();
 
+    GifDeltaTestImpl(true, "Delta.gif");
+    GifDeltaTestImpl(false, "NoDelta.gif");
+    GifRollingTestImpl(40, 0, "RollingFrames.gif");
+    GifRollingTestImpl(0, 256 * 1024, "RollingBytes.gif");
+    GifStreamingTestImpl("Streaming.gif");
+
     printf("GifTest end\n");
 }
 
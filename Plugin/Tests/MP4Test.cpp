@@ -6,14 +6,12 @@ using namespace std::literals;
 size_t tellp(void *f) { return ftell((FILE*)f); }
 void   seekp(void *f, size_t pos) { fseek((FILE*)f, (long)pos, SEEK_SET); }
 size_t write(void *f, const void *data, size_t len) { return fwrite(data, 1, len, (FILE*)f); }
+// emulates a slow sink (network upload etc)
+size_t slow_write(void *f, const void *data, size_t len) { std::this_thread::sleep_for(5ms); return fwrite(data, 1, len, (FILE*)f); }
 
 
-void MP4Test()
+static void MP4DownloadCodec()
 {
-    printf("MP4Test begin\n");
-
-
-    // download OpenH264 codec
     fcMP4DownloadCodecBegin();
     for (int i = 0; i < 30; ++i) {
         if (fcMP4DownloadCodecGetState() == fcDownloadState_InProgress) {
@@ -21,26 +19,20 @@ void MP4Test()
         }
         else { break; }
     }
+}
 
+static void MP4TestImpl(fcMP4Config& conf, const char *prefix)
+{
     const int DurationInSeconds = 10;
     const int FrameRate = 60;
-    const int Width = 320;
-    const int Height = 240;
-    const int SamplingRate = 48000;
-
-    fcMP4Config conf;
-    conf.video_width = Width;
-    conf.video_height = Height;
-    conf.video_bitrate = 256000;
-    conf.audio_sample_rate = SamplingRate;
-    conf.audio_num_channels = 1;
-    conf.audio_bitrate = 64000;
-
+    const int Width = conf.video_width;
+    const int Height = conf.video_height;
+    const int SamplingRate = conf.audio_sample_rate;
 
     // create output streams
-    fcStream* fstream = fcCreateFileStream("file_stream.mp4");
+    fcStream* fstream = fcCreateFileStream((std::string(prefix) + "file_stream.mp4").c_str());
     fcStream* mstream = fcCreateMemoryStream();
-    FILE *ofile = fopen("custom_stream.mp4", "wb");
+    FILE *ofile = fopen((std::string(prefix) + "custom_stream.mp4").c_str(), "wb");
     fcStream* cstream = fcCreateCustomStream(ofile, &tellp, &seekp, &write);
 
     // create mp4 context and add output streams
@@ -84,14 +76,270 @@ void MP4Test()
     // destroy output streams
     {
         fcBufferData bd = fcStreamGetBufferData(mstream);
-        std::fstream of("memory_stream.mp4", std::ios::binary | std::ios::out);
+        std::fstream of(std::string(prefix) + "memory_stream.mp4", std::ios::binary | std::ios::out);
         of.write((char*)bd.data, bd.size);
     }
     fcDestroyStream(fstream);
     fcDestroyStream(mstream);
     fcDestroyStream(cstream);
     fclose(ofile);
+}
+
+// a slow output stream drops frames instead of stalling the encoder and the other streams.
+// it asks the encoder for a keyframe after dropping, so video must keep being written.
+static void MP4SlowStreamTest(fcMP4Config& conf)
+{
+    const int DurationInSeconds = 5;
+    const int FrameRate = 60;
+    const int NumFrames = DurationInSeconds * FrameRate;
+    const int Width = conf.video_width;
+    const int Height = conf.video_height;
+
+    fcStream* fstream = fcCreateFileStream("slow_test_file_stream.mp4");
+    FILE *ofile = fopen("slow_test_custom_stream.mp4", "wb");
+    fcStream* cstream = fcCreateCustomStream(ofile, &tellp, &seekp, &slow_write);
+
+    fcIMP4Context *ctx = fcMP4CreateContext(&conf);
+    fcMP4AddOutputStream(ctx, fstream);
+    fcMP4AddOutputStreamWithPolicy(ctx, cstream, fcMP4DropPolicy_DropUntilKeyframe, 16);
+
+    TBuffer<RGBAu8> video_frame(Width * Height);
+    fcMP4OutputStreamStats fstats, cstats;
+    int accepted_before_drop = -1; // frames the custom stream had taken when it first dropped one
+    fcTime t = 0;
+    for (int i = 0; i < NumFrames; ++i) {
+        CreateVideoData(&video_frame[0], Width, Height, i);
+        fcMP4AddVideoFramePixels(ctx, &video_frame[0], fcPixelFormat_RGBAu8, t);
+        t += 1.0 / FrameRate;
+
+        fcMP4GetOutputStreamStats(ctx, cstream, &cstats);
+        if (accepted_before_drop < 0 && cstats.dropped_frames > 0) {
+            accepted_before_drop = cstats.written_frames + cstats.queued_frames;
+        }
+    }
+
+    // wait until every frame is either written or dropped
+    for (int i = 0; i < 10000; ++i) {
+        fcMP4GetOutputStreamStats(ctx, cstream, &cstats);
+        if (cstats.written_frames + cstats.dropped_frames >= NumFrames) { break; }
+        std::this_thread::sleep_for(1ms);
+    }
+    fcMP4GetOutputStreamStats(ctx, fstream, &fstats);
+    printf("    file stream:   written %d dropped %d max lag %.3lf\n", fstats.written_frames, fstats.dropped_frames, fstats.max_lag);
+    printf("    custom stream: written %d dropped %d max lag %.3lf\n", cstats.written_frames, cstats.dropped_frames, cstats.max_lag);
+    if (accepted_before_drop >= 0 && cstats.written_frames <= accepted_before_drop) {
+        printf("    custom stream failed: no video frame was written after the first drop\n");
+    }
+
+    fcMP4DestroyContext(ctx);
+    fcDestroyStream(fstream);
+    fcDestroyStream(cstream);
+    fclose(ofile);
+}
+
+// keep the last seconds in memory and dump them on request. more frames are added than the replay buffer can hold.
+static void MP4ReplayTest(fcMP4Config& conf)
+{
+    const int DurationInSeconds = 10;
+    const int FrameRate = 60;
+    const int Width = conf.video_width;
+    const int Height = conf.video_height;
+    const int SamplingRate = conf.audio_sample_rate;
+
+    conf.replay_duration = 5.0f;
+    conf.replay_max_bytes = 1024 * 1024;
+    fcIMP4Context *ctx = fcMP4CreateContext(&conf);
+
+    // nothing to dump yet. this must fail without starting a dump
+    bool empty_result = fcMP4DumpReplayFile(ctx, "replay_empty.mp4", 3.0);
+    printf("    dump on empty buffer: %s\n", empty_result ? "started" : "failed");
+
+    TBuffer<RGBAu8> video_frame(Width * Height);
+    TBuffer<float> audio_sample(SamplingRate);
+    fcTime t = 0;
+    for (int i = 0; i < DurationInSeconds * FrameRate; ++i) {
+        if (conf.audio && i % FrameRate == 0) {
+            CreateAudioData(&audio_sample[0], (int)audio_sample.size(), i / FrameRate);
+            fcMP4AddAudioFrame(ctx, &audio_sample[0], (int)audio_sample.size(), t);
+        }
+        CreateVideoData(&video_frame[0], Width, Height, i);
+        fcMP4AddVideoFramePixels(ctx, &video_frame[0], fcPixelFormat_RGBAu8, t);
+        t += 1.0 / FrameRate;
+    }
+
+    bool result = fcMP4DumpReplayFile(ctx, "replay.mp4", 3.0);
+    while (fcMP4IsDumpingReplay(ctx)) {
+        std::this_thread::sleep_for(1ms);
+    }
+    std::ifstream ifile("replay.mp4", std::ios::binary | std::ios::ate);
+    printf("    dump: %s, %d bytes\n", result ? "succeeded" : "failed", (int)ifile.tellg());
+
+    fcMP4DestroyContext(ctx);
+    conf.replay_duration = 0.0f;
+    conf.replay_max_bytes = 0;
+}
+
+void MP4Test()
+{
+    printf("MP4Test begin\n");
+
+
+    // download OpenH264 codec
+    MP4DownloadCodec();
+
+    fcMP4Config conf;
+    conf.video_width = 320;
+    conf.video_height = 240;
+    conf.video_bitrate = 256000;
+    conf.audio_sample_rate = 48000;
+    conf.audio_num_channels = 1;
+    conf.audio_bitrate = 64000;
+    MP4TestImpl(conf, "");
+
+    // moov first, then moof + mdat per fragment
+    conf.fragmented = true;
+    conf.fragment_duration = 2.0f;
+    MP4TestImpl(conf, "fragmented_");
+
+    // moov in front of mdat. custom stream can't be read back, so it keeps moov at the end.
+    conf.fragmented = false;
+    conf.faststart = true;
+    MP4TestImpl(conf, "faststart_");
+
+    conf.faststart = false;
+    MP4ReplayTest(conf);
+
+    conf.audio = false;
+    MP4SlowStreamTest(conf);
 
     printf("MP4Test end\n");
 }
 
+// time to finalize (build and write moov) against number of samples. frames are tiny to keep encoding fast.
+void MP4FinalizeBenchmark()
+{
+    printf("MP4FinalizeBenchmark begin\n");
+
+    MP4DownloadCodec();
+
+    const int Width = 64;
+    const int Height = 64;
+    const int FrameRate = 60;
+    const int DurationsInMinutes[] = { 1, 10, 60 };
+
+    std::vector<uint8_t> i420(Width * Height * 3 / 2, 128);
+    for (bool faststart : { false, true }) {
+        for (int minutes : DurationsInMinutes) {
+            fcMP4Config conf;
+            conf.audio = false;
+            conf.video_width = Width;
+            conf.video_height = Height;
+            conf.video_max_framerate = FrameRate;
+            conf.faststart = faststart;
+
+            fcIMP4Context *ctx = fcMP4CreateContext(&conf);
+            if (!ctx) {
+                printf("    failed to create context\n");
+                return;
+            }
+            fcStream *fstream = fcCreateFileStream("finalize_benchmark.mp4");
+            fcMP4AddOutputStream(ctx, fstream);
+
+            int num_frames = minutes * 60 * FrameRate;
+            fcTime t = 0;
+            for (int i = 0; i < num_frames; ++i) {
+                fcMP4AddVideoFramePixels(ctx, i420.data(), fcPixelFormat_I420, t);
+                t += 1.0 / FrameRate;
+            }
+
+            fcTime begin = fcGetTime();
+            fcMP4DestroyContext(ctx);
+            fcTime elapsed = fcGetTime() - begin;
+            printf("    %-9s %7d samples: %8.2f ms, %10llu bytes\n", faststart ? "faststart" : "default",
+                num_frames, elapsed * 1000.0, (unsigned long long)fcStreamGetWrittenSize(fstream));
+            fcDestroyStream(fstream);
+        }
+    }
+
+    printf("MP4FinalizeBenchmark end\n");
+}
+
+// software encoding speed against number of OpenH264 threads. one slice per thread.
+// RGBA input goes through the conversion stage too, which should overlap encoding. see fcMP4VideoStats.
+void MP4EncoderBenchmark()
+{
+    printf("MP4EncoderBenchmark begin\n");
+
+    MP4DownloadCodec();
+
+    const int Width = 1920;
+    const int Height = 1080;
+    const int FrameRate = 60;
+    const int NumFrames = 300;
+    const int ThreadCounts[] = { 1, 2, 4 };
+
+    // a few moving patterns. flat frames would be too easy to encode.
+    const int NumPatterns = 8;
+    const int FrameSize = Width * Height;
+    std::vector<uint8_t> i420(FrameSize * 3 / 2 * NumPatterns);
+    for (int pi = 0; pi < NumPatterns; ++pi) {
+        uint8_t *y = &i420[FrameSize * 3 / 2 * pi];
+        uint8_t *uv = y + FrameSize;
+        for (int iy = 0; iy < Height; ++iy) {
+            for (int ix = 0; ix < Width; ++ix) {
+                y[Width * iy + ix] = uint8_t((ix + pi * 8) ^ (iy * 3) ^ (rand() & 0xf));
+            }
+        }
+        for (int i = 0; i < FrameSize / 2; ++i) {
+            uv[i] = uint8_t(128 + ((i / Width + pi) & 0x1f));
+        }
+    }
+    TBuffer<RGBAu8> rgba(FrameSize * NumPatterns);
+    for (int pi = 0; pi < NumPatterns; ++pi) {
+        CreateVideoData(&rgba[FrameSize * pi], Width, Height, pi);
+    }
+
+    for (fcPixelFormat fmt : { fcPixelFormat_I420, fcPixelFormat_RGBAu8 })
+    for (int threads : ThreadCounts) {
+        fcMP4Config conf;
+        conf.audio = false;
+        conf.video_use_hardware_encoder_if_possible = false;
+        conf.video_width = Width;
+        conf.video_height = Height;
+        conf.video_bitrate = 8192000;
+        conf.video_max_framerate = FrameRate;
+        conf.video_threads = threads;
+
+        fcIMP4Context *ctx = fcMP4CreateContext(&conf);
+        if (!ctx) {
+            printf("    failed to create context\n");
+            return;
+        }
+        fcStream *mstream = fcCreateMemoryStream();
+        fcMP4AddOutputStream(ctx, mstream);
+
+        fcTime begin = fcGetTime();
+        fcTime t = 0;
+        for (int i = 0; i < NumFrames; ++i) {
+            const void *pixels = fmt == fcPixelFormat_I420 ?
+                (const void*)&i420[FrameSize * 3 / 2 * (i % NumPatterns)] : (const void*)&rgba[FrameSize * (i % NumPatterns)];
+            fcMP4AddVideoFramePixels(ctx, pixels, fmt, t);
+            t += 1.0 / FrameRate;
+        }
+        // frames still in flight are not counted yet. averages are over finished frames.
+        fcMP4VideoStats stats;
+        fcMP4GetVideoStats(ctx, &stats);
+        fcMP4DestroyContext(ctx); // waits all frames to be encoded
+        fcTime elapsed = fcGetTime() - begin;
+        printf("    %s %d threads: %6.2f fps, %10llu bytes\n", fmt == fcPixelFormat_I420 ? "I420" : "RGBA", threads, NumFrames / elapsed,
+            (unsigned long long)fcStreamGetWrittenSize(mstream));
+        if (stats.num_frames > 0) {
+            double n = stats.num_frames / 1000.0; // per frame in milliseconds
+            printf("      per frame: convert %.2f ms, convert wait %.2f ms, encode %.2f ms, mux %.2f ms\n",
+                stats.convert_time / n, stats.convert_wait_time / n, stats.encode_time / n, stats.mux_time / n);
+        }
+        fcDestroyStream(mstream);
+    }
+
+    printf("MP4EncoderBenchmark end\n");
+}
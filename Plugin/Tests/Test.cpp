@@ -2,8 +2,16 @@
 
 void PngTest();
 void ExrTest();
+void ExrCompressionBenchmark();
 void GifTest();
+void GifPaletteMapperBenchmark();
+void GifQuantizerBenchmark();
+void GifDitherBenchmark();
+void GifLzwBenchmark();
+void GifPaletteReuseBenchmark();
 void MP4Test();
+void MP4FinalizeBenchmark();
+void MP4EncoderBenchmark();
 void ConvertTest();
 void FAACSelfBuildTest();
 
@@ -11,8 +19,11 @@ int main(int argc, char *argv[])
 {
     bool png = false;
     bool exr = false;
+    bool exr_bench = false;
     bool gif = false;
+    bool gif_bench = false;
     bool mp4 = false;
+    bool mp4_bench = false;
     bool convert = false;
     bool faac = false;
 
@@ -23,9 +34,12 @@ int main(int argc, char *argv[])
     else {
         for (int i = 1; i < argc; ++i) {
             if      (strstr(argv[i], "png")) { png = true; }
+            else if (strstr(argv[i], "exr_bench")) { exr_bench = true; }
             else if (strstr(argv[i], "exr")) { exr = true; }
+            else if (strstr(argv[i], "gif_bench")) { gif_bench = true; }
             else if (strstr(argv[i], "gif")) { gif = true; }
             else if (strstr(argv[i], "faac")) { faac = true; }
+            else if (strstr(argv[i], "mp4_bench")) { mp4_bench = true; }
             else if (strstr(argv[i], "mp4")) { mp4 = true; }
             else if (strstr(argv[i], "convert")) { convert = true; }
         }
@@ -33,8 +47,20 @@ int main(int argc, char *argv[])
 
     if (png) PngTest();
     if (exr) ExrTest();
+    if (exr_bench) ExrCompressionBenchmark();
     if (gif) GifTest();
+    if (gif_bench) {
+        GifPaletteMapperBenchmark();
+        GifQuantizerBenchmark();
+        GifDitherBenchmark();
+        GifLzwBenchmark();
+        GifPaletteReuseBenchmark();
+    }
     if (mp4) MP4Test();
+    if (mp4_bench) {
+        MP4FinalizeBenchmark();
+        MP4EncoderBenchmark();
+    }
     if (convert) ConvertTest();
     if (faac) FAACSelfBuildTest();
 }
@@ -11,12 +11,19 @@
  * Latest revisions:
  * 	1.00 (2015-11-03) initial release
  *
- * Basic usage:
+ * Basic usage (modified API. frames are encoded into memory and written separately):
  *	char *frame = new char[128*128*4]; // 4 component. RGBX format, where X is unused 
- *	jo_gif_t gif = jo_gif_start("foo.gif", 128, 128, 0, 32); 
- *	jo_gif_frame(&gif, frame, 4, false); // frame 1
- *	jo_gif_frame(&gif, frame, 4, false); // frame 2
- *	jo_gif_frame(&gif, frame, 4, false); // frame 3, ...
+ *	jo_gif_t gif = jo_gif_start(128, 128, 0, 32);
+ *	jo_gif_palette_t pal = {};
+ *	jo_gif_make_palette(&gif, &pal, (unsigned char*)frame, nullptr);
+ *	Buffer colors((char*)pal.colors, jo_gif_palette_table_size(&gif));
+ *	jo_gif_frame_t f1, f2;
+ *	jo_gif_encode_frame(&gif, &f1, (unsigned char*)frame, &pal, nullptr);
+ *	jo_gif_encode_frame(&gif, &f2, (unsigned char*)frame, &pal, prev_frame); // delta frame if gif.delta is true
+ *	jo_gif_write_header(os, &gif);
+ *	jo_gif_write_frame(os, &gif, &f1, &colors, 0, 4); // frame 0 writes the global color table
+ *	jo_gif_write_frame(os, &gif, &f2, nullptr, 1, 4);
+ *	jo_gif_write_footer(os, &gif);
  *	jo_gif_end(&gif);
  * */
 
@@ -27,16 +34,64 @@
 #include <stdio.h>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <algorithm>
 
 // To get a header file for this, either cut and paste the header,
 // or create jo_gif.h, #define JO_GIF_HEADER_FILE_ONLY, and
 // then include jo_gif.cpp from it.
 
+// how pixels are mapped to the nearest palette color
+typedef enum
+{
+    jo_gif_mapper_exhaustive,   // compare against all colors (original behavior)
+    jo_gif_mapper_exact,        // sorted palette + pruned search + per-frame cache. same result as exhaustive
+    jo_gif_mapper_inverse_map,  // 15 bit inverse color map. fastest, approximate
+} jo_gif_mapper_t;
+
+// how palettes are generated
+typedef enum
+{
+    jo_gif_quantizer_neuquant,
+    jo_gif_quantizer_octree,
+    jo_gif_quantizer_median_cut,
+    jo_gif_quantizer_kmeans,    // a few k-means iterations seeded from the global palette (median cut for the first frame)
+} jo_gif_quantizer_t;
+
+typedef enum
+{
+    jo_gif_dither_none,
+    jo_gif_dither_floyd_steinberg,  // serial over the whole frame
+    jo_gif_dither_ordered,          // 8x8 bayer matrix. rows are independent and mapped in parallel
+} jo_gif_dither_t;
+
+// runs body(arg, 0) ... body(arg, count-1), possibly in parallel, and returns when all are done
+typedef void (*jo_gif_parallel_for_t)(void *userdata, int count, void (*body)(void *arg, int i), void *arg);
+
+// palette and its lookup structures. built once per palette.
 typedef struct
 {
-    unsigned char palette[0x300];
+    unsigned char colors[0x300];
+    int numColors;
+    unsigned char sortedIdx[256]; // palette indices sorted by 2nd component
+    unsigned char sortedKey[256]; // 2nd component of sortedIdx[i]
+    unsigned char *inverseMap;    // 32x32x32 cells. only for jo_gif_mapper_inverse_map
+    float error;                  // rms error per channel on the frame it was made from. only if jo_gif_t::reuseThreshold > 0
+} jo_gif_palette_t;
+
+typedef struct
+{
+    jo_gif_palette_t palette;
     short width, height, repeat;
     int numColors, palSize;
+    jo_gif_mapper_t mapper;
+    jo_gif_quantizer_t quantizer;
+    int sample; // palettes are learned from about 1/sample of pixels
+    jo_gif_dither_t dither;
+    jo_gif_parallel_for_t parallelFor; // optional. used to map row bands when dither is not floyd_steinberg
+    void *parallelForData;
+    bool delta; // encode only the changed rectangle of non-keyframes. unchanged pixels are transparent
+    float reuseThreshold; // jo_gif_make_palette() keeps prev if its error on the frame is at most this much worse than prev->error. 0 disables
     //int frame;
 } jo_gif_t;
 
@@ -194,101 +249,728 @@ static void jo_gif_quantize(unsigned char *rgba, int rgbaSize, int sample, unsig
     }
 }
 
-typedef struct {
-    BinaryStream *os;
-    int numBits;
-    unsigned char buf[256];
-    unsigned char idx;
-    unsigned tmp;
-    int outBits;
-    int curBits;
-} jo_gif_lzw_t;
-
-static void jo_gif_lzw_write(jo_gif_lzw_t *s, int code)
-{
-    s->outBits |= code << s->curBits;
-    s->curBits += s->numBits;
-    while(s->curBits >= 8) {
-        s->buf[s->idx++] = s->outBits & 255;
-        s->outBits >>= 8;
-        s->curBits -= 8;
-        if (s->idx >= 255) {
-            (*s->os) << s->idx;
-            s->os->write((char*)s->buf, s->idx);
-            s->idx = 0;
-        }
-    }
-}
-
-static void jo_gif_lzw_encode(BinaryStream &os, unsigned char *in, int len)
+// append gif sub-blocks of lzw codes of len indices (8 bit minimum code size) to out.
+// codes are packed in a 64 bit accumulator into a raw buffer, and then split into 255 byte sub-blocks at once.
+static void jo_gif_lzw_encode(Buffer &out, const unsigned char *in, int len)
 {
-    jo_gif_lzw_t state;
+    // one code per index at most, plus clear codes (one per 3838 codes), eoi and padding. 12 bits each.
+    size_t maxCodes = (size_t)len + len / 3838 + 4;
+    unsigned char *packed = (unsigned char *)malloc(maxCodes * 12 / 8 + 16);
+    unsigned char *op = packed;
+    unsigned long long acc = 0;
+    int accBits = 0;
+    int numBits = 9;
     int maxcode = 511;
-    
-    state.os = &os;
-    state.numBits = 9;
-    state.idx = 0;
-    state.tmp = 0;
-    state.outBits = 0;
-    state.curBits = 0;
-
-    // Note: 30k stack space for dictionary =|
-    const int hashSize = 5003;
-    short codetab[hashSize];
-    int hashTbl[hashSize];
-    memset(hashTbl, 0xFF, sizeof(hashTbl));
-
-    jo_gif_lzw_write(&state, 0x100);
+
+#define JO_GIF_LZW_PUT(code)                                        \
+    acc |= (unsigned long long)(code) << accBits;                   \
+    accBits += numBits;                                             \
+    if (accBits >= 32) {                                            \
+        op[0] = (unsigned char)acc;                                 \
+        op[1] = (unsigned char)(acc >> 8);                          \
+        op[2] = (unsigned char)(acc >> 16);                         \
+        op[3] = (unsigned char)(acc >> 24);                         \
+        op += 4;                                                    \
+        acc >>= 32;                                                 \
+        accBits -= 32;                                              \
+    }
+
+    // open addressing with (string << 12 | code) in one word. 0 is empty as codes are 0x102 or larger.
+    // about half full when the dictionary is full.
+    const int hashBits = 13;
+    const int hashMask = (1 << hashBits) - 1;
+    unsigned hashTbl[1 << hashBits];
+    memset(hashTbl, 0, sizeof(hashTbl));
+
+    JO_GIF_LZW_PUT(0x100);
 
     int free_ent = 0x102;
     int ent = *in++;
-CONTINUE: 
     while (--len) {
         int c = *in++;
-        int fcode = (c << 12) + ent;
-        int key = (c << 4) ^ ent; // xor hashing
-        while(hashTbl[key] >= 0) {
-            if(hashTbl[key] == fcode) {
-                ent = codetab[key];
-                goto CONTINUE;
-            }
-            ++key;
-            key = key >= hashSize ? key - hashSize : key;
+        unsigned fcode = (c << 12) + ent;
+        int key = (int)((fcode * 2654435761u) >> (32 - hashBits));
+        unsigned e;
+        while ((e = hashTbl[key]) != 0 && (e >> 12) != fcode) {
+            key = (key + 1) & hashMask;
         }
-        jo_gif_lzw_write(&state, ent);
+        if (e != 0) {
+            ent = e & 0xFFF;
+            continue;
+        }
+        JO_GIF_LZW_PUT(ent);
         ent = c;
-        if(free_ent < 4096) {
-            if(free_ent > maxcode) {
-                ++state.numBits;
-                if(state.numBits == 12) {
+        if (free_ent < 4096) {
+            if (free_ent > maxcode) {
+                ++numBits;
+                if (numBits == 12) {
                     maxcode = 4096;
                 } else {
-                    maxcode = (1<<state.numBits)-1;
+                    maxcode = (1 << numBits) - 1;
                 }
             }
-            codetab[key] = free_ent++;
-            hashTbl[key] = fcode;
+            hashTbl[key] = (fcode << 12) | free_ent++;
         } else {
-            memset(hashTbl, 0xFF, sizeof(hashTbl));
+            memset(hashTbl, 0, sizeof(hashTbl));
             free_ent = 0x102;
-            jo_gif_lzw_write(&state, 0x100);
-            state.numBits = 9;
+            JO_GIF_LZW_PUT(0x100);
+            numBits = 9;
             maxcode = 511;
         }
     }
-    jo_gif_lzw_write(&state, ent);
-    jo_gif_lzw_write(&state, 0x101);
-    jo_gif_lzw_write(&state, 0);
-    if(state.idx) {
-        os << state.idx;
-        os.write((char*)state.buf, state.idx);
+    JO_GIF_LZW_PUT(ent);
+    JO_GIF_LZW_PUT(0x101);
+    JO_GIF_LZW_PUT(0);
+#undef JO_GIF_LZW_PUT
+    // bits of an incomplete last byte are dropped. the trailing 0 code is the padding to push eoi out.
+    while (accBits >= 8) {
+        *op++ = (unsigned char)acc;
+        acc >>= 8;
+        accBits -= 8;
+    }
+
+    size_t numBytes = op - packed;
+    size_t pos = out.size();
+    out.resize(pos + numBytes + (numBytes + 254) / 255);
+    unsigned char *dst = (unsigned char *)out.ptr() + pos;
+    for (size_t i = 0; i < numBytes; i += 255) {
+        size_t n = numBytes - i < 255 ? numBytes - i : 255;
+        *dst++ = (unsigned char)n;
+        memcpy(dst, packed + i, n);
+        dst += n;
+    }
+    free(packed);
+}
+
+// decode lzw data written by jo_gif_lzw_encode() (sub-blocks with 8 bit minimum code size) into out.
+// every dictionary string is a copy of earlier output, so the table keeps only where it is in out and its length.
+// returns number of pixels decoded. it is less than len if data is broken.
+static int jo_gif_lzw_decode(const unsigned char *data, int size, unsigned char *out, int len)
+{
+    // join sub-blocks
+    unsigned char *bytes = (unsigned char *)malloc(size + 8);
+    int numBytes = 0;
+    for (int i = 0; i < size;) {
+        int n = data[i++];
+        if (n == 0) { break; }
+        n = n < size - i ? n : size - i;
+        memcpy(bytes + numBytes, data + i, n);
+        numBytes += n;
+        i += n;
+    }
+
+    int offset[4096];
+    unsigned short length[4096];
+    for (int i = 0; i < 0x100; ++i) { length[i] = 1; }
+    int numBits = 9;
+    int next = 0x102;
+    int prev = -1;
+    int op = 0;
+    unsigned long long acc = 0;
+    int accBits = 0;
+    int ip = 0;
+    for (;;) {
+        while (accBits <= 56 && ip < numBytes) {
+            acc |= (unsigned long long)bytes[ip++] << accBits;
+            accBits += 8;
+        }
+        if (accBits < numBits) { break; }
+
+        // take as many codes as the accumulator holds
+        do {
+            int code = (int)(acc & ((1 << numBits) - 1));
+            acc >>= numBits;
+            accBits -= numBits;
+
+            if (code == 0x100) {
+                numBits = 9;
+                next = 0x102;
+                prev = -1;
+                continue;
+            }
+            if (code == 0x101 || code > next || (prev < 0 && code >= 0x100)) {
+                goto END;
+            }
+
+            if (prev >= 0 && next < 4096) {
+                // previous string + first char of this one. it is at where the previous string was written
+                offset[next] = op - length[prev];
+                length[next] = length[prev] + 1;
+                ++next;
+                if (next == (1 << numBits) && numBits < 12) { ++numBits; }
+            }
+            prev = code;
+
+            if (code < 0x100) {
+                out[op++] = (unsigned char)code;
+            }
+            else {
+                int n = length[code];
+                if (n > len - op) { n = len - op; }
+                const unsigned char *src = out + offset[code];
+                unsigned char *dst = out + op;
+                if (src + n <= dst) {
+                    memcpy(dst, src, n);
+                }
+                else {
+                    // kwkwk case. the string overlaps itself
+                    for (int i = 0; i < n; ++i) { dst[i] = src[i]; }
+                }
+                op += n;
+            }
+            if (op >= len) { goto END; }
+        } while (accBits >= numBits);
     }
+END:
+    free(bytes);
+    return op;
 }
 
 static int jo_gif_clamp(int a, int b, int c) { return a < b ? b : a > c ? c : a; }
 
+static inline int jo_gif_nearest_exhaustive(const jo_gif_palette_t *pal, int c0, int c1, int c2)
+{
+    const unsigned char *colors = pal->colors;
+    int bestd = 0x7FFFFFFF, best = -1;
+    for (int i = 0; i < pal->numColors; ++i) {
+        int d0 = colors[i*3+0] - c0;
+        int d1 = colors[i*3+1] - c1;
+        int d2 = colors[i*3+2] - c2;
+        int d = d0*d0 + d1*d1 + d2*d2;
+        if (d < bestd) {
+            bestd = d;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// walk the palette sorted by 2nd component outward from c1, and stop each direction when
+// that component alone is farther than the best match. ties are resolved to the lowest index
+// so the result is always identical to jo_gif_nearest_exhaustive().
+static inline int jo_gif_nearest_exact(const jo_gif_palette_t *pal, int c0, int c1, int c2)
+{
+    const unsigned char *colors = pal->colors;
+    const unsigned char *keys = pal->sortedKey;
+    const unsigned char *idx = pal->sortedIdx;
+    int n = pal->numColors;
+
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (keys[mid] < c1) { lo = mid + 1; } else { hi = mid; }
+    }
+
+    int bestd = 0x7FFFFFFF, best = 256;
+    int up = lo, down = lo - 1;
+    bool upAlive = up < n, downAlive = down >= 0;
+    while (upAlive || downAlive) {
+        if (upAlive) {
+            int dk = keys[up] - c1;
+            if (dk*dk > bestd) { upAlive = false; }
+            else {
+                int i = idx[up];
+                int d0 = colors[i*3+0] - c0;
+                int d2 = colors[i*3+2] - c2;
+                int d = d0*d0 + dk*dk + d2*d2;
+                if (d < bestd || (d == bestd && i < best)) {
+                    bestd = d;
+                    best = i;
+                }
+                upAlive = ++up < n;
+            }
+        }
+        if (downAlive) {
+            int dk = keys[down] - c1;
+            if (dk*dk > bestd) { downAlive = false; }
+            else {
+                int i = idx[down];
+                int d0 = colors[i*3+0] - c0;
+                int d2 = colors[i*3+2] - c2;
+                int d = d0*d0 + dk*dk + d2*d2;
+                if (d < bestd || (d == bestd && i < best)) {
+                    bestd = d;
+                    best = i;
+                }
+                downAlive = --down >= 0;
+            }
+        }
+    }
+    return best;
+}
+
+static inline int jo_gif_cell(int c0, int c1, int c2) { return ((c0 >> 3) << 10) | ((c1 >> 3) << 5) | (c2 >> 3); }
+
+// build lookup structures after colors & numColors are set
+static void jo_gif_palette_build(jo_gif_palette_t *pal, jo_gif_mapper_t mapper)
+{
+    int n = pal->numColors;
+    for (int i = 0; i < n; ++i) {
+        pal->sortedIdx[i] = (unsigned char)i;
+    }
+    // insertion sort. stable, so equal keys keep index order
+    for (int i = 1; i < n; ++i) {
+        unsigned char t = pal->sortedIdx[i];
+        int j = i;
+        for (; j > 0 && pal->colors[pal->sortedIdx[j-1]*3+1] > pal->colors[t*3+1]; --j) {
+            pal->sortedIdx[j] = pal->sortedIdx[j-1];
+        }
+        pal->sortedIdx[j] = t;
+    }
+    for (int i = 0; i < n; ++i) {
+        pal->sortedKey[i] = pal->colors[pal->sortedIdx[i]*3+1];
+    }
+
+    if (mapper == jo_gif_mapper_inverse_map) {
+        if (!pal->inverseMap) {
+            pal->inverseMap = (unsigned char*)malloc(0x8000);
+        }
+        // nearest color of the center of each cell
+        for (int c0 = 0; c0 < 32; ++c0) {
+            for (int c1 = 0; c1 < 32; ++c1) {
+                for (int c2 = 0; c2 < 32; ++c2) {
+                    pal->inverseMap[(c0 << 10) | (c1 << 5) | c2] =
+                        (unsigned char)jo_gif_nearest_exact(pal, (c0 << 3) | 4, (c1 << 3) | 4, (c2 << 3) | 4);
+                }
+            }
+        }
+    }
+}
+
+static void jo_gif_palette_release(jo_gif_palette_t *pal)
+{
+    free(pal->inverseMap);
+    pal->inverseMap = nullptr;
+}
+
+// maps colors to palette indices. holds per-frame cache for jo_gif_mapper_exact.
+struct jo_gif_color_mapper
+{
+    const jo_gif_palette_t *pal;
+    jo_gif_mapper_t mapper;
+    unsigned int *cache; // (c0 << 24 | c1 << 16 | c2 << 8 | index) for each 15 bit cell. 0xFFFFFFFF is empty (index never reaches 255)
+
+    jo_gif_color_mapper(const jo_gif_palette_t *p, jo_gif_mapper_t m) : pal(p), mapper(m), cache()
+    {
+        if (mapper == jo_gif_mapper_inverse_map && !pal->inverseMap) {
+            mapper = jo_gif_mapper_exact;
+        }
+        if (mapper == jo_gif_mapper_exact) {
+            cache = (unsigned int*)malloc(sizeof(unsigned int) * 0x8000);
+            memset(cache, 0xFF, sizeof(unsigned int) * 0x8000);
+        }
+    }
+    ~jo_gif_color_mapper() { free(cache); }
+
+    int operator()(int c0, int c1, int c2)
+    {
+        switch (mapper) {
+        case jo_gif_mapper_inverse_map:
+            return pal->inverseMap[jo_gif_cell(c0, c1, c2)];
+        case jo_gif_mapper_exact:
+        {
+            unsigned int key = ((unsigned int)c0 << 24) | ((unsigned int)c1 << 16) | ((unsigned int)c2 << 8);
+            unsigned int &entry = cache[jo_gif_cell(c0, c1, c2)];
+            if ((entry & 0xFFFFFF00) == key && entry != 0xFFFFFFFF) {
+                return entry & 0xFF;
+            }
+            int best = jo_gif_nearest_exact(pal, c0, c1, c2);
+            entry = key | (unsigned int)best;
+            return best;
+        }
+        default:
+            return jo_gif_nearest_exhaustive(pal, c0, c1, c2);
+        }
+    }
+};
+
+// calls f(c0, c1, c2) for about 1/sample of pixels. pixels are picked in a fixed pseudo random order to avoid aliasing.
+template<class F>
+static void jo_gif_each_sample(const unsigned char *rgba, int numPixels, int sample, const F& f)
+{
+    if (sample <= 1) {
+        for (int i = 0; i < numPixels; ++i) {
+            f(rgba[i*4+0], rgba[i*4+1], rgba[i*4+2]);
+        }
+    }
+    else {
+        int n = numPixels / sample;
+        n = n < 1 ? 1 : n;
+        unsigned int seed = 12345;
+        for (int i = 0; i < n; ++i) {
+            seed = seed * 1664525 + 1013904223;
+            int p = (int)(((unsigned long long)seed * (unsigned int)numPixels) >> 32);
+            f(rgba[p*4+0], rgba[p*4+1], rgba[p*4+2]);
+        }
+    }
+}
+
+// octree of depth 5. leaves with fewest pixels in the deepest level are merged first.
+// returns number of colors written to map.
+static int jo_gif_quantize_octree(const unsigned char *rgba, int numPixels, int sample, unsigned char *map, int numColors)
+{
+    struct Node
+    {
+        unsigned int count;
+        unsigned long long sum[3];
+        int child[8];
+        bool leaf;
+    };
+    const int maxDepth = 5;
+
+    std::vector<Node> nodes;
+    std::vector<int> levels[maxDepth]; // internal nodes of each depth
+    nodes.reserve(4096);
+    nodes.push_back(Node());
+    memset(nodes[0].child, 0xFF, sizeof(nodes[0].child));
+    levels[0].push_back(0);
+    int leaves = 0;
+
+    jo_gif_each_sample(rgba, numPixels, sample, [&](int c0, int c1, int c2) {
+        int n = 0;
+        for (int d = 0; ; ++d) {
+            Node &node = nodes[n];
+            ++node.count;
+            node.sum[0] += c0; node.sum[1] += c1; node.sum[2] += c2;
+            if (d == maxDepth) { break; }
+
+            int shift = 7 - d;
+            int ci = (((c0 >> shift) & 1) << 2) | (((c1 >> shift) & 1) << 1) | ((c2 >> shift) & 1);
+            int c = node.child[ci];
+            if (c < 0) {
+                c = (int)nodes.size();
+                nodes[n].child[ci] = c;
+                nodes.push_back(Node());
+                memset(nodes[c].child, 0xFF, sizeof(nodes[c].child));
+                if (d + 1 == maxDepth) {
+                    nodes[c].leaf = true;
+                    ++leaves;
+                }
+                else {
+                    levels[d + 1].push_back(c);
+                }
+            }
+            n = c;
+        }
+    });
+
+    // reduce
+    for (int d = maxDepth - 1; d >= 0 && leaves > numColors; --d) {
+        auto& level = levels[d];
+        std::stable_sort(level.begin(), level.end(), [&](int a, int b) { return nodes[a].count < nodes[b].count; });
+        for (int n : level) {
+            if (leaves <= numColors) { break; }
+            int merged = 0;
+            for (int c : nodes[n].child) {
+                if (c >= 0) { ++merged; }
+            }
+            nodes[n].leaf = true;
+            leaves -= merged - 1;
+        }
+    }
+
+    // gather leaves
+    int numOut = 0;
+    std::vector<int> stack(1, 0);
+    while (!stack.empty() && numOut < numColors) {
+        int n = stack.back();
+        stack.pop_back();
+        const Node &node = nodes[n];
+        if (node.leaf) {
+            for (int i = 0; i < 3; ++i) {
+                map[numOut*3+i] = (unsigned char)((node.sum[i] + node.count / 2) / node.count);
+            }
+            ++numOut;
+        }
+        else {
+            for (int i = 7; i >= 0; --i) {
+                if (node.child[i] >= 0) { stack.push_back(node.child[i]); }
+            }
+        }
+    }
+    return numOut;
+}
+
+// median cut on a 15 bit histogram. the box with the largest (pixel count * longest edge) is split at its median.
+// returns number of colors written to map.
+static int jo_gif_quantize_median_cut(const unsigned char *rgba, int numPixels, int sample, unsigned char *map, int numColors)
+{
+    struct Bin { unsigned int count; unsigned long long sum[3]; };
+    struct Box { int begin, end; unsigned long long count; int axis, range; };
+
+    std::vector<Bin> hist(0x8000);
+    jo_gif_each_sample(rgba, numPixels, sample, [&](int c0, int c1, int c2) {
+        Bin &bin = hist[((c0 >> 3) << 10) | ((c1 >> 3) << 5) | (c2 >> 3)];
+        ++bin.count;
+        bin.sum[0] += c0; bin.sum[1] += c1; bin.sum[2] += c2;
+    });
+
+    std::vector<int> bins;
+    for (int i = 0; i < 0x8000; ++i) {
+        if (hist[i].count) { bins.push_back(i); }
+    }
+    if (bins.empty()) { return 0; }
+
+    auto component = [](int bin, int axis) { return (bin >> (10 - axis * 5)) & 31; };
+    auto shrink = [&](Box &box) {
+        int lo[3] = { 31, 31, 31 }, hi[3] = {};
+        box.count = 0;
+        for (int i = box.begin; i < box.end; ++i) {
+            box.count += hist[bins[i]].count;
+            for (int a = 0; a < 3; ++a) {
+                int c = component(bins[i], a);
+                lo[a] = std::min(lo[a], c);
+                hi[a] = std::max(hi[a], c);
+            }
+        }
+        box.axis = 0;
+        for (int a = 1; a < 3; ++a) {
+            if (hi[a] - lo[a] > hi[box.axis] - lo[box.axis]) { box.axis = a; }
+        }
+        box.range = hi[box.axis] - lo[box.axis];
+    };
+
+    std::vector<Box> boxes(1);
+    boxes[0].begin = 0;
+    boxes[0].end = (int)bins.size();
+    shrink(boxes[0]);
+    while ((int)boxes.size() < numColors) {
+        int target = -1;
+        unsigned long long best = 0;
+        for (int i = 0; i < (int)boxes.size(); ++i) {
+            unsigned long long score = boxes[i].count * boxes[i].range;
+            if (boxes[i].end - boxes[i].begin >= 2 && score > best) {
+                best = score;
+                target = i;
+            }
+        }
+        if (target < 0) { break; }
+
+        Box box = boxes[target];
+        int axis = box.axis;
+        std::sort(bins.begin() + box.begin, bins.begin() + box.end,
+            [&](int a, int b) { return component(a, axis) < component(b, axis); });
+
+        unsigned long long half = box.count / 2, acc = 0;
+        int mid = box.begin;
+        while (mid < box.end - 1 && acc + hist[bins[mid]].count <= half) {
+            acc += hist[bins[mid]].count;
+            ++mid;
+        }
+        mid = mid == box.begin ? box.begin + 1 : mid;
+
+        Box a = box, b = box;
+        a.end = mid;
+        b.begin = mid;
+        shrink(a);
+        shrink(b);
+        boxes[target] = a;
+        boxes.push_back(b);
+    }
+
+    for (int i = 0; i < (int)boxes.size(); ++i) {
+        unsigned long long sum[3] = {};
+        for (int j = boxes[i].begin; j < boxes[i].end; ++j) {
+            const Bin &bin = hist[bins[j]];
+            for (int a = 0; a < 3; ++a) { sum[a] += bin.sum[a]; }
+        }
+        for (int a = 0; a < 3; ++a) {
+            map[i*3+a] = (unsigned char)((sum[a] + boxes[i].count / 2) / boxes[i].count);
+        }
+    }
+    return (int)boxes.size();
+}
+
+// k-means refinement of an initial palette. seed can be null (median cut is used then).
+// returns number of colors written to map.
+static int jo_gif_quantize_kmeans(const unsigned char *rgba, int numPixels, int sample, unsigned char *map, int numColors, const jo_gif_palette_t *seed)
+{
+    const int iterations = 3;
+
+    jo_gif_palette_t pal = {};
+    if (seed && seed->numColors > 0) {
+        memcpy(pal.colors, seed->colors, sizeof(pal.colors));
+        pal.numColors = std::min(seed->numColors, numColors);
+    }
+    else {
+        pal.numColors = jo_gif_quantize_median_cut(rgba, numPixels, sample, pal.colors, numColors);
+    }
+    if (pal.numColors == 0) { return 0; }
+
+    std::vector<unsigned long long> sums(pal.numColors * 4);
+    for (int it = 0; it < iterations; ++it) {
+        jo_gif_palette_build(&pal, jo_gif_mapper_exact);
+        jo_gif_color_mapper nearest(&pal, jo_gif_mapper_exact);
+        std::fill(sums.begin(), sums.end(), 0);
+        jo_gif_each_sample(rgba, numPixels, sample, [&](int c0, int c1, int c2) {
+            unsigned long long *s = &sums[nearest(c0, c1, c2) * 4];
+            s[0] += c0; s[1] += c1; s[2] += c2; s[3] += 1;
+        });
+        for (int i = 0; i < pal.numColors; ++i) {
+            unsigned long long *s = &sums[i * 4];
+            if (s[3] == 0) { continue; } // unused. keep as is
+            for (int a = 0; a < 3; ++a) {
+                pal.colors[i*3+a] = (unsigned char)((s[a] + s[3] / 2) / s[3]);
+            }
+        }
+    }
+    memcpy(map, pal.colors, pal.numColors * 3);
+    return pal.numColors;
+}
+
+// rms error per channel of mapping about 1/sample of pixels of the frame (gif->width x gif->height) with pal.
+float jo_gif_palette_error(jo_gif_t *gif, const jo_gif_palette_t *pal, const unsigned char *rgba, int sample)
+{
+    double se = 0.0;
+    int n = 0;
+    jo_gif_each_sample(rgba, gif->width * gif->height, sample, [&](int c0, int c1, int c2) {
+        const unsigned char *c = pal->colors + jo_gif_nearest_exact(pal, c0, c1, c2) * 3;
+        int d0 = c[0] - c0, d1 = c[1] - c1, d2 = c[2] - c2;
+        se += d0*d0 + d1*d1 + d2*d2;
+        ++n;
+    });
+    return n > 0 ? (float)sqrt(se / (3.0 * n)) : 0.0f;
+}
+
+// generate palette of the frame (gif->width x gif->height) into pal and build its lookup structures.
+// prev is optional. it is the seed of jo_gif_quantizer_kmeans, and is copied instead if it still fits the frame (see reuseThreshold).
+// returns true if prev is copied.
+bool jo_gif_make_palette(jo_gif_t *gif, jo_gif_palette_t *pal, const unsigned char *rgba, const jo_gif_palette_t *prev)
+{
+    int numPixels = gif->width * gif->height;
+    bool measure = gif->reuseThreshold > 0.0f;
+    if (measure && prev && jo_gif_palette_error(gif, prev, rgba, 16) <= prev->error + gif->reuseThreshold) {
+        memcpy(pal->colors, prev->colors, sizeof(pal->colors));
+        pal->numColors = prev->numColors;
+        // compare with the frame it was made from, so that a palette can't drift away step by step
+        pal->error = prev->error;
+        jo_gif_palette_build(pal, gif->mapper);
+        return true;
+    }
+
+    memset(pal->colors, 0, sizeof(pal->colors));
+    int sample = gif->sample < 1 ? 1 : gif->sample;
+    int n = 0;
+    switch (gif->quantizer) {
+    case jo_gif_quantizer_octree:
+        n = jo_gif_quantize_octree(rgba, numPixels, sample, pal->colors, gif->numColors);
+        break;
+    case jo_gif_quantizer_median_cut:
+        n = jo_gif_quantize_median_cut(rgba, numPixels, sample, pal->colors, gif->numColors);
+        break;
+    case jo_gif_quantizer_kmeans:
+        n = jo_gif_quantize_kmeans(rgba, numPixels, sample, pal->colors, gif->numColors, prev);
+        break;
+    default:
+        jo_gif_quantize((unsigned char*)rgba, numPixels*4, sample, pal->colors, gif->numColors);
+        n = gif->numColors;
+        break;
+    }
+    pal->numColors = n < 1 ? 1 : n;
+    jo_gif_palette_build(pal, gif->mapper);
+    if (measure) {
+        pal->error = jo_gif_palette_error(gif, pal, rgba, 16);
+    }
+    return false;
+}
+
+static void jo_gif_map_floyd_steinberg(const jo_gif_palette_t *pal, jo_gif_mapper_t mapper, const unsigned char *rgba, unsigned char *indexedPixels, int width, int height)
+{
+    int size = width * height;
+    const unsigned char *palette = pal->colors;
+    jo_gif_color_mapper nearest(pal, mapper);
+
+    unsigned char *ditheredPixels = (unsigned char*)malloc(size*4);
+    memcpy(ditheredPixels, rgba, size*4);
+    for(int k = 0; k < size*4; k+=4) {
+        indexedPixels[k/4] = (unsigned char)nearest(ditheredPixels[k+0], ditheredPixels[k+1], ditheredPixels[k+2]);
+        int diff[3] = { ditheredPixels[k+0] - palette[indexedPixels[k/4]*3+0], ditheredPixels[k+1] - palette[indexedPixels[k/4]*3+1], ditheredPixels[k+2] - palette[indexedPixels[k/4]*3+2] };
+        // Floyd-Steinberg Error Diffusion
+        // TODO: Use something better -- http://caca.zoy.org/study/part3.html
+        if(k+4 < size*4) { 
+            ditheredPixels[k+4+0] = (unsigned char)jo_gif_clamp(ditheredPixels[k+4+0]+(diff[0]*7/16), 0, 255); 
+            ditheredPixels[k+4+1] = (unsigned char)jo_gif_clamp(ditheredPixels[k+4+1]+(diff[1]*7/16), 0, 255); 
+            ditheredPixels[k+4+2] = (unsigned char)jo_gif_clamp(ditheredPixels[k+4+2]+(diff[2]*7/16), 0, 255); 
+        }
+        if(k+width*4+4 < size*4) { 
+            for(int i = 0; i < 3; ++i) {
+                ditheredPixels[k-4+width*4+i] = (unsigned char)jo_gif_clamp(ditheredPixels[k-4+width*4+i]+(diff[i]*3/16), 0, 255); 
+                ditheredPixels[k+width*4+i] = (unsigned char)jo_gif_clamp(ditheredPixels[k+width*4+i]+(diff[i]*5/16), 0, 255); 
+                ditheredPixels[k+width*4+4+i] = (unsigned char)jo_gif_clamp(ditheredPixels[k+width*4+4+i]+(diff[i]*1/16), 0, 255); 
+            }
+        }
+    }
+    free(ditheredPixels);
+}
+
+typedef struct
+{
+    const jo_gif_palette_t *pal;
+    jo_gif_mapper_t mapper;
+    jo_gif_dither_t dither;
+    const unsigned char *rgba;
+    unsigned char *indexedPixels;
+    int width, height;
+    int x0, y0; // origin of the region in the frame. keeps the dither pattern aligned with the full frame
+    int bandHeight;
+} jo_gif_map_band_args_t;
+
+// maps rows of a band without error diffusion. each band has its own color cache so bands can run in parallel.
+static void jo_gif_map_band(void *arg, int band)
+{
+    static const unsigned char bayer[8][8] = {
+        {  0, 32,  8, 40,  2, 34, 10, 42 },
+        { 48, 16, 56, 24, 50, 18, 58, 26 },
+        { 12, 44,  4, 36, 14, 46,  6, 38 },
+        { 60, 28, 52, 20, 62, 30, 54, 22 },
+        {  3, 35, 11, 43,  1, 33,  9, 41 },
+        { 51, 19, 59, 27, 49, 17, 57, 25 },
+        { 15, 47,  7, 39, 13, 45,  5, 37 },
+        { 63, 31, 55, 23, 61, 29, 53, 21 },
+    };
+
+    const jo_gif_map_band_args_t *args = (const jo_gif_map_band_args_t*)arg;
+    int width = args->width;
+    int yBegin = band * args->bandHeight;
+    int yEnd = yBegin + args->bandHeight < args->height ? yBegin + args->bandHeight : args->height;
+    jo_gif_color_mapper nearest(args->pal, args->mapper);
+
+    if (args->dither == jo_gif_dither_ordered) {
+        // threshold spread is about half of the distance between palette colors if they were evenly distributed
+        int spread = (int)(128.0 / cbrt((double)args->pal->numColors));
+        int offsets[8][8];
+        for (int y = 0; y < 8; ++y) {
+            for (int x = 0; x < 8; ++x) {
+                offsets[y][x] = (bayer[y][x] * 2 - 63) * spread / 128;
+            }
+        }
+        for (int y = yBegin; y < yEnd; ++y) {
+            const unsigned char *src = args->rgba + y * width * 4;
+            unsigned char *dst = args->indexedPixels + y * width;
+            const int *row = offsets[(y + args->y0) & 7];
+            for (int x = 0; x < width; ++x) {
+                int o = row[(x + args->x0) & 7];
+                dst[x] = (unsigned char)nearest(
+                    jo_gif_clamp(src[x*4+0] + o, 0, 255),
+                    jo_gif_clamp(src[x*4+1] + o, 0, 255),
+                    jo_gif_clamp(src[x*4+2] + o, 0, 255));
+            }
+        }
+    }
+    else {
+        for (int y = yBegin; y < yEnd; ++y) {
+            const unsigned char *src = args->rgba + y * width * 4;
+            unsigned char *dst = args->indexedPixels + y * width;
+            for (int x = 0; x < width; ++x) {
+                dst[x] = (unsigned char)nearest(src[x*4+0], src[x*4+1], src[x*4+2]);
+            }
+        }
+    }
+}
+
 jo_gif_t jo_gif_start(short width, short height, short repeat, int numColors)
 {
+    // color table has 2^(palSize+1) entries, so index numColors is always free (used as transparent index)
     numColors = numColors > 255 ? 255 : numColors < 2 ? 2 : numColors;
     jo_gif_t gif = {};
     gif.width = width;
@@ -296,6 +978,10 @@ jo_gif_t jo_gif_start(short width, short height, short repeat, int numColors)
     gif.repeat = repeat;
     gif.numColors = numColors;
     gif.palSize = (int)log2(numColors);
+    gif.mapper = jo_gif_mapper_exact;
+    gif.quantizer = jo_gif_quantizer_neuquant;
+    gif.sample = 1;
+    gif.dither = jo_gif_dither_floyd_steinberg;
     return gif;
 }
 
@@ -303,95 +989,181 @@ jo_gif_t jo_gif_start(short width, short height, short repeat, int numColors)
 struct jo_gif_frame_t
 {
     Buffer palette;
-    Buffer indexed_pixels;
-    Buffer encoded_pixels;
+    Buffer encoded_pixels; // lzw sub-blocks of w * h indices. see jo_gif_decode_indices()
     double timestamp;
+    short x, y, w, h; // region of the image descriptor
+    int transparentIndex; // -1 if opaque. otherwise this frame is drawn over the previous one
 
-    jo_gif_frame_t() : timestamp() {}
+    jo_gif_frame_t() : timestamp(), x(), y(), w(), h(), transparentIndex(-1) {}
+    bool isDelta() const { return transparentIndex >= 0; }
 };
 
-void jo_gif_frame(jo_gif_t *gif, jo_gif_frame_t *fdata, unsigned char * rgba, int frame, bool localPalette)
+// find bounding rectangle of pixels whose rgb differ. returns false if nothing changed.
+static bool jo_gif_diff_rect(const unsigned char *a, const unsigned char *b, int width, int height, int rect[4])
+{
+    int x0 = width, y0 = height, x1 = -1, y1 = -1;
+    for (int y = 0; y < height; ++y) {
+        const unsigned char *pa = a + y * width * 4;
+        const unsigned char *pb = b + y * width * 4;
+        if (memcmp(pa, pb, width * 4) == 0) { continue; } // alpha is ignored below. this is just a fast path
+        int l = -1, r = -1;
+        for (int x = 0; x < width; ++x) {
+            if (pa[x*4+0] != pb[x*4+0] || pa[x*4+1] != pb[x*4+1] || pa[x*4+2] != pb[x*4+2]) {
+                if (l < 0) { l = x; }
+                r = x;
+            }
+        }
+        if (l < 0) { continue; }
+        x0 = l < x0 ? l : x0;
+        x1 = r > x1 ? r : x1;
+        y0 = y < y0 ? y : y0;
+        y1 = y;
+    }
+    if (x1 < 0) { return false; }
+    rect[0] = x0; rect[1] = y0; rect[2] = x1 - x0 + 1; rect[3] = y1 - y0 + 1;
+    return true;
+}
+
+// map rgba (width x height at x0, y0 of the frame) to indices with pal
+static void jo_gif_map_pixels(jo_gif_t *gif, const jo_gif_palette_t *pal, jo_gif_mapper_t mapper, jo_gif_dither_t dither, const unsigned char *rgba, unsigned char *indexedPixels, int width, int height, int x0 = 0, int y0 = 0)
+{
+    if (dither == jo_gif_dither_floyd_steinberg) {
+        jo_gif_map_floyd_steinberg(pal, mapper, rgba, indexedPixels, width, height);
+    }
+    else {
+        jo_gif_map_band_args_t args = { pal, mapper, dither, rgba, indexedPixels, width, height, x0, y0, 0 };
+        // bands are large enough to keep the per-band color cache effective
+        args.bandHeight = height / 16 > 16 ? height / 16 : 16;
+        int numBands = (height + args.bandHeight - 1) / args.bandHeight;
+        if (gif->parallelFor && numBands > 1) {
+            gif->parallelFor(gif->parallelForData, numBands, jo_gif_map_band, &args);
+        }
+        else {
+            for (int i = 0; i < numBands; ++i) { jo_gif_map_band(&args, i); }
+        }
+    }
+}
+
+// size in bytes of color tables
+int jo_gif_palette_table_size(jo_gif_t *gif)
+{
+    return 3 * (1 << (gif->palSize + 1));
+}
+
+// map and encode a frame with pal. palette of fdata is not modified.
+// prevRgba: source of the previous frame. if not null and gif->delta is true, the frame is encoded as a delta frame.
+void jo_gif_encode_frame(jo_gif_t *gif, jo_gif_frame_t *fdata, const unsigned char *rgba, const jo_gif_palette_t *pal, const unsigned char *prevRgba)
 {
     short width = gif->width;
     short height = gif->height;
-    int size = width * height;
 
-    unsigned char localPalTbl[0x300];
-    unsigned char *palette = frame == 0 || !localPalette ? gif->palette : localPalTbl;
-    if (frame == 0 || localPalette) {
-        jo_gif_quantize(rgba, size*4, 1, palette, gif->numColors);
-        fdata->palette.assign((char*)palette, 3 * (1 << (gif->palSize + 1)) );
+    int rect[4] = { 0, 0, width, height };
+    bool delta = gif->delta && prevRgba;
+    if (delta && !jo_gif_diff_rect(rgba, prevRgba, width, height, rect)) {
+        // nothing changed. emit one transparent pixel
+        rect[2] = rect[3] = 1;
     }
+    int rsize = rect[2] * rect[3];
 
-    unsigned char *indexedPixels = (unsigned char *)malloc(size);
-    {
-        unsigned char *ditheredPixels = (unsigned char*)malloc(size*4);
-        memcpy(ditheredPixels, rgba, size*4);
-        for(int k = 0; k < size*4; k+=4) {
-            int rgb[3] = { ditheredPixels[k+0], ditheredPixels[k+1], ditheredPixels[k+2] };
-            int bestd = 0x7FFFFFFF, best = -1;
-            // TODO: exhaustive search. do something better.
-            for(int i = 0; i < gif->numColors; ++i) {
-                int bb = palette[i*3+0]-rgb[0];
-                int gg = palette[i*3+1]-rgb[1];
-                int rr = palette[i*3+2]-rgb[2];
-                int d = bb*bb + gg*gg + rr*rr;
-                if(d < bestd) {
-                    bestd = d;
-                    best = i;
-                }
-            }
-            indexedPixels[k/4] = best;
-            int diff[3] = { ditheredPixels[k+0] - palette[indexedPixels[k/4]*3+0], ditheredPixels[k+1] - palette[indexedPixels[k/4]*3+1], ditheredPixels[k+2] - palette[indexedPixels[k/4]*3+2] };
-            // Floyd-Steinberg Error Diffusion
-            // TODO: Use something better -- http://caca.zoy.org/study/part3.html
-            if(k+4 < size*4) { 
-                ditheredPixels[k+4+0] = (unsigned char)jo_gif_clamp(ditheredPixels[k+4+0]+(diff[0]*7/16), 0, 255); 
-                ditheredPixels[k+4+1] = (unsigned char)jo_gif_clamp(ditheredPixels[k+4+1]+(diff[1]*7/16), 0, 255); 
-                ditheredPixels[k+4+2] = (unsigned char)jo_gif_clamp(ditheredPixels[k+4+2]+(diff[2]*7/16), 0, 255); 
-            }
-            if(k+width*4+4 < size*4) { 
-                for(int i = 0; i < 3; ++i) {
-                    ditheredPixels[k-4+width*4+i] = (unsigned char)jo_gif_clamp(ditheredPixels[k-4+width*4+i]+(diff[i]*3/16), 0, 255); 
-                    ditheredPixels[k+width*4+i] = (unsigned char)jo_gif_clamp(ditheredPixels[k+width*4+i]+(diff[i]*5/16), 0, 255); 
-                    ditheredPixels[k+width*4+4+i] = (unsigned char)jo_gif_clamp(ditheredPixels[k+width*4+4+i]+(diff[i]*1/16), 0, 255); 
+    unsigned char *indexedPixels = (unsigned char *)malloc(rsize);
+    if (!delta) {
+        jo_gif_map_pixels(gif, pal, gif->mapper, gif->dither, rgba, indexedPixels, width, height);
+    }
+    else {
+        unsigned char *rectPixels = (unsigned char *)malloc(rsize * 4);
+        for (int y = 0; y < rect[3]; ++y) {
+            memcpy(rectPixels + y * rect[2] * 4, rgba + ((rect[1] + y) * width + rect[0]) * 4, rect[2] * 4);
+        }
+        jo_gif_map_pixels(gif, pal, gif->mapper, gif->dither, rectPixels, indexedPixels, rect[2], rect[3], rect[0], rect[1]);
+        free(rectPixels);
+
+        // palettes never use index numColors (see jo_gif_start()), so it can be the transparent index
+        int transparent = gif->numColors;
+        for (int y = 0; y < rect[3]; ++y) {
+            const unsigned char *a = rgba + ((rect[1] + y) * width + rect[0]) * 4;
+            const unsigned char *b = prevRgba + ((rect[1] + y) * width + rect[0]) * 4;
+            unsigned char *dst = indexedPixels + y * rect[2];
+            for (int x = 0; x < rect[2]; ++x) {
+                if (a[x*4+0] == b[x*4+0] && a[x*4+1] == b[x*4+1] && a[x*4+2] == b[x*4+2]) {
+                    dst[x] = (unsigned char)transparent;
                 }
             }
         }
-        free(ditheredPixels);
+        fdata->transparentIndex = transparent;
     }
+    fdata->x = (short)rect[0];
+    fdata->y = (short)rect[1];
+    fdata->w = (short)rect[2];
+    fdata->h = (short)rect[3];
 
-    fdata->indexed_pixels.assign((char*)indexedPixels, size);
-
-    {
-        BufferStream bs(fdata->encoded_pixels);
-        jo_gif_lzw_encode(bs, indexedPixels, size);
-    }
+    jo_gif_lzw_encode(fdata->encoded_pixels, indexedPixels, rsize);
 
     free(indexedPixels);
 }
 
+// decode color indices of the frame (fdata->w x fdata->h) into indexed. returns false if encoded data is broken.
+bool jo_gif_decode_indices(const jo_gif_frame_t *fdata, unsigned char *indexed)
+{
+    int size = fdata->w * fdata->h;
+    int n = jo_gif_lzw_decode((const unsigned char*)fdata->encoded_pixels.ptr(), (int)fdata->encoded_pixels.size(), indexed, size);
+    if (n < size) {
+        memset(indexed + n, 0, size - n);
+        return false;
+    }
+    return true;
+}
 
-void jo_gif_decode(void *o_buf, jo_gif_frame_t *fdata, jo_gif_frame_t *palette_frame)
+// draw the frame onto o_buf (RGBA, gif->width x gif->height). delta frames must be drawn over their previous frame.
+// indexed is optional. it is the result of jo_gif_decode_indices(). the frame is decoded here if null.
+void jo_gif_decode(void *o_buf, jo_gif_t *gif, jo_gif_frame_t *fdata, const Buffer *palette_colors, const unsigned char *indexed = nullptr)
 {
-    // todo: decode lzw instead of using indexed pixels
-    int num_pixels = (int)fdata->indexed_pixels.size();
-    unsigned char *op = (unsigned char*)o_buf;
-    unsigned char *palette = (unsigned char*)&palette_frame->palette[0];
-    unsigned char *indexed = (unsigned char*)&fdata->indexed_pixels[0];
-    for (int i = 0; i < num_pixels; ++i)
+    const unsigned char *palette = (const unsigned char*)palette_colors->ptr();
+    unsigned char *tmp = nullptr;
+    if (!indexed) {
+        tmp = (unsigned char *)malloc(fdata->w * fdata->h);
+        jo_gif_decode_indices(fdata, tmp);
+        indexed = tmp;
+    }
+    for (int y = 0; y < fdata->h; ++y)
     {
-        int i4 = i * 4;
-        op[i4 + 0] = palette[indexed[i] * 3 + 0];
-        op[i4 + 1] = palette[indexed[i] * 3 + 1];
-        op[i4 + 2] = palette[indexed[i] * 3 + 2];
-        op[i4 + 3] = 255;
+        unsigned char *op = (unsigned char*)o_buf + ((fdata->y + y) * gif->width + fdata->x) * 4;
+        const unsigned char *ip = indexed + y * fdata->w;
+        for (int x = 0; x < fdata->w; ++x)
+        {
+            int c = ip[x];
+            if (c == fdata->transparentIndex) { continue; }
+            op[x * 4 + 0] = palette[c * 3 + 0];
+            op[x * 4 + 1] = palette[c * 3 + 1];
+            op[x * 4 + 2] = palette[c * 3 + 2];
+            op[x * 4 + 3] = 255;
+        }
     }
+    free(tmp);
+}
+
+// re-encode a decoded image as an opaque full frame with the given palette (no dithering).
+// used to make a delta frame self-contained when its previous frames are not written or are gone.
+// palette of fdata is not modified.
+void jo_gif_frame_full(jo_gif_t *gif, jo_gif_frame_t *fdata, const unsigned char *rgba, const jo_gif_palette_t *pal)
+{
+    int size = gif->width * gif->height;
+    unsigned char *indexedPixels = (unsigned char *)malloc(size);
+    // pixels are palette colors already. the approximate inverse map could turn them into other colors.
+    jo_gif_map_pixels(gif, pal, jo_gif_mapper_exact, jo_gif_dither_none, rgba, indexedPixels, gif->width, gif->height);
+    fdata->encoded_pixels.clear();
+    jo_gif_lzw_encode(fdata->encoded_pixels, indexedPixels, size);
+    fdata->x = fdata->y = 0;
+    fdata->w = gif->width;
+    fdata->h = gif->height;
+    fdata->transparentIndex = -1;
+
+    free(indexedPixels);
 }
 
 
-void jo_gif_end(jo_gif_t *)
+void jo_gif_end(jo_gif_t *gif)
 {
+    jo_gif_palette_release(&gif->palette);
 }
 
 
@@ -406,16 +1178,14 @@ void jo_gif_write_header(BinaryStream &os, jo_gif_t *gif)
 }
 
 
-void jo_gif_write_frame(BinaryStream &os, jo_gif_t *gif, jo_gif_frame_t *fdata, jo_gif_frame_t *palette_optional, int frame, short delayCsec)
+// palette_optional: global color table if frame is 0, otherwise local color table instead of fdata->palette
+void jo_gif_write_frame(BinaryStream &os, jo_gif_t *gif, jo_gif_frame_t *fdata, const Buffer *palette_optional, int frame, short delayCsec)
 {
-    short width = gif->width;
-    short height = gif->height;
-    // int size = width * height;
-    unsigned char *palette = nullptr;
+    const unsigned char *palette = nullptr;
     int palette_size = 0;
     if (palette_optional != nullptr) {
-        palette = (unsigned char*)&palette_optional->palette[0];
-        palette_size = (int)palette_optional->palette.size();
+        palette = (const unsigned char*)palette_optional->ptr();
+        palette_size = (int)palette_optional->size();
     }
     else {
         palette = fdata->palette.empty() ? nullptr : (unsigned char*)&fdata->palette[0];
@@ -433,13 +1203,18 @@ void jo_gif_write_frame(BinaryStream &os, jo_gif_t *gif, jo_gif_frame_t *fdata,
         }
     }
     // Graphic Control Extension
-    os.write("\x21\xf9\x04\x00", 4);
+    // disposal method 1 (do not dispose) in delta mode so that delta frames are drawn over the previous frame
+    os.write("\x21\xf9\x04", 3);
+    os << uint8_t((gif->delta ? 0x04 : 0x00) | (fdata->isDelta() ? 0x01 : 0x00));
     os.write((char*)&delayCsec, 2); // delayCsec x 1/100 sec
-    os.write("\x00\x00", 2); // transparent color index (first byte), currently unused
+    os << uint8_t(fdata->isDelta() ? fdata->transparentIndex : 0); // transparent color index
+    os << uint8_t(0); // block terminator
     // Image Descriptor
-    os.write("\x2c\x00\x00\x00\x00", 5); // header, x,y
-    os.write((char*)&width, 2);
-    os.write((char*)&height, 2);
+    os << uint8_t(0x2c);
+    os.write((char*)&fdata->x, 2);
+    os.write((char*)&fdata->y, 2);
+    os.write((char*)&fdata->w, 2);
+    os.write((char*)&fdata->h, 2);
     if (frame == 0 || !palette) {
         os << uint8_t(0);
     }